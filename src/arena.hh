@@ -0,0 +1,97 @@
+// -*-c++-*-
+/* libpixie monotonic arena for the data of one batch of events */
+
+#ifndef LIBPIXIE_ARENA_H
+#define LIBPIXIE_ARENA_H
+
+#include <memory_resource>
+#include <vector>
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <new>
+
+namespace PIXIE {
+  /* Hands out memory by moving a pointer through large blocks and never
+     frees anything on its own; reset() starts again from the first block
+     once everything allocated from it is dead.  Unlike
+     std::pmr::monotonic_buffer_resource the blocks are kept, so after the
+     first few batches a batch takes nothing from the heap: upstream
+     counts the blocks allocated, allocations the requests served. */
+  class Arena : public std::pmr::memory_resource {
+  private:
+    struct Block {
+      char *data;
+      size_t size;
+    };
+    std::vector<Block> blocks;
+    size_t current;   //block being carved
+    size_t used;      //bytes of it handed out
+    size_t blockSize;
+
+  public:
+    long long allocations;
+    long long upstream;
+
+  public:
+    explicit Arena(size_t size = 1<<20) : current(0), used(0), blockSize(size), allocations(0), upstream(0) {}
+    Arena(const Arena&) = delete;
+    Arena &operator=(const Arena&) = delete;
+    ~Arena() {
+      for (auto &block : blocks) {
+        std::free(block.data);
+      }
+    }
+
+    //everything allocated so far must be dead
+    void reset() {
+      current = 0;
+      used = 0;
+    }
+
+    size_t capacity() const {
+      size_t total = 0;
+      for (auto &block : blocks) {
+        total += block.size;
+      }
+      return total;
+    }
+
+  protected:
+    void *do_allocate(size_t bytes, size_t alignment) {
+      ++allocations;
+      while (current < blocks.size()) {
+        Block &block = blocks[current];
+        uintptr_t base = reinterpret_cast<uintptr_t>(block.data);
+        size_t start = ((base + used + alignment - 1) & ~(alignment - 1)) - base;
+        if (start + bytes <= block.size) {
+          used = start + bytes;
+          return block.data + start;
+        }
+        ++current;
+        used = 0;
+      }
+      //a new block, aligned for anything the request could need
+      size_t align = std::max(alignment, alignof(std::max_align_t));
+      size_t size = (std::max(blockSize, bytes) + align - 1) & ~(align - 1);
+      char *data = static_cast<char*>(std::aligned_alloc(align, size));
+      if (!data) {
+        throw std::bad_alloc();
+      }
+      ++upstream;
+      blocks.push_back({data, size});
+      current = blocks.size() - 1;
+      used = bytes;
+      return data;
+    }
+    void do_deallocate(void *p, size_t bytes, size_t alignment) {
+      //monotonic, freed by reset()
+    }
+    bool do_is_equal(const std::pmr::memory_resource &other) const noexcept {
+      return this == &other;
+    }
+  };
+} // namespace PIXIE
+
+#endif //LIBPIXIE_ARENA_H
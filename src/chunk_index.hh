@@ -0,0 +1,66 @@
+// -*-c++-*-
+/* Reading RawTree in time order.  pixie2root hands chunks of the listmode
+   file to its threads as they become free, so entries from a later chunk
+   can be written before those of an earlier one: in each out.root_i with
+   -k, and in the merged file with --merge.  The ChunkIndex tree next to
+   RawTree records which entries came from which chunk; walking RawTree
+   through it gives the events back in file order. */
+
+#ifndef PIXIE2ROOT_CHUNK_INDEX_H
+#define PIXIE2ROOT_CHUNK_INDEX_H
+
+#include <vector>
+#include <algorithm>
+
+#include <TFile.h>
+#include <TTree.h>
+
+class ChunkOrder {
+  struct Range {
+    Int_t chunk;
+    Long64_t first;
+    Long64_t entries;
+  };
+  std::vector<Range> ranges;
+  size_t range;
+  Long64_t entry;
+
+public:
+  //a file without ChunkIndex (single chunk, older pixie2root) is read straight through
+  ChunkOrder(TFile *file, Long64_t nEntries) : range(0), entry(0) {
+    TTree *index = (TTree*)file->Get("ChunkIndex");
+    if (!index) {
+      ranges.push_back({0, 0, nEntries});
+      return;
+    }
+    Range row;
+    index -> SetBranchAddress("chunk", &row.chunk);
+    index -> SetBranchAddress("firstEntry", &row.first);
+    index -> SetBranchAddress("entries", &row.entries);
+    for (Long64_t i=0; i<index->GetEntries(); ++i) {
+      index -> GetEntry(i);
+      if (row.entries > 0) {
+        ranges.push_back(row);
+      }
+    }
+    index -> ResetBranchAddresses();
+    //a merged chunk has a row per segment
+    std::sort(ranges.begin(), ranges.end(), [](const Range &a, const Range &b) {
+        return a.chunk < b.chunk || (a.chunk == b.chunk && a.first < b.first);
+      });
+  }
+
+  //the next RawTree entry in time order, -1 after the last
+  Long64_t Next() {
+    while (range < ranges.size() && entry >= ranges[range].entries) {
+      range += 1;
+      entry = 0;
+    }
+    if (range == ranges.size()) {
+      return -1;
+    }
+    return ranges[range].first + entry++;
+  }
+};
+
+#endif //PIXIE2ROOT_CHUNK_INDEX_H
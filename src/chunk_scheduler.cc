@@ -0,0 +1,55 @@
+/* libpixie chunk scheduler */
+
+#include "chunk_scheduler.hh"
+
+namespace PIXIE {
+  ChunkScheduler::ChunkScheduler(const std::vector<off_t> &chunkOffsets, int nThreads)
+    : offsets(chunkOffsets), ranges(nThreads) {
+    //deal out contiguous runs of chunks so each thread starts with neighbouring data
+    uint32_t nChunks = offsets.size();
+    for (int i=0; i<nThreads; ++i) {
+      ranges[i].bounds = pack((uint64_t)nChunks*i/nThreads, (uint64_t)nChunks*(i+1)/nThreads);
+    }
+  }
+
+  void ChunkScheduler::make_chunk(uint32_t seq, Chunk &chunk) const {
+    chunk.seq = seq;
+    chunk.begin = offsets[seq];
+    chunk.end = seq+1 < offsets.size() ? offsets[seq+1] : -1;
+  }
+
+  int ChunkScheduler::next(int thread, Chunk &chunk) {
+    std::atomic<uint64_t> &own = ranges[thread].bounds;
+    uint64_t bounds = own.load();
+    while (first(bounds) < last(bounds)) {
+      if (own.compare_exchange_weak(bounds, pack(first(bounds)+1, last(bounds)))) {
+        make_chunk(first(bounds), chunk);
+        return 0;
+      }
+    }
+
+    //our range is empty: nobody steals from it, so it's ours to overwrite
+    while (true) {
+      int victim = -1;
+      uint32_t most = 0;
+      uint64_t victimBounds = 0;
+      for (int i=0; i<ranges.size(); ++i) {
+        uint64_t b = ranges[i].bounds.load();
+        if (i != thread && last(b) > first(b) && last(b) - first(b) > most) {
+          victim = i;
+          most = last(b) - first(b);
+          victimBounds = b;
+        }
+      }
+      if (victim < 0) {
+        return -1;
+      }
+      uint32_t split = last(victimBounds) - (most+1)/2;
+      if (ranges[victim].bounds.compare_exchange_strong(victimBounds, pack(first(victimBounds), split))) {
+        own.store(pack(split+1, last(victimBounds)));
+        make_chunk(split, chunk);
+        return 1;
+      }
+    }
+  }
+}
@@ -0,0 +1,53 @@
+// -*-c++-*-
+/* libpixie chunk scheduler: hands out pieces of the listmode file to threads */
+
+#ifndef LIBPIXIE_CHUNK_SCHEDULER_H
+#define LIBPIXIE_CHUNK_SCHEDULER_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+namespace PIXIE {
+  /* The file is cut into chunks [offsets[i], offsets[i+1]) that end on
+     coincidence gaps (see PreReader), so each can be sorted on its own.
+     Every thread owns a contiguous range of chunk numbers, packed as
+     begin<<32 | end in one atomic word.  The owner takes chunks from the
+     front of its range; a thread that runs dry steals the back half of
+     the fullest range.  Both update the range with a single
+     compare-and-swap, so no locks are taken.  A range never returns to a
+     value it had before (its first chunk has been taken or it has shrunk
+     from the back for good), so the CAS can't be fooled by ABA. */
+  class ChunkScheduler {
+  public:
+    struct Chunk {
+      int seq;      //position of the chunk in the file, for ordering output
+      off_t begin;
+      off_t end;    //<0 = to the end of the file
+    };
+
+  private:
+    struct alignas(64) Range {
+      std::atomic<uint64_t> bounds;
+    };
+
+    std::vector<off_t> offsets;
+    std::vector<Range> ranges;
+
+    static uint64_t pack(uint32_t begin, uint32_t end) { return ((uint64_t)begin<<32) | end; }
+    static uint32_t first(uint64_t bounds) { return bounds>>32; }
+    static uint32_t last(uint64_t bounds) { return bounds & 0xFFFFFFFF; }
+
+    void make_chunk(uint32_t seq, Chunk &chunk) const;
+
+  public:
+    ChunkScheduler(const std::vector<off_t> &chunkOffsets, int nThreads);
+
+    //0 = own chunk, 1 = stolen chunk, -1 = nothing left
+    int next(int thread, Chunk &chunk);
+    int size() const { return offsets.size(); }
+  };
+}
+
+#endif //LIBPIXIE_CHUNK_SCHEDULER_H
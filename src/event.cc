@@ -9,76 +9,300 @@
 
 namespace PIXIE
 {
+  namespace {
+    //stdio has to read the next record and seek back if it isn't wanted,
+    //Sources only peek at it and commit once it joins the event
+    off_t tell(FILE *fpr) { return ftello(fpr); }
+    off_t tell(Source &src) { return src.offset(); }
+    int peek(FILE *fpr, Measurement &meas, Experiment_Definition &definition) { return meas.read(fpr, definition); }
+    int peek(Source &src, Measurement &meas, Experiment_Definition &definition) { return meas.read(src, definition, NULL, false); }
+    void commit(FILE *fpr, const Measurement &meas) { }
+    void commit(Source &src, const Measurement &meas) { src.commit(meas.eventLength); }
+    void restore(FILE *fpr, off_t pos) { fseeko(fpr, pos, SEEK_SET); }
+    void restore(Source &src, off_t pos) { }
+
+    //a Source with decoded headers ahead of its cursor, committed a record at a time
+    struct Batched {
+      Source &src;
+      HeaderBatch &batch;
+      off_t limit;
+      bool fromBatch; //the record last peeked at
+    };
+    off_t tell(Batched &in) { return in.src.offset(); }
+    int peek(Batched &in, Measurement &meas, Experiment_Definition &definition) {
+      in.fromBatch = !in.batch.empty() || in.batch.fill(in.src, in.limit);
+      if (!in.fromBatch) {
+        return meas.read(in.src, definition, NULL, false);
+      }
+      in.batch.get(meas);
+      return 0;
+    }
+    void commit(Batched &in, const Measurement &meas) {
+      if (in.fromBatch) {
+        in.batch.pop();
+      }
+      in.src.commit(meas.eventLength);
+    }
+    void restore(Batched &in, off_t pos) { }
+
+    //another input's records, passed through a reorder buffer into time order
+    template <typename Input>
+    struct Reordered {
+      Input &in;
+      ReorderBuffer &buffer;
+      off_t limit;
+      bool deferTraces;
+    };
+    template <typename Input>
+    off_t tell(Reordered<Input> &in) { return tell(in.in) - in.buffer.bytes(); }
+    template <typename Input>
+    int peek(Reordered<Input> &in, Measurement &meas, Experiment_Definition &definition) {
+      //read ahead until the earliest record held can't be overtaken any more
+      bool draining = false;
+      while (!in.buffer.ready(draining)) {
+        if (draining) {
+          return -1;
+        }
+        if (in.limit > 0 && tell(in.in) >= in.limit) {
+          draining = true;
+          continue;
+        }
+        Measurement &next = in.buffer.slot();
+        next.deferTrace = in.deferTraces;
+        if (peek(in.in, next, definition) == -1) {
+          draining = true;
+          continue;
+        }
+        commit(in.in, next);
+        in.buffer.push();
+      }
+      meas = in.buffer.top();
+      return 0;
+    }
+    template <typename Input>
+    void commit(Reordered<Input> &in, const Measurement &meas) { in.buffer.pop(); }
+    template <typename Input>
+    void restore(Reordered<Input> &in, off_t pos) { }
+
+    /* Where an event ends, one policy per Event::Mode.  open() is given
+       the hit the event starts with, add() each one that joins it,
+       returning a time before which the hits already in are dropped
+       (0 = none), and a hit that accepts() turns down closes it.
+       triggered() says the event is wanted as it is. */
+    struct Rolling {
+      uint64_t window;
+      uint64_t end;
+      explicit Rolling(uint64_t w) : window(w), end(0) {}
+      void open(const Measurement &meas, bool trigger) { end = meas.eventTime + window; }
+      bool accepts(const Measurement &meas) const { return meas.eventTime <= end; }
+      uint64_t add(const Measurement &meas, bool trigger) {
+        end = meas.eventTime + window;
+        return 0;
+      }
+      bool triggered() const { return true; }
+    };
+    struct FixedWindow {
+      uint64_t window;
+      uint64_t end;
+      explicit FixedWindow(uint64_t w) : window(w), end(0) {}
+      void open(const Measurement &meas, bool trigger) { end = meas.eventTime + window; }
+      bool accepts(const Measurement &meas) const { return meas.eventTime <= end; }
+      uint64_t add(const Measurement &meas, bool trigger) { return 0; }
+      bool triggered() const { return true; }
+    };
+    //until a trigger comes only the last window of hits is kept, as they could be before it
+    struct TriggerCentred {
+      uint64_t window;
+      uint64_t end;
+      bool trig;
+      explicit TriggerCentred(uint64_t w) : window(w), end(0), trig(false) {}
+      void open(const Measurement &meas, bool trigger) {
+        trig = trigger;
+        end = meas.eventTime + window;
+      }
+      bool accepts(const Measurement &meas) const { return !trig || meas.eventTime <= end; }
+      uint64_t add(const Measurement &meas, bool trigger) {
+        if (trig) {
+          return 0;
+        }
+        if (trigger) {
+          trig = true;
+          end = meas.eventTime + window;
+        }
+        return meas.eventTime > window ? meas.eventTime - window : 0;
+      }
+      bool triggered() const { return trig; }
+    };
+
+    //keeps the record that ends an event for the next one, rather than reading it again
+    template <typename Input>
+    void hold(Input &in, const Measurement &meas, Measurement *lookahead) {
+      if (lookahead) {
+        commit(in, meas);
+        *lookahead = meas;
+      }
+    }
+  }
+
   int Event::read(FILE *fpr,
                   Experiment_Definition &definition,
                   int coincWindow,
                   off_t max_offset,
-                  bool warnings) {
+                  bool warnings,
+                  Measurement *lookahead,
+                  ReorderBuffer *reorder) {
+    if (reorder) {
+      Reordered<FILE*> in = {fpr, *reorder, max_offset, deferTraces};
+      return build(in, definition, coincWindow, max_offset, warnings, lookahead);
+    }
+    return build(fpr, definition, coincWindow, max_offset, warnings, lookahead);
+  }
 
-    fpos_t pos;
-    Measurement meas;
-    int retval = meas.read(fpr, definition);
-    if (retval == -1) {
-      return 1; //end of file return
+  int Event::read(Source &src,
+                  Experiment_Definition &definition,
+                  int coincWindow,
+                  off_t max_offset,
+                  bool warnings,
+                  Measurement *lookahead,
+                  ReorderBuffer *reorder) {
+    if (reorder) {
+      Reordered<Source> in = {src, *reorder, max_offset, deferTraces};
+      return build(in, definition, coincWindow, max_offset, warnings, lookahead);
+    }
+    return build(src, definition, coincWindow, max_offset, warnings, lookahead);
+  }
+
+  int Event::read(Source &src,
+                  HeaderBatch &batch,
+                  Experiment_Definition &definition,
+                  int coincWindow,
+                  off_t max_offset,
+                  bool warnings,
+                  Measurement *lookahead,
+                  ReorderBuffer *reorder) {
+    Batched in = {src, batch, max_offset, false};
+    if (reorder) {
+      Reordered<Batched> reordered = {in, *reorder, max_offset, deferTraces};
+      return build(reordered, definition, coincWindow, max_offset, warnings, lookahead);
+    }
+    return build(in, definition, coincWindow, max_offset, warnings, lookahead);
+  }
+
+  template <typename Input>
+  int Event::build(Input &in,
+                   Experiment_Definition &definition,
+                   int coincWindow,
+                   off_t max_offset,
+                   bool warnings,
+                   Measurement *lookahead) {
+    switch (mode) {
+    case kFixedWindow:
+      return group(in, definition, FixedWindow(coincWindow), max_offset, warnings, lookahead);
+    case kTrigger:
+      return group(in, definition, TriggerCentred(coincWindow), max_offset, warnings, lookahead);
+    default:
+      return group(in, definition, Rolling(coincWindow), max_offset, warnings, lookahead);
+    }
+  }
+
+  template <typename Input, typename Window>
+  int Event::group(Input &in,
+                   Experiment_Definition &definition,
+                   Window window,
+                   off_t max_offset,
+                   bool warnings,
+                   Measurement *lookahead) {
+
+    //every record decoded, and every trace processed, on the way
+    auto decoded = [&](const Measurement &m) {
+      ++decodes;
+      if (m.eventLength > m.headerLength && (definition.Lookup(m.crateID, m.slotID, m.channelNumber).flags & Experiment_Definition::ChannelInfo::kTraces)) {
+        ++traces;
+      }
+    };
+    auto trigger = [&](const Measurement &m) {
+      return (definition.Lookup(m.crateID, m.slotID, m.channelNumber).flags & Experiment_Definition::ChannelInfo::kTrigger) != 0;
+    };
+
+    off_t pos = 0;
+    int retval = 0;
+    //measurements and their traces go where this event's are kept
+    std::pmr::memory_resource *resource = fMeasurements.get_allocator().resource();
+    Measurement meas(resource);
+    meas.deferTrace = deferTraces;
+    if (lookahead && lookahead->headerLength) {
+      //the record that closed the last event opens this one, already decoded
+      meas = *lookahead;
+      lookahead->headerLength = 0;
+    }
+    else {
+      retval = peek(in, meas, definition);
+      if (retval == -1) {
+        return 1; //end of file return
+      }
+      decoded(meas);
+      commit(in, meas);
     }
     
-    AddMeasurement(meas);
     int lastCrate = meas.crateID;
     int lastSlot = meas.slotID;
     int lastChan = meas.channelNumber;
     
-    uint64_t maxTime = meas.eventTime + coincWindow;
-    uint64_t triggerTime = meas.eventTime;
-
-    int mult = 1;
+    uint64_t lastTime = meas.eventTime;
+    window.open(meas, trigger(meas));
+    AddMeasurement(std::move(meas));
 
     int curEvent = 1;
     
     while (curEvent) {
       //loop for current event
-      fgetpos(fpr, &pos);          
+      pos = tell(in);
 
-      if (max_offset > 0 && ftello(fpr) >= max_offset) {
-        std::cout << max_offset << "   " << ftello(fpr) << std::endl;
+      if (max_offset > 0 && pos >= max_offset) {
+        std::cout << max_offset << "   " << pos << std::endl;
         retval = 1; //end of file return
         break;
       }
              
-      Measurement next_meas;
-      retval = next_meas.read(fpr, definition);
+      Measurement next_meas(resource);
+      next_meas.deferTrace = deferTraces;
+      retval = peek(in, next_meas, definition);
       if (retval == -1) {
         retval = 1;  //end of file
         break;
       }
+      decoded(next_meas);
              
       //   get event time, check if it's in the coincidence window
-      if (next_meas.eventTime<=maxTime) {
+      if (window.accepts(next_meas)) {
         //in current event
         //check for duplicate in same channel
-        if (GetMeasurement(next_meas.crateID, next_meas.slotID, next_meas.channelNumber)) {
-          const Measurement *dup_meas = GetMeasurement(next_meas.crateID, next_meas.slotID, next_meas.channelNumber);
+        const Measurement *dup_meas = GetMeasurement(next_meas.crateID, next_meas.slotID, next_meas.channelNumber);
+        if (dup_meas && !window.triggered()) {
+          //nothing wants the earlier hit yet, start again after it
+          untriggered += DropMeasurements(dup_meas - fMeasurements.data() + 1);
+        }
+        else if (dup_meas) {
 	  
           if (warnings) {
             std::cout << ANSI_COLOR_RED << "Warning: Channel " << dup_meas->slotID << ":" << dup_meas->channelNumber << " already fired in this event, perhaps the coincidence window is too large?" ANSI_COLOR_RESET << std::endl;
             std::cout << ANSI_COLOR_RED << dup_meas->eventTime << " vs " << next_meas.eventTime << " :  " << (double)(-dup_meas->eventTime + next_meas.eventTime)/3276.8 << ANSI_COLOR_RESET << std::endl;
           }
           //if it's not a tagger, end this event and start another
-	  auto *channel = definition.GetChannel(next_meas.crateID, next_meas.slotID, next_meas.channelNumber);
-	  if(!channel->isTagger){
+	  if(!(definition.Lookup(next_meas.crateID, next_meas.slotID, next_meas.channelNumber).flags & Experiment_Definition::ChannelInfo::kTagger)){
 	    curEvent = 0;
 	    retval = 2; //end of event with same channel pileup
+	    hold(in, next_meas, lookahead);
 	    break;
 	  }
         }
                 
-        mult = mult + 1;
-		 
-        if (next_meas.eventTime<maxTime-coincWindow) {
+        if (next_meas.eventTime<lastTime) {
           std::cout<< ANSI_COLOR_RED "\nWarning! File is not properly time-sorted" << std::endl;
           std::cout<< "First event: "
 		   << lastCrate << "." 
 		   << lastSlot << "." 
-		   << lastChan << "   " << maxTime - coincWindow << std::endl;
+		   << lastChan << "   " << lastTime << std::endl;
 	  std::cout<< "Second event: "
 		   << next_meas.crateID << "."
 		   << next_meas.slotID << "."
@@ -86,24 +310,46 @@ namespace PIXIE
 
         }
                 
-        AddMeasurement(next_meas);
+        commit(in, next_meas);
 	lastCrate = next_meas.crateID;
 	lastSlot = next_meas.slotID;
 	lastChan = next_meas.channelNumber;
-        maxTime = next_meas.eventTime+coincWindow;
+        lastTime = next_meas.eventTime;
+        uint64_t before = window.add(next_meas, trigger(next_meas));
+        AddMeasurement(std::move(next_meas));
+        size_t stale = 0;
+        while (stale < fMeasurements.size() && fMeasurements[stale].eventTime < before) {
+          ++stale;
+        }
+        if (stale) {
+          untriggered += DropMeasurements(stale);
+        }
         //go to next sub-event
       }
       else {
         curEvent=0; //breaks current event loop
+        hold(in, next_meas, lookahead);
       }
     }//loop for current event
 
+    //the input ran out before a trigger came
+    if (!window.triggered()) {
+      untriggered += DropMeasurements(fMeasurements.size());
+      if (!lookahead) {
+        restore(in, pos);
+      }
+      return 1;
+    }
+
     // increment multiplicity count
+    size_t mult = fMeasurements.size();
     if ( mult < 5 ) {
       this->mults[mult-1] = this->mults[mult-1] + 1;
     } 
-    //set read position back to start of current sub-event
-    fsetpos(fpr, &pos);
+    //set read position back to start of current sub-event (if we read past it and didn't keep it)
+    if (!lookahead) {
+      restore(in, pos);
+    }
 
     return 0;
   }
@@ -5,35 +5,125 @@
 #define LIBPIXIE_EVENT_H
 
 #include <vector>
+#include <algorithm>
+#include <utility>
+#include <memory_resource>
 
 #include "experiment_definition.hh"
+#include "header_batch.hh"
 #include "measurement.hh"
+#include "reorder_buffer.hh"
+#include "source.hh"
 #include "traces.hh"
 
 namespace PIXIE {
+  /* Where each channel's first hit is in an event, by the 12-bit ID
+     crate<<8 | slot<<4 | channel.  An entry only counts if it carries
+     the current generation, so emptying the table is one increment.  It
+     is scratch space for building: a copied or moved Event starts
+     without one (untracked) and searches its hits instead, until it is
+     cleared. */
+  class ChannelSlots {
+  private:
+    std::vector<uint32_t> stamp;
+    std::vector<uint32_t> position;
+    uint32_t generation;
+
+  public:
+    bool tracking; //every hit of the event is in the table
+
+    ChannelSlots() : generation(1), tracking(true) {}
+    ChannelSlots(const ChannelSlots &other) : generation(1), tracking(false) {}
+    ChannelSlots &operator=(const ChannelSlots &other) {
+      tracking = false;
+      return *this;
+    }
+
+    void clear() {
+      if (++generation == 0) {
+        std::fill(stamp.begin(), stamp.end(), 0);
+        generation = 1;
+      }
+      tracking = true;
+    }
+    //position of the channel's first hit, -1 = none
+    long find(uint32_t id) const {
+      return (!stamp.empty() && stamp[id] == generation) ? (long)position[id] : -1;
+    }
+    void add(uint32_t id, size_t pos) {
+      if (stamp.empty()) {
+        stamp.assign(4096, 0);
+        position.assign(4096, 0);
+      }
+      if (stamp[id] != generation) {
+        stamp[id] = generation;
+        position[id] = pos;
+      }
+    }
+  };
+
   class Event {
   public:
-    std::vector<Measurement> fMeasurements;
+    /* How far an event reaches: rolling, each hit extends it by the
+       coincidence window (events can chain without end at high rates);
+       fixed window, the window from its first hit; trigger, the window
+       either side of its first hit in a trigger channel, hits with no
+       trigger that near being dropped. */
+    enum Mode { kRolling, kFixedWindow, kTrigger };
+
+    std::pmr::vector<Measurement> fMeasurements; //and their traces, in the memory the Event was made with
 
     long long pileups;
     long long badcfd;
     long long outofrange;
     long long mults[4];
+    long long decodes; //records decoded while building, counting ones read again
+    long long traces;  //of which with a trace processed (or kept for processing)
+    long long untriggered; //hits dropped in trigger mode
+
+    bool deferTraces; //leave trace samples in the measurements for later processing
+    Mode mode;
+
+  private:
+    ChannelSlots channels; //for same-channel pileup, O(1) however many hits
 
   public:
-    Event() :  //initialise counters to zero
+    explicit Event(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :  //initialise counters to zero
+      fMeasurements(resource),
       pileups(0),
       badcfd(0),
-      outofrange(0)
+      outofrange(0),
+      decodes(0),
+      traces(0),
+      untriggered(0),
+      deferTraces(false),
+      mode(kRolling)
     {
       mults[0] = 0;
       mults[1] = 0;
       mults[2] = 0;
       mults[3] = 0;      
     }
+  public:
     int print();
+    //empty for reuse, keeping the capacity
+    void clear() {
+      fMeasurements.clear();
+      channels.clear();
+      pileups = 0;
+      badcfd = 0;
+      outofrange = 0;
+      decodes = 0;
+      traces = 0;
+      untriggered = 0;
+      std::fill(mults, mults + 4, 0);
+    }
+    //as clear(), also giving up the storage, before the memory it is in is reused
+    void release() {
+      std::pmr::vector<Measurement>(fMeasurements.get_allocator()).swap(fMeasurements);
+      clear();
+    }
     int AddMeasurement(Measurement meas) {
-      fMeasurements.push_back(meas);
       //increment counters
       if (meas.finishCode == 1) {
         ++pileups;
@@ -41,17 +131,95 @@ namespace PIXIE {
 
       badcfd += meas.CFDForce;
       outofrange += meas.outOfRange;
-      
+
+      if (channels.tracking) {
+        channels.add(id(meas.crateID, meas.slotID, meas.channelNumber), fMeasurements.size());
+      }
+      fMeasurements.push_back(std::move(meas));
       return 0;
     }
+    //removes the first n hits and what AddMeasurement counted for them
+    size_t DropMeasurements(size_t n) {
+      for (size_t i=0; i<n; ++i) {
+        const Measurement &meas = fMeasurements[i];
+        if (meas.finishCode == 1) {
+          --pileups;
+        }
+        badcfd -= meas.CFDForce;
+        outofrange -= meas.outOfRange;
+      }
+      fMeasurements.erase(fMeasurements.begin(), fMeasurements.begin() + n);
+      if (channels.tracking) {
+        channels.clear();
+        for (size_t pos=0; pos<fMeasurements.size(); ++pos) {
+          const Measurement &meas = fMeasurements[pos];
+          channels.add(id(meas.crateID, meas.slotID, meas.channelNumber), pos);
+        }
+      }
+      return n;
+    }
+    /* Each builds one event from the records at the cursor.  Without
+       lookahead the record after the event is read again by the next
+       call; with it, that record is consumed and kept in *lookahead
+       (headerLength 0 = none), and the next call starts from it, so
+       every record is decoded and its trace processed exactly once.
+       With a reorder buffer the records are taken from it in time order,
+       refilling it from the input, rather than as they are in the file.
+       Where the event ends is up to mode. */
     int read(FILE *fpr,
              Experiment_Definition &definition,
              int coincWindow,
              off_t max_offset,
-             bool warnings);
+             bool warnings,
+             Measurement *lookahead = NULL,
+             ReorderBuffer *reorder = NULL);
+    int read(Source &src,
+             Experiment_Definition &definition,
+             int coincWindow,
+             off_t max_offset,
+             bool warnings,
+             Measurement *lookahead = NULL,
+             ReorderBuffer *reorder = NULL);
+    //as above, taking runs of plain 4-word records from batch, refilled from src
+    int read(Source &src,
+             HeaderBatch &batch,
+             Experiment_Definition &definition,
+             int coincWindow,
+             off_t max_offset,
+             bool warnings,
+             Measurement *lookahead = NULL,
+             ReorderBuffer *reorder = NULL);
+
+  private:
+    //picks the Window policy for mode
+    template <typename Input>
+    int build(Input &in,
+              Experiment_Definition &definition,
+              int coincWindow,
+              off_t max_offset,
+              bool warnings,
+              Measurement *lookahead);
+    template <typename Input, typename Window>
+    int group(Input &in,
+              Experiment_Definition &definition,
+              Window window,
+              off_t max_offset,
+              bool warnings,
+              Measurement *lookahead);
+
+  public:
     
+    static uint32_t id(int crateID, int slotID, int channelNumber) {
+      return ((crateID & 0xF)<<8) | ((slotID & 0xF)<<4) | (channelNumber & 0xF);
+    }
+
+    //the channel's first hit in the event
     const Measurement *GetMeasurement(int crateID, int slotID, int channelNumber) const
     {
+      if (channels.tracking) {
+        long pos = channels.find(id(crateID, slotID, channelNumber));
+        return (pos < 0 ? NULL : &fMeasurements[pos]);
+      }
       for (const Measurement &meas : fMeasurements) {
         if (meas.crateID == crateID &&
             meas.slotID == slotID &&
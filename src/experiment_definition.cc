@@ -7,8 +7,10 @@
 #include <fstream>
 #include <iostream>
 #include <algorithm>
+#include <cmath>
 
 #include "experiment_definition.hh"
+#include "measurement.hh"
 #include "trace_algorithms.hh"
 
 namespace PIXIE
@@ -102,6 +104,45 @@ namespace PIXIE
           }
           break;
         }
+      case 'R':
+        {
+          //an already defined channel that opens events in trigger mode
+          ss.clear();
+          ss.str(line);
+
+          char flag;
+          int crateID;
+          int slotID;
+          int channelNumber;
+          ss >> flag >> crateID >> slotID >> channelNumber;
+          Channel *channel = this->GetChannel(crateID, slotID, channelNumber);
+          if (!channel) {
+            std::cout << "Caution: trigger channel " << crateID << "." << slotID << "." << channelNumber << " is not defined, ignored" << std::endl;
+            break;
+          }
+          channel->isTrigger = true;
+          break;
+        }
+      case 'O':
+        {
+          //time offset (ns) of an already defined channel
+          ss.clear();
+          ss.str(line);
+
+          char flag;
+          int crateID;
+          int slotID;
+          int channelNumber;
+          double offset = 0;
+          ss >> flag >> crateID >> slotID >> channelNumber >> offset;
+          Channel *channel = this->GetChannel(crateID, slotID, channelNumber);
+          if (!channel) {
+            std::cout << "Caution: time offset for channel " << crateID << "." << slotID << "." << channelNumber << " which is not defined, ignored" << std::endl;
+            break;
+          }
+          channel->timeOffset = offset;
+          break;
+        }
       case 'C':
         break;
       }
@@ -111,9 +152,53 @@ namespace PIXIE
     std::cout << "Setting algorithms" << std::endl;
     int nalgs = set_algorithms();
     std::cout << nalgs << " set" << std::endl;
+
+    compile();
     
     return (0);
   }//read_definition  
+
+  Experiment_Definition::ChannelInfo::ChannelInfo()
+    : channel(nullptr), freq(0), index(-1), flags(0), timeOffset(0), decoders(Measurement::decoders(-1)) {}
+
+  int Experiment_Definition::compile() {
+    channelTable.assign(4096, ChannelInfo());
+    int n_chans = 0;
+    int64_t earliest = 0;
+    int64_t latest = 0;
+    for (const auto &crate_it : crateMap) {
+      auto crate = crate_it.second;
+      for (const auto &slot_it : crate->slotMap) {
+        auto slot = slot_it.second;
+        for (const auto &channel_it : slot->channelMap) {
+          auto channel = channel_it.second;
+          if (crate->crateID < 0 || crate->crateID > 15 || slot->slotID < 0 || slot->slotID > 15 ||
+              channel->channelNumber < 0 || channel->channelNumber > 15) {
+            std::cout << "Caution: channel " << crate->crateID << "." << slot->slotID << "." << channel->channelNumber << " can't appear in a header, ignored" << std::endl;
+            continue;
+          }
+          ChannelInfo &info = channelTable[(crate->crateID<<8) | (slot->slotID<<4) | channel->channelNumber];
+          info.channel = channel;
+          info.freq = slot->freq;
+          info.decoders = Measurement::decoders(slot->freq);
+          info.flags = (channel->isTagger ? ChannelInfo::kTagger : 0) |
+                       (channel->eraw ? ChannelInfo::kERaw : 0) |
+                       (channel->qdcs ? ChannelInfo::kQDCs : 0) |
+                       (channel->traces ? ChannelInfo::kTraces : 0) |
+                       (channel->isTrigger ? ChannelInfo::kTrigger : 0);
+          const auto &list = channel->isTagger ? taggers : detectors;
+          auto pos = std::find(list.begin(), list.end(), channel);
+          info.index = pos == list.end() ? -1 : pos - list.begin();
+          info.timeOffset = std::llround(channel->timeOffset*3276.8); //ns to 10 ns/32768
+          earliest = std::min(earliest, info.timeOffset);
+          latest = std::max(latest, info.timeOffset);
+          ++n_chans;
+        }
+      }
+    }
+    offsetSpread = latest - earliest;
+    return n_chans;
+  }
   
 
   Experiment_Definition::Slot * Experiment_Definition::Crate::GetSlot(int slotID) const {
@@ -273,6 +358,8 @@ namespace PIXIE
           log << "    Channel " << channel->channelNumber;
           if (std::find(taggers.begin(), taggers.end(), channel)!=taggers.end())
             log << "    (Tagger)";
+          if (channel->isTrigger)
+            log << "    (Trigger)";
                 
           log << std::endl;
         }
@@ -297,6 +384,10 @@ namespace PIXIE
           if (channel->traces) { std::cout << "   Traces, (" << channel->algName << " \"" << channel->algFile << "\", ID="<<channel->algIndex<<")"; }
           if (std::find(taggers.begin(), taggers.end(), channel)!=taggers.end())
             std::cout << "    (Tagger)";
+          if (channel->isTrigger)
+            std::cout << "    (Trigger)";
+          if (channel->timeOffset != 0)
+            std::cout << "    Offset " << channel->timeOffset << " ns";
                 
           std::cout << std::endl;
         }
@@ -6,6 +6,7 @@
 #define LIBPIXIE_EXPERIMENT_DEFINITION_H
 
 
+#include <cstdint>
 #include <unordered_map>
 #include <set>
 #include <string>
@@ -16,6 +17,10 @@
 #include "traces.hh"
 
 namespace PIXIE {
+  class Measurement;
+  //decodes the header of one record, see Measurement::decoders
+  typedef void (*HeaderDecoder)(Measurement &meas, const uint32_t *words);
+
   class Experiment_Definition {
   public:    
     FILE *file;   //experimental definition, ASCII
@@ -33,6 +38,8 @@ namespace PIXIE {
       Trace::Algorithm *alg;
       std::string name;
       bool isTagger;
+      bool isTrigger; //opens events when building around triggers
+      double timeOffset; //ns added to the channel's times, for cable and electronics delays
       bool operator<(const Channel &other) const {return channelNumber < other.channelNumber; }
       bool operator==(const Channel &other) const { return !name.compare(other.name); }
       Channel(int crID,
@@ -55,7 +62,9 @@ namespace PIXIE {
         algFile(algF),
         algIndex(algI),
         alg(NULL),
-	isTagger(isTag){};
+	isTagger(isTag),
+        isTrigger(false),
+        timeOffset(0){};
     };
 
     struct Slot {
@@ -86,15 +95,33 @@ namespace PIXIE {
       int AddSlot(int slotID, int frequency);
     };
     
+    /* What the decoder and the writers need to know about a channel,
+       without walking the maps.  Entries are indexed by the 12-bit ID of
+       the first header word, crate<<8 | slot<<4 | channel */
+    struct ChannelInfo {
+      enum Flags : uint8_t { kTagger = 1, kERaw = 2, kQDCs = 4, kTraces = 8, kTrigger = 16 };
+
+      Channel *channel; //NULL = not in the definition
+      int freq;         //of the slot, MHz
+      int index;        //position in detectors, or in taggers if a tagger, -1 = neither
+      uint8_t flags;
+      int64_t timeOffset; //in Measurement::eventTime units (10 ns / 32768)
+      const HeaderDecoder *decoders; //for the slot's frequency, by header length
+      ChannelInfo();
+    };
+    
   public:    
     std::unordered_map<int, Crate*> crateMap;
     std::vector<Channel*> detectors;
     std::vector<Channel*> taggers;
+    std::vector<ChannelInfo> channelTable; //4096 entries, filled by compile()
+    uint64_t offsetSpread; //latest less earliest channel time offset, in eventTime units
 
   public:
-    Experiment_Definition() : file(NULL) {};
+    Experiment_Definition() : file(NULL), channelTable(4096), offsetSpread(0) {};
     int open(const std::string &path);
     int read();
+    int compile(); //fills channelTable, after read() or after adding channels by hand
     int close() { fclose(this->file); return 0; }
    
     int AddChannel(int crateID,
@@ -114,6 +141,12 @@ namespace PIXIE {
     Slot *GetSlot(int crateID, int slotID) const;
     Channel *GetChannel(int crateID, int slotID, int channelNumber) const;
 
+    //O(1), for the hot path; id is the first header word, only its low 12 bits are used
+    const ChannelInfo &Lookup(uint32_t id) const { return channelTable[id & 0xFFF]; }
+    const ChannelInfo &Lookup(int crateID, int slotID, int channelNumber) const {
+      return channelTable[((crateID & 0xF)<<8) | ((slotID & 0xF)<<4) | (channelNumber & 0xF)];
+    }
+
     int set_algorithms();
     
     int print();
@@ -0,0 +1,305 @@
+/* libpixie batch header decoder, with SSE2/AVX2 kernels chosen at run time */
+
+#include <algorithm>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+#include "header_batch.hh"
+
+namespace PIXIE {
+  namespace {
+    //header and event length both 4 (bits 12-30 of the first word)
+    const uint32_t kPlainMask = 0x7FFFF000;
+    const uint32_t kPlain     = (4<<12) | (4<<17);
+    const uint32_t kTraceMask = 0x7FFF0000; //trace length, fourth word
+
+    /* One record at a time, also used for the tail the vector kernels
+       leave.  Same arithmetic as Measurement::ProcessCFD. */
+    size_t decode_scalar(const uint32_t *words, size_t from, size_t n, const int32_t *frequencies, HeaderBatch &b) {
+      size_t i;
+      for (i=from; i<n; ++i) {
+        const uint32_t *w = words + 4*i;
+        if ((w[0] & kPlainMask) != kPlain || (w[3] & kTraceMask)) {
+          break;
+        }
+        int32_t freq = frequencies[w[0] & 0xFFF];
+        if (!freq) {
+          break;
+        }
+        uint32_t force = w[2] >> 31;
+        int32_t frac;
+        if (freq == 100) {
+          frac = (w[2] >> 16) & 0x7FFF;
+        }
+        else if (freq == 250) {
+          frac = force ? 16384 : static_cast<int32_t>((w[2] >> 16) & 0x3FFF) - 16384*static_cast<int32_t>((w[2] >> 30) & 1);
+        }
+        else {
+          int32_t source = w[2] >> 29;
+          force = source == 7;
+          frac = force ? 40960*4/5 : (static_cast<int32_t>((w[2] >> 16) & 0x1FFF) + 8192*(source-1))*4/5;
+        }
+        b.id[i]        = w[0] & 0xFFF;
+        b.timeLow[i]   = w[1];
+        b.timeHigh[i]  = w[2] & 0xFFFF;
+        b.cfd[i]       = frac;
+        b.frequency[i] = freq;
+        b.energy[i]    = w[3] & 0xFFFF;
+        b.flags[i]     = (w[0] >> 31) | (force << 1) | ((w[3] >> 31) << 2);
+      }
+      return i;
+    }
+
+#if defined(__x86_64__)
+    /* Four records per step: a 4x4 transpose turns the records into one
+       register per header word, then every field is masks, shifts and
+       selects.  The 500 MHz *4/5 goes through float, exact at these
+       magnitudes and truncated like integer division. */
+    size_t decode_sse2(const uint32_t *words, size_t n, const int32_t *frequencies, HeaderBatch &b) {
+      const __m128i zero      = _mm_setzero_si128();
+      const __m128i one       = _mm_set1_epi32(1);
+      const __m128i plainMask = _mm_set1_epi32(kPlainMask);
+      const __m128i plain     = _mm_set1_epi32(kPlain);
+      const __m128i traceMask = _mm_set1_epi32(kTraceMask);
+      const __m128i low16     = _mm_set1_epi32(0xFFFF);
+
+      size_t i = 0;
+      for (; i+4 <= n; i += 4) {
+        const uint32_t *w = words + 4*i;
+        __m128 r0 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(w)));
+        __m128 r1 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(w + 4)));
+        __m128 r2 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(w + 8)));
+        __m128 r3 = _mm_castsi128_ps(_mm_loadu_si128((const __m128i*)(w + 12)));
+        _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+        __m128i w0 = _mm_castps_si128(r0), w1 = _mm_castps_si128(r1);
+        __m128i w2 = _mm_castps_si128(r2), w3 = _mm_castps_si128(r3);
+
+        __m128i id = _mm_and_si128(w0, _mm_set1_epi32(0xFFF));
+        __m128i freq = _mm_setr_epi32(frequencies[w[0] & 0xFFF], frequencies[w[4] & 0xFFF],
+                                      frequencies[w[8] & 0xFFF], frequencies[w[12] & 0xFFF]);
+        __m128i ok = _mm_and_si128(_mm_cmpeq_epi32(_mm_and_si128(w0, plainMask), plain),
+                                   _mm_cmpeq_epi32(_mm_and_si128(w3, traceMask), zero));
+        ok = _mm_andnot_si128(_mm_cmpeq_epi32(freq, zero), ok);
+
+        __m128i force = _mm_srli_epi32(w2, 31);
+        __m128i cfdTime = _mm_srli_epi32(w2, 16);
+        __m128i frac100 = _mm_and_si128(cfdTime, _mm_set1_epi32(0x7FFF));
+
+        __m128i frac250 = _mm_sub_epi32(_mm_and_si128(cfdTime, _mm_set1_epi32(0x3FFF)),
+                                        _mm_slli_epi32(_mm_and_si128(_mm_srli_epi32(w2, 30), one), 14));
+        __m128i forced = _mm_cmpeq_epi32(force, one);
+        frac250 = _mm_or_si128(_mm_and_si128(forced, _mm_set1_epi32(16384)), _mm_andnot_si128(forced, frac250));
+
+        __m128i source = _mm_srli_epi32(w2, 29);
+        __m128i force500 = _mm_cmpeq_epi32(source, _mm_set1_epi32(7));
+        __m128i x = _mm_slli_epi32(_mm_add_epi32(_mm_and_si128(cfdTime, _mm_set1_epi32(0x1FFF)),
+                                                 _mm_slli_epi32(_mm_sub_epi32(source, one), 13)), 2);
+        __m128i frac500 = _mm_cvttps_epi32(_mm_div_ps(_mm_cvtepi32_ps(x), _mm_set1_ps(5.0f)));
+        frac500 = _mm_or_si128(_mm_and_si128(force500, _mm_set1_epi32(40960*4/5)), _mm_andnot_si128(force500, frac500));
+
+        __m128i is250 = _mm_cmpeq_epi32(freq, _mm_set1_epi32(250));
+        __m128i is500 = _mm_cmpeq_epi32(freq, _mm_set1_epi32(500));
+        __m128i frac = _mm_or_si128(_mm_and_si128(is250, frac250), _mm_andnot_si128(is250, frac100));
+        frac = _mm_or_si128(_mm_and_si128(is500, frac500), _mm_andnot_si128(is500, frac));
+        force = _mm_or_si128(_mm_and_si128(is500, _mm_srli_epi32(force500, 31)), _mm_andnot_si128(is500, force));
+
+        __m128i flags = _mm_or_si128(_mm_srli_epi32(w0, 31),
+                                     _mm_or_si128(_mm_slli_epi32(force, 1), _mm_slli_epi32(_mm_srli_epi32(w3, 31), 2)));
+
+        _mm_storeu_si128((__m128i*)&b.id[i], id);
+        _mm_storeu_si128((__m128i*)&b.timeLow[i], w1);
+        _mm_storeu_si128((__m128i*)&b.timeHigh[i], _mm_and_si128(w2, low16));
+        _mm_storeu_si128((__m128i*)&b.cfd[i], frac);
+        _mm_storeu_si128((__m128i*)&b.frequency[i], freq);
+        _mm_storeu_si128((__m128i*)&b.energy[i], _mm_and_si128(w3, low16));
+        _mm_storeu_si128((__m128i*)&b.flags[i], flags);
+
+        int valid = _mm_movemask_ps(_mm_castsi128_ps(ok));
+        if (valid != 0xF) {
+          return i + __builtin_ctz(~valid); //what was stored past the run is never read
+        }
+      }
+      return decode_scalar(words, i, n, frequencies, b);
+    }
+
+    /* As decode_sse2 with eight records per step: the transpose works
+       within 128-bit lanes and a permute puts the records back in order,
+       and the frequencies come from one gather. */
+    __attribute__((target("avx2")))
+    size_t decode_avx2(const uint32_t *words, size_t n, const int32_t *frequencies, HeaderBatch &b) {
+      const __m256i zero      = _mm256_setzero_si256();
+      const __m256i one       = _mm256_set1_epi32(1);
+      const __m256i plainMask = _mm256_set1_epi32(kPlainMask);
+      const __m256i plain     = _mm256_set1_epi32(kPlain);
+      const __m256i traceMask = _mm256_set1_epi32(kTraceMask);
+      const __m256i low16     = _mm256_set1_epi32(0xFFFF);
+      const __m256i order     = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+      size_t i = 0;
+      for (; i+8 <= n; i += 8) {
+        const __m256i *w = (const __m256i*)(words + 4*i);
+        __m256i v0 = _mm256_loadu_si256(w);     //records 0 and 1
+        __m256i v1 = _mm256_loadu_si256(w + 1); //2 and 3
+        __m256i v2 = _mm256_loadu_si256(w + 2);
+        __m256i v3 = _mm256_loadu_si256(w + 3);
+        __m256i t0 = _mm256_unpacklo_epi32(v0, v1);
+        __m256i t1 = _mm256_unpackhi_epi32(v0, v1);
+        __m256i t2 = _mm256_unpacklo_epi32(v2, v3);
+        __m256i t3 = _mm256_unpackhi_epi32(v2, v3);
+        //records 0 2 4 6 1 3 5 7 until permuted
+        __m256i w0 = _mm256_permutevar8x32_epi32(_mm256_unpacklo_epi64(t0, t2), order);
+        __m256i w1 = _mm256_permutevar8x32_epi32(_mm256_unpackhi_epi64(t0, t2), order);
+        __m256i w2 = _mm256_permutevar8x32_epi32(_mm256_unpacklo_epi64(t1, t3), order);
+        __m256i w3 = _mm256_permutevar8x32_epi32(_mm256_unpackhi_epi64(t1, t3), order);
+
+        __m256i id = _mm256_and_si256(w0, _mm256_set1_epi32(0xFFF));
+        __m256i freq = _mm256_i32gather_epi32(frequencies, id, 4);
+        __m256i ok = _mm256_and_si256(_mm256_cmpeq_epi32(_mm256_and_si256(w0, plainMask), plain),
+                                      _mm256_cmpeq_epi32(_mm256_and_si256(w3, traceMask), zero));
+        ok = _mm256_andnot_si256(_mm256_cmpeq_epi32(freq, zero), ok);
+
+        __m256i force = _mm256_srli_epi32(w2, 31);
+        __m256i cfdTime = _mm256_srli_epi32(w2, 16);
+        __m256i frac100 = _mm256_and_si256(cfdTime, _mm256_set1_epi32(0x7FFF));
+
+        __m256i frac250 = _mm256_sub_epi32(_mm256_and_si256(cfdTime, _mm256_set1_epi32(0x3FFF)),
+                                           _mm256_slli_epi32(_mm256_and_si256(_mm256_srli_epi32(w2, 30), one), 14));
+        frac250 = _mm256_blendv_epi8(frac250, _mm256_set1_epi32(16384), _mm256_cmpeq_epi32(force, one));
+
+        __m256i source = _mm256_srli_epi32(w2, 29);
+        __m256i force500 = _mm256_cmpeq_epi32(source, _mm256_set1_epi32(7));
+        __m256i x = _mm256_slli_epi32(_mm256_add_epi32(_mm256_and_si256(cfdTime, _mm256_set1_epi32(0x1FFF)),
+                                                       _mm256_slli_epi32(_mm256_sub_epi32(source, one), 13)), 2);
+        __m256i frac500 = _mm256_cvttps_epi32(_mm256_div_ps(_mm256_cvtepi32_ps(x), _mm256_set1_ps(5.0f)));
+        frac500 = _mm256_blendv_epi8(frac500, _mm256_set1_epi32(40960*4/5), force500);
+
+        __m256i is250 = _mm256_cmpeq_epi32(freq, _mm256_set1_epi32(250));
+        __m256i is500 = _mm256_cmpeq_epi32(freq, _mm256_set1_epi32(500));
+        __m256i frac = _mm256_blendv_epi8(_mm256_blendv_epi8(frac100, frac250, is250), frac500, is500);
+        force = _mm256_blendv_epi8(force, _mm256_srli_epi32(force500, 31), is500);
+
+        __m256i flags = _mm256_or_si256(_mm256_srli_epi32(w0, 31),
+                                        _mm256_or_si256(_mm256_slli_epi32(force, 1), _mm256_slli_epi32(_mm256_srli_epi32(w3, 31), 2)));
+
+        _mm256_storeu_si256((__m256i*)&b.id[i], id);
+        _mm256_storeu_si256((__m256i*)&b.timeLow[i], w1);
+        _mm256_storeu_si256((__m256i*)&b.timeHigh[i], _mm256_and_si256(w2, low16));
+        _mm256_storeu_si256((__m256i*)&b.cfd[i], frac);
+        _mm256_storeu_si256((__m256i*)&b.frequency[i], freq);
+        _mm256_storeu_si256((__m256i*)&b.energy[i], _mm256_and_si256(w3, low16));
+        _mm256_storeu_si256((__m256i*)&b.flags[i], flags);
+
+        int valid = _mm256_movemask_ps(_mm256_castsi256_ps(ok));
+        if (valid != 0xFF) {
+          return i + __builtin_ctz(~valid);
+        }
+      }
+      return decode_scalar(words, i, n, frequencies, b);
+    }
+#endif
+  }
+
+  HeaderBatch::HeaderBatch()
+    : size(0), next(0), isa(best()), decoded(0) {
+    //room for a whole vector past the last record
+    for (auto *column : {&id, &timeLow, &timeHigh, &frequency, &energy, &flags}) {
+      column -> resize(kCapacity + 8);
+    }
+    cfd.resize(kCapacity + 8);
+    eventTime.resize(kCapacity + 8);
+  }
+
+  HeaderBatch::Isa HeaderBatch::best() {
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return kAVX2;
+    }
+    return kSSE2;
+#else
+    return kScalar;
+#endif
+  }
+
+  const char *HeaderBatch::name(Isa isa) {
+    switch (isa) {
+    case kAVX2: return "AVX2";
+    case kSSE2: return "SSE2";
+    default:    return "scalar";
+    }
+  }
+
+  void HeaderBatch::bind(const Experiment_Definition &definition) {
+    frequencies.assign(4096, 0);
+    offsets.assign(4096, 0);
+    for (int i=0; i<4096; ++i) {
+      const auto &info = definition.Lookup(i);
+      if (info.channel && (info.freq == 100 || info.freq == 250 || info.freq == 500)) {
+        frequencies[i] = info.freq;
+        offsets[i] = info.timeOffset;
+      }
+    }
+    clear();
+  }
+
+  size_t HeaderBatch::decode(const uint32_t *words, size_t n) {
+    n = std::min(n, kCapacity);
+    switch (isa) {
+#if defined(__x86_64__)
+    case kAVX2: size = decode_avx2(words, n, frequencies.data(), *this); break;
+    case kSSE2: size = decode_sse2(words, n, frequencies.data(), *this); break;
+#endif
+    default:    size = decode_scalar(words, 0, n, frequencies.data(), *this); break;
+    }
+    next = 0;
+
+    //the 64-bit time, as Measurement::ProcessTime, and the channel's offset
+    for (size_t i=0; i<size; ++i) {
+      uint64_t time = ((static_cast<uint64_t>(timeHigh[i])<<32) + timeLow[i]) << 15;
+      time += cfd[i];
+      time = frequency[i] == 250 ? time*8/10 : time;
+      eventTime[i] = Measurement::ShiftTime(time, offsets[id[i]]);
+    }
+    decoded += size;
+    return size;
+  }
+
+  size_t HeaderBatch::fill(Source &src, off_t limit) {
+    clear();
+    off_t end = src.fileLength;
+    if (limit > 0 && limit < end) {
+      end = limit;
+    }
+    off_t available = (end - src.offset())/16;
+    if (!bound() || available <= 0) {
+      return 0;
+    }
+    //a record that can't be batched costs one test, not a peek at the next thousand
+    const uint32_t *words = src.peek(4);
+    if (!words || (words[0] & kPlainMask) != kPlain) {
+      return 0;
+    }
+    size_t n = std::min<size_t>(available, kCapacity);
+    if (!(words = src.peek(4*n))) {
+      return 0;
+    }
+    return decode(words, n);
+  }
+
+  void HeaderBatch::get(Measurement &meas) const {
+    size_t i = next;
+    meas.crateID       = id[i] >> 8;
+    meas.slotID        = (id[i] >> 4) & 0xF;
+    meas.channelNumber = id[i] & 0xF;
+    meas.headerLength  = 4;
+    meas.eventLength   = 4;
+    meas.finishCode    = flags[i] & kFinishCode;
+    meas.eventTime     = eventTime[i];
+    meas.CFDForce      = (flags[i] & kCFDForce) >> 1;
+    meas.eventEnergy   = energy[i];
+    meas.traceLength   = 0;
+    meas.outOfRange    = (flags[i] & kOutOfRange) >> 2;
+  }
+} // namespace PIXIE
@@ -0,0 +1,72 @@
+// -*-c++-*-
+/* libpixie batch decoding of fixed-length headers */
+
+#ifndef LIBPIXIE_HEADER_BATCH_H
+#define LIBPIXIE_HEADER_BATCH_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <sys/types.h>
+
+#include "experiment_definition.hh"
+#include "measurement.hh"
+#include "source.hh"
+
+namespace PIXIE {
+  /* Headers of a run of plain 4-word records (no energy sums, QDCs or
+     trace) from channels of the definition, decoded many at a time into
+     one array per field.  fill() decodes as many records as it can from
+     the cursor of a Source without moving it; get() hands out the next
+     record as a Measurement and pop() moves past it once the caller has
+     committed its 4 words, so the Source offset always points at the
+     first record not yet popped.  The first record that doesn't fit
+     (other header lengths, traces, unknown channels or frequencies) ends
+     the run and is left to Measurement::read. */
+  class HeaderBatch {
+  public:
+    enum Isa { kScalar, kSSE2, kAVX2 };
+    enum Flags : uint32_t { kFinishCode = 1, kCFDForce = 2, kOutOfRange = 4 };
+
+    static const size_t kCapacity = 1024; //records per fill
+
+    //one entry per record
+    std::vector<uint32_t> id;          //crate<<8 | slot<<4 | channel
+    std::vector<uint32_t> timeLow;     //raw timestamp, low 32 bits
+    std::vector<uint32_t> timeHigh;    //and high 16
+    std::vector<int32_t>  cfd;         //CFD fraction added to timestamp<<15
+    std::vector<uint32_t> frequency;   //of the slot, MHz
+    std::vector<uint32_t> energy;
+    std::vector<uint32_t> flags;
+    std::vector<uint64_t> eventTime;   //as Measurement::eventTime
+
+    size_t size;    //records decoded
+    size_t next;    //next to hand out
+    Isa isa;        //kernel used by fill()
+    long long decoded; //records decoded here rather than by Measurement::read
+
+  private:
+    std::vector<int32_t> frequencies;  //by 12-bit ID, 0 = not decoded here
+    std::vector<int64_t> offsets;      //by 12-bit ID, the channel's time offset
+
+  public:
+    HeaderBatch();
+
+    static Isa best();  //the widest kernel this CPU runs
+    static const char *name(Isa isa);
+
+    void bind(const Experiment_Definition &definition);
+    bool bound() const { return !frequencies.empty(); }
+    void clear() { size = 0; next = 0; }
+    bool empty() const { return next >= size; }
+
+    //decode from the cursor up to limit (<=0 = end of file), the number of records
+    size_t fill(Source &src, off_t limit);
+    //decode n records at words, stopping at the first that doesn't fit
+    size_t decode(const uint32_t *words, size_t n);
+    void get(Measurement &meas) const;
+    void pop() { ++next; }
+  };
+} // namespace PIXIE
+
+#endif //LIBPIXIE_HEADER_BATCH_H
@@ -0,0 +1,51 @@
+/* hit batch implementation for libpixie */
+
+#include "hit_batch.hh"
+
+namespace PIXIE {
+  void HitBatch::clear() {
+    for (auto *column : {&eventRelTime, &finishCode, &CFDForce, &eventEnergy, &outOfRange,
+                         &ESumTrailing, &ESumLeading, &ESumGap, &baseline, &QDCSums}) {
+      column -> clear();
+    }
+    for (auto *column : {&traceFirst, &traceCount, &sampleFirst, &sampleCount, &traceMeas}) {
+      column -> clear();
+    }
+    id.clear();
+    eventTime.clear();
+    samples.clear();
+    eventStart.assign(1, 0);
+  }
+
+  void HitBatch::add(const Event &event) {
+    for (const Measurement &meas : event.fMeasurements) {
+      id.push_back((meas.crateID<<8) | (meas.slotID<<4) | meas.channelNumber);
+      eventTime.push_back(meas.eventTime);
+      eventRelTime.push_back(meas.eventRelTime);
+      finishCode.push_back(meas.finishCode);
+      CFDForce.push_back(meas.CFDForce);
+      eventEnergy.push_back(meas.eventEnergy);
+      outOfRange.push_back(meas.outOfRange);
+      ESumTrailing.push_back(meas.ESumTrailing);
+      ESumLeading.push_back(meas.ESumLeading);
+      ESumGap.push_back(meas.ESumGap);
+      baseline.push_back(meas.baseline);
+      QDCSums.insert(QDCSums.end(), meas.QDCSums, meas.QDCSums + 8);
+
+      traceFirst.push_back(meas.trace_meas.empty() ? -1 : (int32_t)traceMeas.size());
+      traceCount.push_back(meas.trace_meas.size());
+      traceMeas.insert(traceMeas.end(), meas.trace_meas.begin(), meas.trace_meas.end());
+
+      sampleFirst.push_back(meas.samples.empty() ? -1 : (int32_t)samples.size());
+      sampleCount.push_back(meas.samples.size());
+      samples.insert(samples.end(), meas.samples.begin(), meas.samples.end());
+    }
+    eventStart.push_back(id.size());
+  }
+
+  void HitBatch::set_trace(size_t hit, const int32_t *meas, size_t n) {
+    traceFirst[hit] = n ? (int32_t)traceMeas.size() : -1;
+    traceCount[hit] = n;
+    traceMeas.insert(traceMeas.end(), meas, meas + n);
+  }
+} // namespace PIXIE
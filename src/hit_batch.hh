@@ -0,0 +1,65 @@
+// -*-c++-*-
+/* libpixie batch of built events, one array per hit field */
+
+#ifndef LIBPIXIE_HIT_BATCH_H
+#define LIBPIXIE_HIT_BATCH_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "event.hh"
+#include "measurement.hh"
+
+namespace PIXIE {
+  /* The events of one read, stored as columns over all their hits: the
+     hits of event e are [eventStart[e], eventStart[e+1]).  Trace
+     measurements (only the values, the names are the algorithm's
+     Prototype()) and raw samples deferred to another thread live in flat
+     arrays, each hit pointing at its first entry.  clear() keeps the
+     capacity, so a batch reused read after read stops allocating once it
+     has seen its largest read. */
+  class HitBatch {
+  public:
+    //one entry per hit
+    std::vector<uint16_t> id;            //crate<<8 | slot<<4 | channel
+    std::vector<uint64_t> eventTime;
+    std::vector<uint32_t> eventRelTime;
+    std::vector<uint32_t> finishCode;
+    std::vector<uint32_t> CFDForce;
+    std::vector<uint32_t> eventEnergy;
+    std::vector<uint32_t> outOfRange;
+    std::vector<uint32_t> ESumTrailing;
+    std::vector<uint32_t> ESumLeading;
+    std::vector<uint32_t> ESumGap;
+    std::vector<uint32_t> baseline;
+    std::vector<uint32_t> QDCSums;       //8 per hit
+    std::vector<int32_t>  traceFirst;    //index in traceMeas, -1 = none
+    std::vector<int32_t>  traceCount;
+    std::vector<int32_t>  sampleFirst;   //index in samples, -1 = none
+    std::vector<int32_t>  sampleCount;
+
+    //one entry per event, plus the end of the last
+    std::vector<uint32_t> eventStart;
+
+    std::vector<int32_t>  traceMeas;     //trace measurements of every hit
+    std::vector<uint16_t> samples;       //deferred raw traces of every hit
+
+  public:
+    HitBatch() { clear(); }
+
+    void clear();
+    size_t events() const { return eventStart.size() - 1; }
+    size_t hits() const { return id.size(); }
+    uint32_t first(size_t event) const { return eventStart[event]; }
+    uint32_t last(size_t event) const { return eventStart[event+1]; }
+    uint32_t mult(size_t event) const { return eventStart[event+1] - eventStart[event]; }
+
+    //appends the event's hits as the next event
+    void add(const Event &event);
+    //trace measurements of hit, for processing deferred samples
+    void set_trace(size_t hit, const int32_t *meas, size_t n);
+  };
+} // namespace PIXIE
+
+#endif //LIBPIXIE_HIT_BATCH_H
@@ -0,0 +1,162 @@
+/* libpixie listmode index */
+
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <sys/stat.h>
+
+#include "list_index.hh"
+#include "measurement.hh"
+
+namespace PIXIE {
+  namespace {
+    struct IndexHeader {
+      char magic[8];
+      uint32_t version;
+      uint32_t stride;
+      uint64_t fileSize;
+      int64_t mtime;
+      uint64_t nRecords;
+      uint64_t nBlocks;
+    };
+    const char kMagic[8] = {'P','X','I','D','X','\0','\0','\0'};
+  }
+
+  int ListIndex::build(Source &src, uint32_t blockStride) {
+    stride = blockStride;
+    fileSize = src.update_filesize();
+    nRecords = 0;
+    blocks.clear();
+    std::fill(channelCounts.begin(), channelCounts.end(), 0);
+
+    src.seek(0);
+    Block block = {};
+    while (true) {
+      off_t offset = src.offset();
+      const uint32_t *words = src.peek(3);
+      if (!words) {
+        break;
+      }
+      uint32_t eventLength = Measurement::mEventLength(words[0]);
+      if (eventLength < 3) {
+        std::cout << "Corrupt record at offset " << offset << ", index stops here" << std::endl;
+        break;
+      }
+      //the record has to be complete to count
+      if (!(words = src.peek(eventLength))) {
+        break;
+      }
+      uint64_t timestamp = Measurement::mTimeHigh(words[2]);
+      timestamp = (timestamp<<32) + Measurement::mTimeLow(words[1]);
+
+      if (block.nRecords == 0) {
+        block.offset = offset;
+        block.firstTime = timestamp;
+      }
+      block.lastTime = timestamp;
+      ++block.nRecords;
+      ++channelCounts[words[0] & 0xFFF];
+      ++nRecords;
+
+      if (block.nRecords == stride) {
+        blocks.push_back(block);
+        block = {};
+      }
+
+      src.commit(eventLength);
+    }
+    if (block.nRecords) {
+      blocks.push_back(block);
+    }
+    return 0;
+  }
+
+  int ListIndex::load(const std::string &listPath) {
+    struct stat st;
+    if (stat(listPath.c_str(), &st) != 0) {
+      return (-1);
+    }
+
+    FILE *fpr = fopen(path_for(listPath).c_str(), "rb");
+    if (!fpr) {
+      return (-1);
+    }
+
+    IndexHeader header;
+    if (fread(&header, sizeof(header), 1, fpr) != 1 ||
+        memcmp(header.magic, kMagic, sizeof(kMagic)) ||
+        header.version != kVersion ||
+        header.fileSize != (uint64_t)st.st_size ||
+        header.mtime != (int64_t)st.st_mtime) {
+      fclose(fpr);
+      return (-2); //stale or foreign index
+    }
+
+    stride = header.stride;
+    fileSize = header.fileSize;
+    mtime = header.mtime;
+    nRecords = header.nRecords;
+    blocks.resize(header.nBlocks);
+    channelCounts.assign(kChannels, 0);
+    if (fread(channelCounts.data(), sizeof(uint64_t), kChannels, fpr) != (size_t)kChannels ||
+        fread(blocks.data(), sizeof(Block), blocks.size(), fpr) != blocks.size()) {
+      fclose(fpr);
+      return (-3);
+    }
+    fclose(fpr);
+    return (0);
+  }
+
+  int ListIndex::write(const std::string &listPath) const {
+    struct stat st;
+    if (stat(listPath.c_str(), &st) != 0) {
+      return (-1);
+    }
+    //the file changed while we were indexing it (live mode), don't keep a stale index
+    if ((uint64_t)st.st_size != fileSize) {
+      return (-1);
+    }
+
+    FILE *fpw = fopen(path_for(listPath).c_str(), "wb");
+    if (!fpw) {
+      return (-2);
+    }
+
+    IndexHeader header;
+    memcpy(header.magic, kMagic, sizeof(kMagic));
+    header.version = kVersion;
+    header.stride = stride;
+    header.fileSize = fileSize;
+    header.mtime = st.st_mtime;
+    header.nRecords = nRecords;
+    header.nBlocks = blocks.size();
+
+    bool good = (fwrite(&header, sizeof(header), 1, fpw) == 1 &&
+                 fwrite(channelCounts.data(), sizeof(uint64_t), kChannels, fpw) == (size_t)kChannels &&
+                 fwrite(blocks.data(), sizeof(Block), blocks.size(), fpw) == blocks.size());
+    fclose(fpw);
+    if (!good) {
+      remove(path_for(listPath).c_str());
+      return (-3);
+    }
+    return (0);
+  }
+
+  std::vector<off_t> ListIndex::split(int nParts) const {
+    std::vector<off_t> offsets;
+    size_t iblock = 0;
+    for (int part=0; part<nParts; ++part) {
+      //first block starting at or beyond part/nParts of the file
+      while (iblock < blocks.size() && (off_t)blocks[iblock].offset*nParts < (off_t)part*(off_t)fileSize) {
+        ++iblock;
+      }
+      if (iblock < blocks.size()) {
+        offsets.push_back(blocks[iblock].offset);
+      }
+      else {
+        offsets.push_back(fileSize); //nothing left for this part
+      }
+    }
+    return offsets;
+  }
+}
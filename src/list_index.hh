@@ -0,0 +1,51 @@
+// -*-c++-*-
+/* libpixie listmode index, stored next to the data as <file>.pxidx */
+
+#ifndef LIBPIXIE_LIST_INDEX_H
+#define LIBPIXIE_LIST_INDEX_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <sys/types.h>
+
+#include "source.hh"
+
+namespace PIXIE {
+  class ListIndex {
+  public:
+    struct Block {
+      uint64_t offset;     //file offset of the first record in the block
+      uint64_t firstTime;  //raw timestamp (clock ticks) of the first record
+      uint64_t lastTime;   //raw timestamp of the last record
+      uint32_t nRecords;
+      uint32_t reserved;
+    };
+
+    static const uint32_t kVersion = 1;
+    static const int kChannels = 4096; //crate.slot.channel is a 12-bit ID
+
+    uint32_t stride;        //records per block
+    uint64_t fileSize;      //of the listmode file when indexed
+    int64_t mtime;
+    uint64_t nRecords;
+    std::vector<Block> blocks;
+    std::vector<uint64_t> channelCounts;
+
+  public:
+    ListIndex() : stride(0), fileSize(0), mtime(0), nRecords(0), channelCounts(kChannels, 0) {};
+
+    static std::string path_for(const std::string &listPath) { return listPath + ".pxidx"; }
+
+    int build(Source &src, uint32_t blockStride);
+    int load(const std::string &listPath);
+    int write(const std::string &listPath) const;
+
+    std::vector<off_t> split(int nParts) const;
+    uint64_t count(int crateID, int slotID, int channelNumber) const {
+      return channelCounts[(crateID<<8) | (slotID<<4) | channelNumber];
+    }
+  };
+}
+
+#endif //LIBPIXIE_LIST_INDEX_H
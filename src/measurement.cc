@@ -5,80 +5,152 @@
 
 namespace PIXIE {
   
-  Mask Measurement::mChannelNumber    = Mask(0xF, 0);
-  Mask Measurement::mSlotID           = Mask(0xF0, 4);
-  Mask Measurement::mCrateID          = Mask(0xF00, 8);
-  Mask Measurement::mHeaderLength     = Mask(0x1F000, 12);
-  Mask Measurement::mEventLength      = Mask(0x7FFE0000, 17);
-  Mask Measurement::mFinishCode       = Mask(0x80000000, 31);
-  Mask Measurement::mTimeLow          = Mask(0xFFFFFFFF, 0);
-  Mask Measurement::mTimeHigh         = Mask(0xFFFF, 0);
-  Mask Measurement::mEventEnergy      = Mask(0xFFFF, 0);
-  Mask Measurement::mTraceLength      = Mask(0x7FFF0000, 16);
-  Mask Measurement::mTraceOutRange    = Mask(0x80000000, 31);
-  
-  Mask Measurement::mCFDTime100       = Mask(0x7FFF0000, 16);
-  Mask Measurement::mCFDTime250       = Mask(0x3FFF0000, 16);
-  Mask Measurement::mCFDTime500       = Mask(0x1FFF0000, 16);
-  Mask Measurement::mCFDForce100      = Mask(0x80000000, 31);
-  Mask Measurement::mCFDForce250      = Mask(0x80000000, 31);
-  Mask Measurement::mCFDTrigSource250 = Mask(0x40000000, 30);
-  Mask Measurement::mCFDTrigSource500 = Mask(0xE0000000, 29);
-
-  Mask Measurement::mESumTrailing     = Mask(0xFFFFFFFF, 0);
-  Mask Measurement::mESumLeading      = Mask(0xFFFFFFFF, 0);
-  Mask Measurement::mESumGap          = Mask(0xFFFFFFFF, 0);
-  Mask Measurement::mBaseline         = Mask(0xFFFFFFFF, 0);
-  
-  Mask Measurement::mQDCSums          = Mask(0xFFFFFFFF, 0);
-
-  CFD Measurement::ProcessCFD(unsigned int data, int frequency) {
+  template <int Frequency>
+  constexpr CFD Measurement::ProcessCFD(unsigned int data) {
     CFD retval = {};
-    if (frequency == 100) {
-      int CFDTime  = mCFDTime100(data);
-      unsigned int CFDForce = mCFDForce100(data);
-      retval = {CFDTime, CFDForce};
-      return retval;
-    }
-    else if (frequency == 250) {
-      int CFDTime       = mCFDTime250(data);
+    if constexpr (Frequency == 100) {
+      retval = {static_cast<int>(mCFDTime100(data)), mCFDForce100(data)};
+    }
+    else if constexpr (Frequency == 250) {
+      int CFDTime                = mCFDTime250(data);
       unsigned int CFDTrigSource = mCFDTrigSource250(data);
-      unsigned int CFDForce      = mCFDForce250(data);
-      retval.CFDForce = CFDForce;
-      if (CFDForce==0) {                  
-        retval.CFDFraction = CFDTime - 16384*static_cast<int>(CFDTrigSource);
-      }
-      else {
-        retval.CFDFraction = 16384;
-      }      
+      retval.CFDForce = mCFDForce250(data);
+      //CFDForce is one bit, choose without a branch
+      retval.CFDFraction = retval.CFDForce ? 16384 : CFDTime - 16384*static_cast<int>(CFDTrigSource);
     }
-    else if (frequency == 500) {
-      int CFDTime       = mCFDTime500(data);
+    else if constexpr (Frequency == 500) {
+      int CFDTime                = mCFDTime500(data);
       unsigned int CFDTrigSource = mCFDTrigSource500(data);
-      if (CFDTrigSource == 7) {
-        retval.CFDForce = 1;
-        retval.CFDFraction = 40960*4/5;
-      }
-      else {
-        retval.CFDForce = 0;
-        retval.CFDFraction = (CFDTime + 8192*(static_cast<int>(CFDTrigSource)-1))*4/5;
-      }
-    }
-    else {
-      std::cout << "\n" ANSI_COLOR_RED "Waring! Slot has frequency of neither 100 MHz, 250 MHz, or 500 MHz" ANSI_COLOR_RESET<< std::endl;
+      retval.CFDForce = CFDTrigSource == 7;
+      retval.CFDFraction = retval.CFDForce ? 40960*4/5 : (CFDTime + 8192*(static_cast<int>(CFDTrigSource)-1))*4/5;
     }
     return retval;
   }
 
-  EventTime Measurement::ProcessTime(unsigned long long timestamp, unsigned int cfddat, int frequency) {    
+  template <int Frequency>
+  constexpr EventTime Measurement::ProcessTime(unsigned long long timestamp, unsigned int cfddat) {
     unsigned long long time = timestamp << 15;
-    CFD cfd = ProcessCFD(cfddat, frequency);
+    CFD cfd = ProcessCFD<Frequency>(cfddat);
     time += cfd.CFDFraction;
-    if (frequency == 250) {
+    if constexpr (Frequency == 250) {
       time = time*8/10;
     }
     EventTime retval = {time, cfd.CFDForce};
-    return retval;    
+    return retval;
+  }
+
+  template <int Frequency, int HeaderLength>
+  void Measurement::decode_header(Measurement &meas, const uint32_t *words) {
+    uint32_t firstWord = words[0];
+    meas.channelNumber = mChannelNumber(firstWord);
+    meas.slotID        = mSlotID(firstWord);
+    meas.crateID       = mCrateID(firstWord);
+    meas.headerLength  = mHeaderLength(firstWord);
+    meas.eventLength   = mEventLength(firstWord);
+    meas.finishCode    = mFinishCode(firstWord);
+
+    uint64_t timestamp = (static_cast<uint64_t>(mTimeHigh(words[2]))<<32) + mTimeLow(words[1]);
+    if constexpr (Frequency == 100 || Frequency == 250 || Frequency == 500) {
+      EventTime time = ProcessTime<Frequency>(timestamp, words[2]);
+      meas.eventTime = time.time;
+      meas.CFDForce  = time.CFDForce;
+    }
+    else if constexpr (Frequency < 0) {
+      std::cout << "\nWarning! CrateID.SlotID.ChannelNumber " << meas.crateID << "." << meas.slotID << "." << meas.channelNumber << " not found" << std::endl;
+    }
+    else {
+      std::cout << "\n" ANSI_COLOR_RED "Waring! Slot has frequency of neither 100 MHz, 250 MHz, or 500 MHz" ANSI_COLOR_RESET<< std::endl;
+      meas.eventTime = timestamp << 15;
+      meas.CFDForce  = 0;
+    }
+    meas.eventEnergy = mEventEnergy(words[3]);
+    meas.traceLength = mTraceLength(words[3]);
+    meas.outOfRange  = mTraceOutRange(words[3]);
+
+    //Read the rest of the header
+    if constexpr (HeaderLength == 8 || HeaderLength == 16) {//Raw energy sums
+      meas.ESumTrailing = mESumTrailing(words[4]);
+      meas.ESumLeading  = mESumLeading(words[5]);
+      meas.ESumGap      = mESumGap(words[6]);
+      meas.baseline     = mBaseline(words[7]);
+    }
+    if constexpr (HeaderLength == 12 || HeaderLength == 16) {//QDCSums, after the energy sums if both
+      constexpr int first = HeaderLength == 12 ? 4 : 8;
+      for (int i=0; i<8; i++) {
+        meas.QDCSums[i] = mQDCSums(words[first+i]);
+      }
+    }
+  }
+
+  namespace {
+    //every 5-bit header length, those without extra words just decode the first four
+    template <int Frequency>
+    struct Decoders {
+      static constexpr HeaderDecoder table[32] = {
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 4>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 8>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 12>, Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 16>, Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+        Measurement::decode_header<Frequency, 0>,  Measurement::decode_header<Frequency, 0>,
+      };
+    };
+  }
+
+  const HeaderDecoder *Measurement::decoders(int frequency) {
+    switch (frequency) {
+    case 100: return Decoders<100>::table;
+    case 250: return Decoders<250>::table;
+    case 500: return Decoders<500>::table;
+    case -1:  return Decoders<-1>::table;
+    default:  return Decoders<0>::table;
+    }
+  }
+
+  void Measurement::decode(const uint32_t *words, Experiment_Definition &definition) {
+    //the channel's frequency picks the row, the record's header length the kernel
+    const Experiment_Definition::ChannelInfo &info = definition.Lookup(words[0]);
+    info.decoders[mHeaderLength(words[0])](*this, words);
+    //with the channel's delay taken out, before the time is used for anything
+    if (info.timeOffset) {
+      eventTime = ShiftTime(eventTime, info.timeOffset);
+    }
+  }
+
+  void Measurement::processTrace(const uint16_t *trace, Experiment_Definition::Channel *channel) {
+    if (deferTrace) {
+      //processed later, possibly by another thread with its own algorithm
+      samples.assign(trace, trace + traceLength);
+      return;
+    }
+    PIXIE::Trace::Algorithm *tracealg = channel->alg;
+    if (!tracealg || !tracealg->loaded) {
+      //no trace algorigthm, should never happen
+    }
+    else {
+      trace_meas.resize(tracealg->Width());
+      trace_meas.resize(tracealg->Process(trace, traceLength, trace_meas.data()));
+      good_trace = tracealg->good_trace;
+    }
+  }
+
+  void Measurement::processTrace(PIXIE::Trace::Algorithm *tracealg) {
+    if (samples.empty() || !tracealg || !tracealg->loaded) {
+      return;
+    }
+    trace_meas.resize(tracealg->Width());
+    trace_meas.resize(tracealg->Process(samples.data(), samples.size(), trace_meas.data()));
+    good_trace = tracealg->good_trace;
   }
 
   int Measurement::read(FILE *fpr, Experiment_Definition &definition, uint16_t *outTrace) {
@@ -90,66 +162,20 @@ namespace PIXIE {
       return -1;    
     }
 
-    channelNumber = mChannelNumber(firstWord);
-    slotID        = mSlotID(firstWord);
-    crateID       = mCrateID(firstWord);
-    headerLength  = mHeaderLength(firstWord);
-    eventLength   = mEventLength(firstWord);
-    finishCode    = mFinishCode(firstWord);
-
-    int oldChan = channelNumber;
+    uint32_t hLength = mHeaderLength(firstWord);
 	 
     //read the rest of the header
-    uint32_t otherWords[headerLength-1];
-    if (fread(&otherWords, (size_t) 4, (size_t) headerLength-1, fpr) != (size_t) headerLength-1) {
+    uint32_t words[hLength];
+    words[0] = firstWord;
+    if (fread(&words[1], (size_t) 4, (size_t) hLength-1, fpr) != (size_t) hLength-1) {
       fsetpos(fpr, &pos);
       return -1;
     }
-    
-    uint32_t timestampLow  = mTimeLow(otherWords[0]);
-    uint32_t timestampHigh = mTimeHigh(otherWords[1]);
-   
-    uint64_t timestamp=static_cast<uint64_t>(timestampHigh);
-    timestamp=timestamp<<32;
-    timestamp=timestamp+timestampLow;
-       
-    if (definition.GetChannel(crateID, slotID, channelNumber)) {
-      EventTime time = ProcessTime(timestamp, otherWords[1], definition.GetSlot(crateID, slotID)->freq);
-      eventTime = time.time;
-      CFDForce = time.CFDForce;            
-    }
-    else {
-      std::cout << "\nWarning! CrateID.SlotID.ChannelNumber " << crateID << "." << slotID << "." << channelNumber << " not found" << std::endl;
-    }
-    eventEnergy=mEventEnergy(otherWords[2]);
-    traceLength=mTraceLength(otherWords[2]);
-    outOfRange=mTraceOutRange(otherWords[2]);
-    
-    //Read the rest of the header
-    if (headerLength==8) {//Raw energy sums
-      ESumTrailing = mESumTrailing(otherWords[3]);
-      ESumLeading  = mESumLeading(otherWords[4]);
-      ESumGap      = mESumGap(otherWords[5]);
-      baseline     = mBaseline(otherWords[6]);
-    }
-    else if (headerLength==12) {//QDCSums
-      for (int i=0; i<8; i++) {
-        QDCSums[i]=mQDCSums(otherWords[3+i]);
-      }
-    }
-    else if (headerLength==16) { //Both
-      ESumTrailing = mESumTrailing(otherWords[3]);
-      ESumLeading  = mESumLeading(otherWords[4]);
-      ESumGap      = mESumGap(otherWords[5]);
-      baseline     = mBaseline(otherWords[6]);
-        
-      for (int i=0; i<8; i++) {
-          QDCSums[i]=mQDCSums(otherWords[7+i]);
-      }
-    }
+
+    decode(words, definition);
     
     //skip or proces the trace if recorded
-    auto channel = definition.GetChannel(crateID, slotID, channelNumber);
+    auto channel = definition.Lookup(firstWord).channel;
     //no trace, do nothing
     if ((eventLength - headerLength) == 0) {;}
     //skip trace if not needed
@@ -170,21 +196,53 @@ namespace PIXIE {
 	memcpy(outTrace, &trace,traceLength*sizeof(uint16_t));
       }
       if (channel->traces) {
-        PIXIE::Trace::Algorithm *tracealg = channel->alg;
-        if (!tracealg || !tracealg->loaded) {
-          //no trace algorigthm, should never happen
-        }
-        else {
-          auto tmeas = tracealg->Process(trace, traceLength);
-          good_trace = tracealg->good_trace;
-          for (auto &m : tmeas) {
-            trace_meas.push_back(m);
-          }
-        }
+        processTrace(trace, channel);
       }
     }
     return 0;     
   }
+
+  int Measurement::read(Source &src, Experiment_Definition &definition, uint16_t *outTrace, bool commit) {
+    const uint32_t *words = src.peek(1);
+    if (!words) {
+      return -1;
+    }
+
+    uint32_t hLength = mHeaderLength(words[0]);
+    uint32_t eLength = mEventLength(words[0]);
+    if (hLength < 4 || eLength < hLength) {
+      return -1; //corrupt record, we can't find the next one
+    }
+
+    //the whole record has to be in memory, trace included
+    words = src.peek(eLength);
+    if (!words) {
+      return -1;
+    }
+
+    decode(words, definition);
+
+    auto channel = definition.Lookup(words[0]).channel;
+    if ((eventLength - headerLength) != 0 && (outTrace!=NULL || (channel && channel->traces))) {
+      if (traceLength > 2*(eventLength - headerLength)) {
+        return -1;
+      }
+      //trace samples are decoded straight out of the source window
+      const uint16_t *trace = reinterpret_cast<const uint16_t*>(words + headerLength);
+      if (outTrace!=NULL){
+        memcpy(outTrace, trace, traceLength*sizeof(uint16_t));
+      }
+      if (channel && channel->traces) {
+        processTrace(trace, channel);
+      }
+    }
+
+    //without commit the record is only peeked at, the caller commits it if wanted
+    if (commit) {
+      src.commit(eventLength);
+    }
+    return 0;
+  }
     
   int Measurement::print() const
   {
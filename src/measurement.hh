@@ -4,8 +4,10 @@
 #include <iostream>
 #include <string>
 #include <vector>
+#include <memory_resource>
 
 #include "experiment_definition.hh"
+#include "source.hh"
 #include "traces.hh"
 #include "colors.hh"
 
@@ -14,8 +16,8 @@ namespace PIXIE {
     unsigned int fBits;
     unsigned int fShift;
 
-    Mask(const unsigned int bits, unsigned int shift) : fBits(bits), fShift(shift) {}
-    unsigned int operator() (unsigned int data) {
+    constexpr Mask(const unsigned int bits, unsigned int shift) : fBits(bits), fShift(shift) {}
+    constexpr unsigned int operator() (unsigned int data) const {
       return (data&fBits) >> fShift;
     }
   };
@@ -55,39 +57,41 @@ namespace PIXIE {
     //QDC sums
     uint32_t QDCSums[8];
 
-    //Trace measurements
-    std::vector<PIXIE::Trace::Measurement> trace_meas;
+    //Trace measurements (laid out as the algorithm's Prototype()), in the memory the Measurement was made with
+    std::pmr::vector<int32_t> trace_meas;
     bool good_trace;
+    bool deferTrace;                    //keep the samples for processTrace(alg) instead of processing them now
+    std::pmr::vector<uint16_t> samples; //raw trace, only filled when deferred
     
-    static Mask mChannelNumber;
-    static Mask mSlotID;
-    static Mask mCrateID;
-    static Mask mHeaderLength;
-    static Mask mEventLength;
-    static Mask mFinishCode;
-    static Mask mTimeLow;
-    static Mask mTimeHigh;
-    static Mask mEventEnergy;
-    static Mask mTraceLength;
-    static Mask mTraceOutRange;
+    static constexpr Mask mChannelNumber    = Mask(0xF, 0);
+    static constexpr Mask mSlotID           = Mask(0xF0, 4);
+    static constexpr Mask mCrateID          = Mask(0xF00, 8);
+    static constexpr Mask mHeaderLength     = Mask(0x1F000, 12);
+    static constexpr Mask mEventLength      = Mask(0x7FFE0000, 17);
+    static constexpr Mask mFinishCode       = Mask(0x80000000, 31);
+    static constexpr Mask mTimeLow          = Mask(0xFFFFFFFF, 0);
+    static constexpr Mask mTimeHigh         = Mask(0xFFFF, 0);
+    static constexpr Mask mEventEnergy      = Mask(0xFFFF, 0);
+    static constexpr Mask mTraceLength      = Mask(0x7FFF0000, 16);
+    static constexpr Mask mTraceOutRange    = Mask(0x80000000, 31);
     
-    static Mask mCFDTime100;
-    static Mask mCFDTime250;
-    static Mask mCFDTime500;
-    static Mask mCFDForce100;
-    static Mask mCFDForce250;
-    static Mask mCFDTrigSource250;
-    static Mask mCFDTrigSource500;
+    static constexpr Mask mCFDTime100       = Mask(0x7FFF0000, 16);
+    static constexpr Mask mCFDTime250       = Mask(0x3FFF0000, 16);
+    static constexpr Mask mCFDTime500       = Mask(0x1FFF0000, 16);
+    static constexpr Mask mCFDForce100      = Mask(0x80000000, 31);
+    static constexpr Mask mCFDForce250      = Mask(0x80000000, 31);
+    static constexpr Mask mCFDTrigSource250 = Mask(0x40000000, 30);
+    static constexpr Mask mCFDTrigSource500 = Mask(0xE0000000, 29);
 
-    static Mask mESumTrailing;
-    static Mask mESumLeading;
-    static Mask mESumGap;
-    static Mask mBaseline;
+    static constexpr Mask mESumTrailing     = Mask(0xFFFFFFFF, 0);
+    static constexpr Mask mESumLeading      = Mask(0xFFFFFFFF, 0);
+    static constexpr Mask mESumGap          = Mask(0xFFFFFFFF, 0);
+    static constexpr Mask mBaseline         = Mask(0xFFFFFFFF, 0);
     
-    static Mask mQDCSums;
+    static constexpr Mask mQDCSums          = Mask(0xFFFFFFFF, 0);
 
   public:
-    Measurement() :
+    explicit Measurement(std::pmr::memory_resource *resource = std::pmr::get_default_resource()) :
       headerLength(0),
       eventLength(0),
       traceLength(0),      
@@ -104,17 +108,65 @@ namespace PIXIE {
       ESumLeading(0),
       ESumGap(0),
       baseline(0),
-      trace_meas(0),
-      good_trace(false) {      
+      trace_meas(resource),
+      good_trace(false),
+      deferTrace(false),
+      samples(resource) {
       std::fill(QDCSums, QDCSums + 8, 0);
     }
 
+    //as if just made, but keeping the memory of the trace vectors for reuse
+    void reset() {
+      headerLength = 0;
+      eventLength = 0;
+      traceLength = 0;
+      crateID = 0;
+      slotID = 0;
+      channelNumber = 0;
+      finishCode = 0;
+      eventTime = 0;
+      eventRelTime = 0;
+      CFDForce = 0;
+      eventEnergy = 0;
+      outOfRange = 0;
+      ESumTrailing = 0;
+      ESumLeading = 0;
+      ESumGap = 0;
+      baseline = 0;
+      std::fill(QDCSums, QDCSums + 8, 0);
+      trace_meas.clear();
+      good_trace = false;
+      deferTrace = false;
+      samples.clear();
+    }
+
+    /* The header decoders for channels of one frequency (100, 250 or 500
+       MHz; anything else only warns and leaves the time unscaled, -1 is
+       for channels missing from the definition), indexed by the header
+       length of the record.  Each is compiled for its frequency and
+       header length, so decoding a record is a straight run of masks
+       and shifts with no tests on either. */
+    static const HeaderDecoder *decoders(int frequency);
+
     int print() const;
     int read(FILE *fpr, Experiment_Definition &definition, uint16_t *outTrace=NULL);
+    int read(Source &src, Experiment_Definition &definition, uint16_t *outTrace=NULL, bool commit=true);
+    void decode(const uint32_t *words, Experiment_Definition &definition);
+    void processTrace(const uint16_t *trace, Experiment_Definition::Channel *channel);
+    void processTrace(PIXIE::Trace::Algorithm *tracealg);
     int getTrace(FILE *fpr,  PIXIE::Trace::Algorithm *tracealg, uint16_t* trace);
    
-    CFD ProcessCFD(unsigned int data, int frequency);
-    EventTime ProcessTime(unsigned long long timestamp, unsigned int cfd, int frequency);
+    //time moved by a channel's offset, but not to before zero
+    static uint64_t ShiftTime(uint64_t time, int64_t offset) {
+      return (offset < 0 && time < static_cast<uint64_t>(-offset)) ? 0 : time + offset;
+    }
+
+    template <int Frequency>
+    static constexpr CFD ProcessCFD(unsigned int data);
+    template <int Frequency>
+    static constexpr EventTime ProcessTime(unsigned long long timestamp, unsigned int cfd);
+    template <int Frequency, int HeaderLength>
+    static void decode_header(Measurement &meas, const uint32_t *words);
   };
 }
 
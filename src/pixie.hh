@@ -3,10 +3,18 @@
 #ifndef LIBPIXIE_PIXIE_H
 #define LIBPIXIE_PIXIE_H
 
+#include "chunk_scheduler.hh"
 #include "event.hh"
 #include "experiment_definition.hh"
+#include "header_batch.hh"
+#include "hit_batch.hh"
+#include "list_index.hh"
 #include "pre_reader.hh"
+#include "queue.hh"
 #include "reader.hh"
+#include "reorder_buffer.hh"
+#include "source.hh"
+#include "time_order.hh"
 #include "colors.hh"
 
 #endif //LIBPIXIE_PIXIE_H
@@ -6,6 +6,7 @@
 
 #include<iostream>
 #include<vector>
+#include<algorithm>
 #include<unordered_map>
 #include<cassert>
 #include<cstdio>
@@ -13,6 +14,7 @@
 #include<cerrno>
 #include<sstream>
 #include<fstream>
+#include<chrono>
 
 #include<pthread.h>
 
@@ -46,19 +48,39 @@ int main(int argc, char ** argv) {
   args::ValueFlag<std::string> rootfile(filegroup, "test.root", "Output ROOT file", {'o', "rootfile"});
   
   args::Flag live(parser, "live", "Live mode", {'l', "live"});
-  args::Flag timeorder(parser, "timeorder", "Time-order mode", {'t', "timeorder"});
+  args::Flag timeorder(parser, "timeorder", "Time-order the records as they are read (on one core)", {'t', "timeorder"});
   args::Flag warnings(parser, "warnings", "Display warnings", {'w', "warnings"});
   args::Flag verbose(parser, "verbose", "Verbose output", {'v', "verbose"});
+  args::Flag mmap(parser, "mmap", "Memory-map the listmode file", {'M', "mmap"});
+  args::Flag direct(parser, "direct", "Bypass the page cache (O_DIRECT) for block reads", {'D', "direct"});
+  args::Flag noindex(parser, "noindex", "Don't use or write a .pxidx index of the listmode file", {"noindex"});
+  args::Flag probe(parser, "probe", "Find thread offsets by probing the file in parallel rather than scanning it", {'p', "probe"});
+  args::Flag merge(parser, "merge", "Merge all threads into the one output file as they go, rather than one file per thread", {"merge"});
   
   args::ValueFlag<ULong64_t> n_events_per_read(parser, "10000", "Events per read", {'n', "eventsperread"}, 10000);
+  args::ValueFlag<UInt_t> blocksize(parser, "4096", "Read block size in kB, zero = stdio", {'B', "blocksize"}, 4096);
+  args::ValueFlag<UInt_t> prefetch(parser, "0", "Blocks to read ahead in a separate thread, zero = none", {'P', "prefetch"}, 0);
+  args::Flag batchdecode(parser, "batch-decode", "Decode runs of 4-word headers many at a time with SIMD (not with stdio)", {"batch-decode"});
+  args::ValueFlag<UInt_t> reorder(parser, "100000", "Time-ordering holds each record until one this much later (in units of 10 ns) has been read", {"reorder-window"}, 100000);
+  args::ValueFlag<UInt_t> disorder(parser, "0", "Build events through a buffer putting records this far out of order (in units of 10 ns) back in order, zero = none", {"disorder"}, 0);
+  args::ValueFlag<std::string> buildmode(parser, "rolling", "Event building: rolling (each hit extends the window), fixed (window from the first hit) or trigger (window either side of a trigger channel, R lines in the definition)", {"build"}, "rolling");
   args::ValueFlag<UInt_t> coinc(parser, "20", "Coincidence window (in units of 10 ns)", {'c', "coincidence"}, 20);
   args::ValueFlag<UInt_t> mult(parser, "1", "Minimum multiplicy to write to Tree", {'m', "multiplicty"}, 1);
   args::ValueFlag<ULong64_t> n_events(parser, "0", "Events to process, zero = all", {'N', "nevents"}, 0);
   args::ValueFlag<UInt_t> n_threads(parser, "1", "Number of cores", {'j', "cores"}, 1);
+  args::ValueFlag<UInt_t> n_chunks(parser, "1", "Chunks per core, idle cores steal chunks from busy ones", {'k', "chunks"}, 1);
+  args::ValueFlag<UInt_t> autoflush(parser, "30", "Tree baskets are written every this many MB", {"autoflush"}, 30);
+  args::ValueFlag<UInt_t> autosave(parser, "300", "Tree header is written every this many MB", {"autosave"}, 300);
+  args::ValueFlag<UInt_t> checkpoint(parser, "0", "Also write the tree header every this many s, so a crashed live sort stays readable, zero = never", {"checkpoint"}, 0);
+  args::ValueFlag<std::string> compression(parser, "zlib:1", "Output compression, none/zlib/lzma/lz4/zstd with optional :level", {'Z', "compression"});
+  args::ValueFlagList<std::string> branchcompression(parser, "qdc=zstd:9", "Compression for one class of branches: event, eraw, qdc, trace or tagger", {"branch-compression"});
+  args::ValueFlag<UInt_t> n_dsp(parser, "0", "Trace processing threads per core, filling on its own thread, zero = no pipeline", {"dsp"}, 0);
   
   args::Flag qdcs(parser, "qdcs", "QDCs", {'q', "qdcs"});
   args::Flag eraw(parser, "eraw", "Raw Energy Sums", {'e', "eraw"});
   args::Flag traces(parser, "traces", "Traces", {'z', "traces"});
+  args::Flag sparse(parser, "sparse", "Write one row per hit (mult, id[mult], eventEnergy[mult], ...) instead of branches for every channel", {'s', "sparse"});
+  args::Flag rntuple(parser, "rntuple", "Write RawTree as an RNTuple, one collection per field over the hits", {'R', "rntuple"});
 
   try { parser.ParseCLI(argc, argv); }
   catch (args::Help) {
@@ -82,27 +104,71 @@ int main(int argc, char ** argv) {
   options.verbose                  = args::get(verbose);
   options.warnings                 = args::get(warnings);
   options.timeOrder                = args::get(timeorder);
+  options.reorderWindow            = args::get(reorder);
+  options.disorder                 = args::get(disorder);
   options.minMult                  = args::get(mult);
   options.coincWindow              = args::get(coinc);
   options.nThreads                 = args::get(n_threads);
   options.QDCs                     = args::get(qdcs);
   options.rawE                     = args::get(eraw);
   options.traces                   = args::get(traces);
+  options.sparse                   = args::get(sparse);
+  options.rntuple                  = args::get(rntuple);
+  options.mmap                     = args::get(mmap);
+  options.blockSize                = (size_t)args::get(blocksize)*1024;
+  options.prefetchDepth            = args::get(prefetch);
+  options.batchDecode              = args::get(batchdecode);
+  options.directIO                 = args::get(direct);
+  options.useIndex                 = !args::get(noindex);
+  options.probe                    = args::get(probe);
+  options.chunksPerThread          = std::max(1u, args::get(n_chunks));
+  options.dspThreads               = args::get(n_dsp);
+  options.merge                    = args::get(merge);
+  options.autoFlush                = (Long64_t)args::get(autoflush)*1000000;
+  options.autoSave                 = (Long64_t)args::get(autosave)*1000000;
+  options.checkpoint               = args::get(checkpoint);
+
+#ifndef PIXIE2ROOT_RNTUPLE
+  if (options.rntuple) {
+    std::cerr << "This pixie2root was built without RNTuple, which needs ROOT 6.36 or later" << std::endl;
+    return 1;
+  }
+#endif
+
+  if (compression) {
+    options.compression = compression_settings(args::get(compression));
+    if (options.compression < 0) {
+      std::cerr << "Unknown compression " << args::get(compression) << std::endl;
+      return 1;
+    }
+  }
+  const std::string modes[] = {"rolling", "fixed", "trigger"};
+  options.buildMode = std::find(std::begin(modes), std::end(modes), args::get(buildmode)) - std::begin(modes);
+  if (options.buildMode > PIXIE::Event::kTrigger) {
+    std::cerr << "Unknown event building " << args::get(buildmode) << ", expected rolling, fixed or trigger" << std::endl;
+    return 1;
+  }
+  for (const auto &spec : args::get(branchcompression)) {
+    size_t equals = spec.find('=');
+    int settings = equals == std::string::npos ? -1 : compression_settings(spec.substr(equals+1));
+    if (settings < 0) {
+      std::cerr << "Can't use branch compression " << spec << ", expected class=algorithm[:level]" << std::endl;
+      return 1;
+    }
+    if (!branch_class(spec.substr(0, equals))) {
+      std::cerr << "Can't use branch compression " << spec << ", the class must be event, eraw, qdc, trace or tagger" << std::endl;
+      return 1;
+    }
+    options.branchCompression[spec.substr(0, equals)] = settings;
+  }
 
   options.defPath                  = args::get(expdef).c_str();
   options.listPath                 = args::get(listmode).c_str();
   options.path_output              = args::get(rootfile).c_str();
 
-  if (options.timeOrder && options.live) {
-    std::cout << "Can't have live mode and time-ordering: run pxi-time-order with -l in a separate shell" << std::endl;
-    exit(EXIT_FAILURE);
-  }
-
-  if (options.timeOrder) {
-    std::string cmd = "Pixie16TimeOrder ";
-    cmd.append(options.listPath);
-    system(cmd.c_str());
-    options.listPath.append(".to");
+  if (options.timeOrder && options.nThreads > 1) {
+    std::cout << "Time-ordering reads the file as one stream, using one core" << std::endl;
+    options.nThreads = 1;
   }
   int nThreads = options.nThreads;
 
@@ -124,38 +190,68 @@ int main(int argc, char ** argv) {
     definition.print();
   }
   definition.close();
+  if (options.buildMode == PIXIE::Event::kTrigger &&
+      std::none_of(definition.channelTable.begin(), definition.channelTable.end(), [](const PIXIE::Experiment_Definition::ChannelInfo &info) {
+        return (info.flags & PIXIE::Experiment_Definition::ChannelInfo::kTrigger) != 0;
+      })) {
+    std::cerr << "Building around triggers, but the definition marks no trigger channels (R lines)" << std::endl;
+    return 1;
+  }
 
-  PIXIE::PreReader prereader(nThreads);
+  //a time-ordered stream has no offsets to split it at, it is one chunk
+  std::vector<off_t> offsets(1, 0);
+  if (!options.timeOrder) {
+    PIXIE::PreReader prereader(nThreads*options.chunksPerThread);
+    prereader.useIndex = options.useIndex && !options.live;
+    prereader.definition = &definition;
+    prereader.coincWindow = options.coincWindow;
+    prereader.disorder = options.disorder;
+    prereader.probe = options.probe;
 
-  retval = prereader.open(options.listPath);
-  if (retval < 0) {
-    std::cout << "Error, could not open listmode file: " << options.listPath << " retval= " << retval << std::endl;
-    return -1;
-  }
-  time(&starttime);
-  std::cout << "Pre-reading to determine offsets for each thread" << std::endl;
-  prereader.read(options.breakatevent);
-  prereader.print();
+    retval = prereader.open(options.listPath);
+    if (retval < 0) {
+      std::cout << "Error, could not open listmode file: " << options.listPath << " retval= " << retval << std::endl;
+      return -1;
+    }
+    time(&starttime);
+    std::cout << "Pre-reading to determine offsets for each chunk" << std::endl;
+    prereader.read(options.breakatevent);
+    prereader.print();
 
-  time(&endtime);
-  time_t preread_time = endtime-starttime;
-  std::cout << "Pre-reading time = " << preread_time << " s" << std::endl;
+    time(&endtime);
+    time_t preread_time = endtime-starttime;
+    std::cout << "Pre-reading time = " << preread_time << " s" << std::endl;
+
+    offsets = prereader.offsets;
+  }
 
   pthread_t threads[nThreads];
   pthread_attr_t attr;
   void *status;
   int rc;
   std::vector<PixieThread*> pixie_threads;
+  PIXIE::ChunkScheduler scheduler(offsets, nThreads);
+  MergedOutput *merged = nullptr;
+  MergedNTuple *mergedNTuple = nullptr;
+  if (options.merge) {
+#ifdef PIXIE2ROOT_RNTUPLE
+    if (options.rntuple) {
+      mergedNTuple = new MergedNTuple(options.path_output, options);
+    }
+    else
+#endif
+    {
+      merged = new MergedOutput(options.path_output, options.compression);
+    }
+  }
   
   for (int i=0; i<nThreads; ++i) {
-    off_t max_offset = -1;
-    if (i < nThreads-1) { max_offset = prereader.offsets[i+1]; }
-    //printf("%ld\n",max_offset);
-    PixieThread* pixie_thread = new PixieThread(options, definition, i, prereader.offsets[i], max_offset);
+    PixieThread* pixie_thread = new PixieThread(options, definition, i, &scheduler, merged, mergedNTuple);
     pixie_threads.push_back(pixie_thread);
   }
 
   time(&starttime);
+  auto wallStart = std::chrono::steady_clock::now();
   pthread_attr_init(&attr);
   pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
   for (int i=0; i<nThreads; ++i) {
@@ -180,17 +276,40 @@ int main(int argc, char ** argv) {
     reader.badcfd += (pixie_threads[i]->reader).badcfd;
     reader.subevents += (pixie_threads[i]->reader).subevents;
     reader.nEvents += (pixie_threads[i]->reader).nEvents;
+    reader.decodes += (pixie_threads[i]->reader).decodes;
+    reader.traces += (pixie_threads[i]->reader).traces;
+    reader.untriggered += (pixie_threads[i]->reader).untriggered;
     reader.sameChanPU += (pixie_threads[i]->reader).sameChanPU;
     reader.outofrange += (pixie_threads[i]->reader).outofrange;
     reader.mults[0] += (pixie_threads[i]->reader).mults[0];
     reader.mults[1] += (pixie_threads[i]->reader).mults[1];
     reader.mults[2] += (pixie_threads[i]->reader).mults[2];
     reader.mults[3] += (pixie_threads[i]->reader).mults[3];
+    reader.ioTime += (pixie_threads[i]->reader).ioTime;
+    reader.ioStall += (pixie_threads[i]->reader).ioStall;
+    reader.decodeStall += (pixie_threads[i]->reader).decodeStall;
+    reader.batch.decoded += (pixie_threads[i]->reader).batch.decoded;
+    reader.arena.allocations += (pixie_threads[i]->reader).arena.allocations;
+    reader.arena.upstream += (pixie_threads[i]->reader).arena.upstream;
+    reader.lateRecords += (pixie_threads[i]->reader).lateRecords;
+    reader.forcedRecords += (pixie_threads[i]->reader).forcedRecords;
+    reader.reorderPeak = std::max(reader.reorderPeak, (pixie_threads[i]->reader).reorderPeak);
+    reader.reorder.reordered += (pixie_threads[i]->reader).reorder.reordered;
+    reader.reorder.late += (pixie_threads[i]->reader).reorder.late;
+    reader.reorder.forced += (pixie_threads[i]->reader).reorder.forced;
+    reader.reorder.maxDisorder = std::max(reader.reorder.maxDisorder, (pixie_threads[i]->reader).reorder.maxDisorder);
+    reader.reorder.peak = std::max(reader.reorder.peak, (pixie_threads[i]->reader).reorder.peak);
     std::cout << std::endl << "[ " << i << " ] Finished sorting " << std::endl;
   }
+  //writes out whatever the merger still holds
+  delete merged;
+#ifdef PIXIE2ROOT_RNTUPLE
+  delete mergedNTuple;
+#endif
   
   time(&endtime);
   time_t filltime = endtime-starttime;
+  double wallTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
   
   // final print
   //--------------------------------------------
@@ -202,13 +321,42 @@ int main(int argc, char ** argv) {
   printf("Pileups:              " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     " ANSI_COLOR_GREEN "%5.1f%% " ANSI_COLOR_RESET "good\n", reader.pileups, 100*(1-(double)reader.pileups/(double)reader.subevents));
   printf("Same channel pileups: " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     " ANSI_COLOR_GREEN "%5.1f%% " ANSI_COLOR_RESET "good\n", reader.sameChanPU, 100*(1-(double)reader.sameChanPU/(double)reader.subevents));
   printf("Out of range:         " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     " ANSI_COLOR_GREEN "%5.1f%% " ANSI_COLOR_RESET "good\n", reader.outofrange, 100*(1-(double)reader.outofrange/(double)reader.subevents));
+  printf("Decoded twice:        " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET " records, " ANSI_COLOR_YELLOW "%lld" ANSI_COLOR_RESET " traces processed\n", reader.decodes - reader.subevents - reader.untriggered, reader.traces);
+  if (options.buildMode == PIXIE::Event::kTrigger) {
+    printf("Untriggered:          " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET " hits dropped, no trigger within the window\n", reader.untriggered);
+  }
   printf("\n");
   printf("Singles:              " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     " ANSI_COLOR_GREEN "%5.1f%% " ANSI_COLOR_RESET "\n", reader.mults[0], 100*(double)reader.mults[0]/(double)reader.nEvents);
   printf("Doubles:              " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     " ANSI_COLOR_GREEN "%5.1f%% " ANSI_COLOR_RESET "\n", reader.mults[1], 100*(double)reader.mults[1]/(double)reader.nEvents);
   printf("Triples:              " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     " ANSI_COLOR_GREEN "%5.1f%% " ANSI_COLOR_RESET "\n", reader.mults[2], 100*(double)reader.mults[2]/(double)reader.nEvents);
   printf("Quadruples:           " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     " ANSI_COLOR_GREEN "%5.1f%% " ANSI_COLOR_RESET "\n", reader.mults[3], 100*(double)reader.mults[3]/(double)reader.nEvents);
+  printf("\n");
+  printf("Read time:            " ANSI_COLOR_YELLOW "%15.1f" ANSI_COLOR_RESET " s (summed over threads)\n", reader.ioTime);
+  printf("Read stalled on fill: " ANSI_COLOR_YELLOW "%15.1f" ANSI_COLOR_RESET " s\n", reader.ioStall);
+  printf("Fill stalled on read: " ANSI_COLOR_YELLOW "%15.1f" ANSI_COLOR_RESET " s\n", reader.decodeStall);
+  printf("Event allocations:    " ANSI_COLOR_YELLOW "%15.3f" ANSI_COLOR_RESET " per event from the arena, " ANSI_COLOR_YELLOW "%.6f" ANSI_COLOR_RESET " arena blocks from the heap (other heap use not counted)\n", (double)reader.arena.allocations/(double)reader.nEvents, (double)reader.arena.upstream/(double)reader.nEvents);
+  if (options.batchDecode) {
+    printf("Batch-decoded:        " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     " ANSI_COLOR_GREEN "%5.1f%% " ANSI_COLOR_RESET "(%s)\n", reader.batch.decoded, 100*(double)reader.batch.decoded/(double)reader.subevents, PIXIE::HeaderBatch::name(reader.batch.isa));
+  }
+  if (options.timeOrder) {
+    printf("Late for time-order:  " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     " ANSI_COLOR_GREEN "%5.1f%% " ANSI_COLOR_RESET "in order, " ANSI_COLOR_YELLOW "%lld" ANSI_COLOR_RESET " forced out early, at most " ANSI_COLOR_YELLOW "%zu" ANSI_COLOR_RESET " held\n",
+           reader.lateRecords, 100*(1-(double)reader.lateRecords/(double)reader.subevents), reader.forcedRecords, reader.reorderPeak);
+  }
+  if (options.disorder > 0 || definition.offsetSpread > 0) {
+    printf("Reordered:            " ANSI_COLOR_YELLOW "%15lld" ANSI_COLOR_RESET ",     at most " ANSI_COLOR_YELLOW "%.1f" ANSI_COLOR_RESET " (10 ns) out, " ANSI_COLOR_YELLOW "%lld" ANSI_COLOR_RESET " too late, " ANSI_COLOR_YELLOW "%lld" ANSI_COLOR_RESET " forced out early, at most " ANSI_COLOR_YELLOW "%zu" ANSI_COLOR_RESET " held\n",
+           reader.reorder.reordered, (double)reader.reorder.maxDisorder/32768.0, reader.reorder.late, reader.reorder.forced, reader.reorder.peak);
+  }
+  printf("\n");
+  for (int i=0; i<nThreads; ++i) {
+    printf("[ %2i ] busy " ANSI_COLOR_YELLOW "%8.1f" ANSI_COLOR_RESET " s, idle " ANSI_COLOR_YELLOW "%8.1f" ANSI_COLOR_RESET " s, %5i chunks (%i stolen)\n",
+           i, pixie_threads[i]->busyTime, wallTime - pixie_threads[i]->busyTime, pixie_threads[i]->chunks, pixie_threads[i]->steals);
+    if (options.dspThreads > 0) {
+      printf("       decode stalled on fill " ANSI_COLOR_YELLOW "%8.1f" ANSI_COLOR_RESET " s, fill stalled on traces " ANSI_COLOR_YELLOW "%8.1f" ANSI_COLOR_RESET " s\n",
+             pixie_threads[i]->decodeWait, pixie_threads[i]->fillWait);
+    }
+  }
 
-  if (nThreads==1) {
+  if (nThreads==1 && !options.merge) {
     std::rename((options.path_output+"_"+std::to_string(0)).c_str(), (options.path_output).c_str());
   }
  
@@ -1,9 +1,42 @@
 #ifndef PIXIE2ROOT_HH
 #define PIXIE2ROOT_HH
 
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "Compression.h"
+#include "TFile.h"
+#include "TTree.h"
+#include "ROOT/TBufferMerger.hxx"
+#include "RVersion.h"
+
+//RNTuple's writing API is stable from ROOT 6.36
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,36,0)
+#define PIXIE2ROOT_RNTUPLE
+#include "ROOT/REntry.hxx"
+#include "ROOT/RNTupleFillContext.hxx"
+#include "ROOT/RNTupleModel.hxx"
+#include "ROOT/RNTupleParallelWriter.hxx"
+#include "ROOT/RNTupleWriteOptions.hxx"
+#include "ROOT/RNTupleWriter.hxx"
+#endif
+
 class options {
 public:
   int events_per_read;
+  size_t blockSize;
+  int prefetchDepth;
+  bool batchDecode;    //SIMD decoding of runs of 4-word headers
   bool live;
   size_t breakatevent;
   std::string path_output;
@@ -13,15 +46,35 @@ public:
   int coincWindow;
   int liveCount;
   bool timeOrder;
+  int reorderWindow;   //10 ns units a record is held for time-ordering
+  int disorder;        //10 ns units of disorder absorbed by event building, 0 = none
+  int buildMode;       //PIXIE::Event::Mode, where events end
   int minMult;
   bool warnings;
   int nThreads;
   bool QDCs;
   bool rawE;
   bool traces;
+  bool mmap;
+  bool directIO;
+  bool useIndex;
+  bool probe;
+  int chunksPerThread;
+  int dspThreads;
+  bool merge;
+  Long64_t autoFlush;  //bytes of baskets between flushes to the file
+  Long64_t autoSave;   //bytes between writes of the tree header
+  int checkpoint;      //s between tree header writes in live mode, 0 = only autoSave
+  int compression;     //ROOT compression settings (algorithm*100 + level), <0 = ROOT's default
+  std::map<std::string, int> branchCompression; //overrides for event, eraw, qdc, trace or tagger branches
+  bool sparse;         //one row per hit rather than branches for every channel
+  bool rntuple;        //write RawTree as an RNTuple rather than a TTree
 public:
   options()
     : events_per_read(1000),
+      blockSize(4<<20),
+      prefetchDepth(0),
+      batchDecode(false),
       live(false),
       breakatevent(0),
       path_output("pixie.root"),
@@ -29,13 +82,29 @@ public:
       coincWindow(-1),
       liveCount(0),
       timeOrder(false),
+      reorderWindow(100000),
+      disorder(0),
+      buildMode(0),
       minMult(1),
       warnings(false),
       nThreads(1),
       QDCs(false),
       rawE(false),
-      traces(false)
-      
+      traces(false),
+      mmap(false),
+      directIO(false),
+      useIndex(true),
+      probe(false),
+      chunksPerThread(1),
+      dspThreads(0),
+      merge(false),
+      autoFlush(30000000),
+      autoSave(300000000),
+      checkpoint(0),
+      compression(-1),
+      sparse(false),
+      rntuple(false)
+
   { }
 };
 
@@ -94,6 +163,59 @@ struct PixieTraceEvent {
   }
 };
 
+/* Sparse layout: every event holds mult hits, each column is an array
+   over the hits.  id is crate<<8 | slot<<4 | channel as in the header,
+   QDCSums has 8 per hit, and traceFirst is the index in traceMeas of the
+   hit's first trace measurement (-1 = none).  The vectors only grow, the
+   tree is pointed at their new storage when they do. */
+struct PixieHits {
+  Int_t mult;
+  Int_t nTrace;
+  std::vector<UShort_t> id;
+  std::vector<UChar_t> tagger;
+  std::vector<ULong64_t> eventTime;
+  std::vector<UInt_t> eventRelTime;
+  std::vector<UInt_t> finishCode;
+  std::vector<UInt_t> CFDForce;
+  std::vector<UInt_t> eventEnergy;
+  std::vector<UInt_t> outOfRange;
+
+  std::vector<UInt_t> ESumTrailing;
+  std::vector<UInt_t> ESumLeading;
+  std::vector<UInt_t> ESumGap;
+  std::vector<UInt_t> baseline;
+
+  std::vector<UInt_t> QDCSums;
+
+  std::vector<Int_t> traceFirst;
+  std::vector<Int_t> traceMeas;
+
+public:
+  PixieHits() : mult(0), nTrace(0) { reserve(64, 256); }
+  //true if any storage moved
+  bool reserve(size_t hits, size_t traces) {
+    bool moved = false;
+    if (hits > id.size()) {
+      hits = std::max(hits, 2*id.size());
+      for (auto *column : {&eventRelTime, &finishCode, &CFDForce, &eventEnergy, &outOfRange,
+                           &ESumTrailing, &ESumLeading, &ESumGap, &baseline}) {
+        column -> resize(hits);
+      }
+      id.resize(hits);
+      tagger.resize(hits);
+      eventTime.resize(hits);
+      QDCSums.resize(8*hits);
+      traceFirst.resize(hits);
+      moved = true;
+    }
+    if (traces > traceMeas.size()) {
+      traceMeas.resize(std::max(traces, 2*traceMeas.size()));
+      moved = true;
+    }
+    return moved;
+  }
+};
+
 struct PixieTagger {
   ULong64_t taggerTime;
   //UInt_t taggerRelTime;
@@ -104,6 +226,191 @@ public:
   void Reset() { taggerTime = 0; taggerValue = 0; taggerNew = 0; }
 };
 
+/* One output file shared by all threads (--merge).  Each thread writes
+   into its own in-memory file and hands it to the merger after every
+   batch; the mutex makes the order in which buffers are queued, and so
+   merged, the same as the order in which entries are counted, so each
+   thread's ChunkIndex rows point at the right RawTree entries. */
+struct MergedOutput {
+  ROOT::TBufferMerger merger;
+  std::mutex mutex;
+  Long64_t entries; //RawTree entries handed to the merger so far
+
+  MergedOutput(const std::string &path, int compression)
+    : merger(path.c_str(), "recreate", compression < 0 ? (int)ROOT::RCompressionSetting::EDefaults::kUseCompiledDefault : compression),
+      entries(0) {}
+};
+
+//"zstd:5" to ROOT compression settings, algorithm none/zlib/lzma/lz4/zstd, level optional; -1 if not understood
+int compression_settings(const std::string &spec);
+//a class of branches the writers give --branch-compression to: event, eraw, qdc, trace or tagger
+bool branch_class(const std::string &name);
+
+/* Where Process and Pipeline send their events: RawTree as a TTree
+   (TreeWriter) or an RNTuple (NTupleWriter) */
+class OutputWriter {
+public:
+  virtual ~OutputWriter() {}
+
+  virtual void branch(std::ofstream &log) = 0;
+  virtual void start_chunk(int seq) {}             //the events that follow come from chunk seq
+  virtual int fill(const PIXIE::HitBatch &batch, size_t event) = 0; //1 if the event made it into the output
+  virtual void flush(int seq) = 0;                 //after each batch of events from chunk seq
+  virtual void end_chunk(int seq) = 0;
+  virtual void write() = 0;
+};
+
+/* Owns the RawTree branch buffers of one output file: sets them from an
+   event and fills the tree, and keeps the ChunkIndex tree recording which
+   entries came from which chunk of the listmode file.  Baskets go to the
+   file as they fill up (autoFlush) and the tree header is only rewritten
+   every autoSave bytes or checkpoint seconds, not after each batch.  When
+   merging, a
+   chunk is written in several segments (one per batch), each with its own
+   ChunkIndex row.  Chunks are written as the threads finish them, not in
+   file order; ChunkOrder (chunk_index.hh) reads RawTree back in order. */
+class TreeWriter : public OutputWriter {
+public:
+  TTree *tree;
+  TTree *chunkTree;
+
+private:
+  options opt;
+  TFile *file;
+  MergedOutput *merged;
+  Long64_t segmentEntries; //filled since the last flush
+  std::chrono::steady_clock::time_point lastCheckpoint;
+  PIXIE::Experiment_Definition *definition;
+  //branch buffers by ChannelInfo::index, NULL for channels without branches
+  std::vector<PixieEvent*> detector_data;
+  std::vector<PixieTraceEvent*> detector_tracedata;
+  std::vector<PixieTagger*> tagger_data;
+
+  //which entries of RawTree came from which chunk of the file, to put them back in time order
+  Int_t chunkSeq;
+  Long64_t chunkFirstEntry, chunkEntries;
+
+  PixieHits hits;
+
+  TBranch *compress(TBranch *branch, const char *branchClass);
+  void bind_hits(bool create);
+  int fill_hits(const PIXIE::HitBatch &batch, size_t event);
+
+public:
+  TreeWriter(const options &op, PIXIE::Experiment_Definition *def, TFile *f, MergedOutput *m = nullptr);
+  ~TreeWriter();
+
+  void branch(std::ofstream &log);
+  int fill(const PIXIE::HitBatch &batch, size_t event);
+  void flush(int seq);
+  void end_chunk(int seq);
+  void write();
+};
+
+struct MergedNTuple;
+
+#ifdef PIXIE2ROOT_RNTUPLE
+/* RawTree as an RNTuple, in the sparse layout: each entry holds
+   collections over its hits, with the QDC sums as an array of 8 per hit
+   and the trace measurements as a collection per hit, so nothing is
+   stored for channels that did not fire.  RNTuple compresses a whole
+   file with one setting and has no header to checkpoint; the dataset is
+   only readable once write() commits it.  Entries from several threads
+   are interleaved a cluster at a time, so rather than a ChunkIndex every
+   entry carries the chunk it came from. */
+class NTupleWriter : public OutputWriter {
+private:
+  options opt;
+  PIXIE::Experiment_Definition *definition;
+  std::unique_ptr<ROOT::RNTupleWriter> writer;                      //own file
+  std::shared_ptr<ROOT::Experimental::RNTupleFillContext> context;  //or a share of a merged one
+  std::unique_ptr<ROOT::REntry> entry;
+
+  std::shared_ptr<std::int32_t> chunk;
+  std::shared_ptr<std::vector<std::uint16_t>> id;
+  std::shared_ptr<std::vector<std::uint8_t>> tagger;
+  std::shared_ptr<std::vector<std::uint64_t>> eventTime;
+  std::shared_ptr<std::vector<std::uint32_t>> eventRelTime;
+  std::shared_ptr<std::vector<std::uint32_t>> finishCode;
+  std::shared_ptr<std::vector<std::uint32_t>> CFDForce;
+  std::shared_ptr<std::vector<std::uint32_t>> eventEnergy;
+  std::shared_ptr<std::vector<std::uint32_t>> outOfRange;
+  std::shared_ptr<std::vector<std::uint32_t>> ESumTrailing;
+  std::shared_ptr<std::vector<std::uint32_t>> ESumLeading;
+  std::shared_ptr<std::vector<std::uint32_t>> ESumGap;
+  std::shared_ptr<std::vector<std::uint32_t>> baseline;
+  std::shared_ptr<std::vector<std::array<std::uint32_t, 8>>> QDCSums;
+  std::shared_ptr<std::vector<std::vector<std::int32_t>>> traceMeas;
+
+public:
+  //the fields for the options, and how to write them
+  static std::unique_ptr<ROOT::RNTupleModel> model(const options &op);
+  static ROOT::RNTupleWriteOptions write_options(const options &op);
+
+  NTupleWriter(const options &op, PIXIE::Experiment_Definition *def, const std::string &path, MergedNTuple *m = nullptr);
+
+  void branch(std::ofstream &log);
+  void start_chunk(int seq);
+  int fill(const PIXIE::HitBatch &batch, size_t event);
+  void flush(int seq);
+  void end_chunk(int seq);
+  void write();
+};
+
+/* One RawTree RNTuple for all threads (--merge --rntuple), each thread
+   filling through its own context */
+struct MergedNTuple {
+  std::unique_ptr<ROOT::Experimental::RNTupleParallelWriter> writer;
+  MergedNTuple(const std::string &path, const options &op)
+    : writer(ROOT::Experimental::RNTupleParallelWriter::Recreate(NTupleWriter::model(op), "RawTree", path, NTupleWriter::write_options(op))) {}
+};
+#endif
+
+/* Optional pipelined engine for one output file.  The thread running
+   Process decodes and builds events into batches (leaving traces
+   unprocessed), a pool of workers runs the trace algorithms on whole
+   batches, and a single writer thread fills the tree.  Batches travel
+   through lock-free bounded queues: every batch goes to the workers and,
+   in order, to the writer, which waits for each to be processed before
+   filling it, so the tree keeps the file order.  A fixed pool of batches
+   is recycled, bounding the memory in flight. */
+class Pipeline {
+public:
+  struct Batch {
+    PIXIE::HitBatch hits;
+    int chunk;                   //chunk the events came from
+    bool chunkEnd;               //no events, marks the end of the chunk
+    std::atomic<bool> processed; //traces done, ready to be written
+    Batch() : chunk(0), chunkEnd(false), processed(false) {}
+  };
+
+  double decodeWait; //s the decoder waited for a free batch
+  double fillWait;   //s the writer waited for traces to be processed
+
+private:
+  OutputWriter &writer;
+  const PIXIE::Experiment_Definition &definition;
+  int nWorkers;
+  std::vector<Batch*> batches;
+  PIXIE::BoundedQueue<Batch*> freeBatches;
+  PIXIE::BoundedQueue<Batch*> toProcess;
+  PIXIE::BoundedQueue<Batch*> toWrite;
+  std::vector<std::thread> workers;
+  std::thread writerThread;
+
+  void process();
+  void write();
+
+public:
+  Pipeline(OutputWriter &w, const PIXIE::Experiment_Definition &def, int workers, int depth);
+  ~Pipeline();
+
+  Batch *acquire();          //an empty batch for the decoder to fill
+  void submit(Batch *batch);
+  void end_chunk(int seq);
+  void finish();             //drain the queues and stop the threads
+};
+
 class PixieThread {
 public:
   //TFile *file;
@@ -111,12 +418,18 @@ public:
   PIXIE::Experiment_Definition definition;
   options opt;
   int threadNum;
-  unsigned long long offset;
-  unsigned long long max_offset;
+  PIXIE::ChunkScheduler *scheduler;
+  MergedOutput *merged; //all threads write to one file, NULL = one file each
+  MergedNTuple *mergedNTuple; //the same for --rntuple
+  int chunks;      //chunks sorted by this thread
+  int steals;      //of which taken from other threads
+  double busyTime; //s spent sorting chunks
+  double decodeWait; //pipelined mode: s waiting on trace processing/filling
+  double fillWait;   //pipelined mode: s waiting on trace processing
   //PIXIE::Trace::Algorithm *tracealg;
   //PixieThread(TFile *f, PIXIE::Reader r, options op, int i, unsigned long long off) : file(f), reader(r), opt(op), threadNum(i), offset(off) {};
 
-  PixieThread(options op, PIXIE::Experiment_Definition def, int i, unsigned long long off, unsigned long long moff) : opt(op), definition(def), threadNum(i), offset(off), max_offset(moff) {
+  PixieThread(options op, PIXIE::Experiment_Definition def, int i, PIXIE::ChunkScheduler *sched, MergedOutput *m = nullptr, MergedNTuple *mn = nullptr) : opt(op), definition(def), threadNum(i), scheduler(sched), merged(m), mergedNTuple(mn), chunks(0), steals(0), busyTime(0), decodeWait(0), fillWait(0) {
   };  
 };
 
@@ -0,0 +1,896 @@
+/*
+  pixie_bench: synthetic benchmarks for the stages of a pixie2root conversion
+  Each benchmark builds its own data, so no listmode file is needed
+*/
+
+#include<iostream>
+#include<vector>
+#include<string>
+#include<random>
+#include<chrono>
+#include<atomic>
+#include<new>
+#include<cstdlib>
+#include<cstdio>
+#include<cstring>
+#include<cmath>
+#include<sys/stat.h>
+
+/* EXTERN */
+#include "args/args.hxx"
+
+#include "TROOT.h"
+#include "TFile.h"
+#include "TTree.h"
+
+#include "pixie.hh"
+#include "trace_algorithms.hh"
+#include "pixie2root.hh"
+
+#ifdef PIXIE2ROOT_RNTUPLE
+#include "ROOT/RNTupleReader.hxx"
+#include "ROOT/RNTupleView.hxx"
+#endif
+
+//every operator new of the process, so bench build can show the event loop allocates nothing
+static std::atomic<long long> heapAllocations(0);
+
+void *operator new(std::size_t size) {
+  heapAllocations.fetch_add(1, std::memory_order_relaxed);
+  if (void *p = std::malloc(size ? size : 1)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+namespace {
+  double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+
+  double file_mb(const std::string &path) {
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0) {
+      return 0;
+    }
+    return st.st_size/1e6;
+  }
+
+  //16 channels per slot in slots 2-15 of as many crates as needed, all 250 MHz
+  void make_definition(PIXIE::Experiment_Definition &definition, int nChannels) {
+    for (int i=0; i<nChannels; ++i) {
+      int crate = i/(16*14);
+      int slot = 2 + (i/16)%14;
+      definition.AddCrate(crate);
+      definition.AddSlot(crate, slot, 250);
+      definition.AddChannel(crate, slot, i%16);
+      definition.detectors.push_back(definition.GetChannel(crate, slot, i%16));
+    }
+    definition.compile();
+  }
+
+  //events of mult hits on distinct random channels, 10 ns apart
+  void make_events(PIXIE::HitBatch &hits, int nEvents, const PIXIE::Experiment_Definition &definition, int mult, std::mt19937 &rng) {
+    std::uniform_int_distribution<int> channel(0, definition.detectors.size()-1);
+    std::uniform_int_distribution<uint32_t> energy(0, 0xFFFF);
+    static uint64_t time = 0;
+    hits.clear();
+    for (int i=0; i<nEvents; ++i) {
+      PIXIE::Event event;
+      for (int m=0; m<mult; ++m) {
+        const PIXIE::Experiment_Definition::Channel *chan;
+        do {
+          chan = definition.detectors[channel(rng)];
+        } while (event.GetMeasurement(chan->crateID, chan->slotID, chan->channelNumber));
+        PIXIE::Measurement meas;
+        meas.crateID = chan->crateID;
+        meas.slotID = chan->slotID;
+        meas.channelNumber = chan->channelNumber;
+        meas.headerLength = 4;
+        meas.eventLength = 4;
+        meas.eventTime = time;
+        meas.eventEnergy = energy(rng);
+        event.AddMeasurement(meas);
+        time += 10<<15;
+      }
+      hits.add(event);
+      time += 10000<<15;
+    }
+  }
+
+  //the first header word of a record of headerLength words and traceLength samples
+  uint32_t header_word(const PIXIE::Experiment_Definition::Channel *chan, uint32_t headerLength, uint32_t traceLength) {
+    return chan->channelNumber | (chan->slotID<<4) | (chan->crateID<<8) | (headerLength<<12) | ((headerLength + traceLength/2)<<17);
+  }
+
+  /* How write_listmode lays out its events: mult hits each (1 to mult at
+     random with randomMult), hitGap clock ticks after every hit and
+     eventGap more after every event.  A gap is its minimum plus an
+     exponential of the given mean, so 0 keeps it fixed. */
+  struct Listmode {
+    struct Gap {
+      uint64_t min;
+      double mean;
+    };
+    int mult = 1;
+    bool randomMult = false;
+    bool qdcs = false;         //12-word headers with QDC sums instead of 4 words
+    uint32_t traceLength = 0;  //samples of a pulse on half the hits of channels with traces
+    Gap hitGap = {2, 0};
+    Gap eventGap = {5000, 0};
+    long long traced = 0;      //hits written with a trace
+  };
+
+  /* Writes a listmode file of nEvents events on random channels, shaped
+     by layout, and returns its size in MB */
+  double write_listmode(const std::string &path, const PIXIE::Experiment_Definition &definition, int nEvents, Listmode &layout, std::mt19937 &rng) {
+    std::uniform_int_distribution<int> channel(0, definition.detectors.size()-1);
+    std::uniform_int_distribution<int> mult(1, layout.mult);
+    std::uniform_int_distribution<uint32_t> energy(0, 0xFFFF);
+    std::uniform_int_distribution<int> coin(0, 1);
+    std::uniform_int_distribution<int> amplitude(0, 1999);
+    std::uniform_int_distribution<int> jitter(0, 9);
+    std::uniform_int_distribution<int> noise(0, 7);
+    std::exponential_distribution<double> qdc(1.0/2000);
+    std::exponential_distribution<double> hitGap(1.0/std::max(layout.hitGap.mean, 1.0));
+    std::exponential_distribution<double> eventGap(1.0/std::max(layout.eventGap.mean, 1.0));
+    uint32_t headerLength = layout.qdcs ? 12 : 4;
+    std::vector<uint16_t> trace(layout.traceLength);
+    uint64_t timestamp = 1000;
+    layout.traced = 0;
+    FILE *fpw = fopen(path.c_str(), "wb");
+    for (int i=0; i<nEvents; ++i) {
+      int hits = layout.randomMult ? mult(rng) : layout.mult;
+      for (int m=0; m<hits; ++m) {
+        const PIXIE::Experiment_Definition::Channel *chan = definition.detectors[channel(rng)];
+        uint32_t traceLength = chan->traces && coin(rng) ? layout.traceLength : 0;
+        uint32_t words[12] = {0};
+        words[0] = header_word(chan, headerLength, traceLength);
+        words[1] = timestamp & 0xFFFFFFFF;
+        words[2] = (timestamp>>32) & 0xFFFF;
+        words[3] = energy(rng) | (traceLength<<16);
+        for (uint32_t q=4; q<headerLength; ++q) {
+          words[q] = qdc(rng);
+        }
+        fwrite(words, 4, headerLength, fpw);
+        if (traceLength) {
+          //a baseline of 400 with a pulse decaying over 20 samples from 5/8 of the way in
+          double height = amplitude(rng);
+          uint32_t start = traceLength*5/8 + jitter(rng);
+          for (uint32_t k=0; k<traceLength; ++k) {
+            trace[k] = 400 + noise(rng) + (k >= start ? height*std::exp(-(k - start)/20.0) : 0);
+          }
+          fwrite(trace.data(), 2, traceLength, fpw);
+          layout.traced += 1;
+        }
+        timestamp += layout.hitGap.min + (layout.hitGap.mean > 0 ? (uint64_t)hitGap(rng) : 0);
+      }
+      timestamp += layout.eventGap.min + (layout.eventGap.mean > 0 ? (uint64_t)eventGap(rng) : 0);
+    }
+    fclose(fpw);
+    return file_mb(path);
+  }
+
+  /* Converts a synthetic listmode file with each output compression and
+     reports the conversion rate against the size of the ROOT file */
+  int bench_compress(int nChannels, int mult, int nEvents, int batch, const std::string &path, bool qdcs) {
+    PIXIE::Experiment_Definition definition;
+    make_definition(definition, nChannels);
+    for (auto *channel : definition.detectors) {
+      channel -> qdcs = qdcs;
+    }
+    std::mt19937 rng(1);
+    std::string listPath = path + ".evt";
+    Listmode layout;
+    layout.mult = mult;
+    layout.qdcs = qdcs;
+    double inputMB = write_listmode(listPath, definition, nEvents, layout, rng);
+
+    printf("%d channels, multiplicity %d, %d events, %.1f MB of listmode data\n", nChannels, mult, nEvents, inputMB);
+    const char *settings[][2] = {
+      {"none", ""}, {"zlib:1", ""}, {"zlib:6", ""}, {"lz4:4", ""}, {"zstd:5", ""}, {"lzma:7", ""},
+      {"lz4:4", "qdc=zstd:9"},
+    };
+    for (const auto &setting : settings) {
+      if (!qdcs && setting[1][0]) {
+        continue;
+      }
+      options opt;
+      opt.QDCs = qdcs;
+      opt.compression = compression_settings(setting[0]);
+      if (setting[1][0]) {
+        opt.branchCompression["qdc"] = compression_settings(strchr(setting[1], '=')+1);
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      PIXIE::Reader reader;
+      reader.definition = definition;
+      reader.open(listPath);
+      reader.start();
+
+      TFile *file = new TFile(path.c_str(), "recreate");
+      file -> SetCompressionSettings(opt.compression);
+      TreeWriter writer(opt, &(reader.definition), file);
+      std::ofstream log("/dev/null");
+      writer.branch(log);
+
+      PIXIE::HitBatch hits;
+      while (true) {
+        hits.clear();
+        reader.read(hits, 20, batch, -1, false);
+        for (size_t event=0; event<hits.events(); ++event) {
+          writer.fill(hits, event);
+        }
+        writer.flush(0);
+        if (reader.eof() || reader.end) {
+          break;
+        }
+      }
+      writer.end_chunk(0);
+      writer.write();
+      reader.close();
+      file -> Close();
+      double elapsed = seconds_since(start);
+      delete file;
+
+      std::string name = std::string(setting[0]) + (setting[1][0] ? std::string(", ") + setting[1] : "");
+      printf("%-22s %8.1f MB/s %8.1f MB written (%4.1f%%)\n", name.c_str(), inputMB/elapsed, file_mb(path), 100*file_mb(path)/inputMB);
+    }
+    std::remove(path.c_str());
+    std::remove(listPath.c_str());
+    return 0;
+  }
+
+  /* Event building rate over a synthetic listmode file, into a vector
+     of Event objects and into one HitBatch reused read after read, with
+     the allocations the reader's arena served and everything the read
+     loop took from the heap: operator new and the arena's own blocks */
+  int bench_build(int nChannels, int mult, int nEvents, int batch, const std::string &path) {
+    PIXIE::Experiment_Definition definition;
+    make_definition(definition, nChannels);
+    std::mt19937 rng(1);
+    std::string listPath = path + ".evt";
+    Listmode layout;
+    layout.mult = mult;
+    double inputMB = write_listmode(listPath, definition, nEvents, layout, rng);
+
+    printf("%d channels, multiplicity %d, %d events, %.1f MB of listmode data\n", nChannels, mult, nEvents, inputMB);
+    const char *outputs[] = {"std::vector<Event>", "HitBatch"};
+    for (int output=0; output<2; ++output) {
+      PIXIE::Reader reader;
+      reader.definition = definition;
+      reader.open(listPath);
+      reader.start();
+
+      uint64_t check = 0;
+      std::vector<PIXIE::Event> events;
+      PIXIE::HitBatch hits;
+      long long heapBefore = heapAllocations.load();
+      auto start = std::chrono::steady_clock::now();
+      while (true) {
+        if (output == 0) {
+          events.clear();
+          reader.read(events, 20, batch, -1, false);
+          for (auto &event : events) {
+            for (auto &meas : event.fMeasurements) {
+              check += meas.eventTime + meas.eventEnergy;
+            }
+          }
+        }
+        else {
+          hits.clear();
+          reader.read(hits, 20, batch, -1, false);
+          for (size_t h=0; h<hits.hits(); ++h) {
+            check += hits.eventTime[h] + hits.eventEnergy[h];
+          }
+        }
+        if (reader.eof() || reader.end) {
+          break;
+        }
+      }
+      double elapsed = seconds_since(start);
+      long long heap = heapAllocations.load() - heapBefore + reader.arena.upstream;
+      reader.close();
+      printf("%-22s %10.0f events/s (check %llx), %.3f arena and %.6f heap allocations per event\n", outputs[output], reader.nEvents/elapsed, (unsigned long long)check,
+             (double)reader.arena.allocations/reader.nEvents, (double)heap/reader.nEvents);
+    }
+    std::remove(listPath.c_str());
+    return 0;
+  }
+
+  /* Building events from a steady stream of hits on random channels,
+     every eighth channel a trigger, arriving on average every 20 clock
+     ticks: dense enough that rolling events chain, and with each mode
+     of the event builder */
+  int bench_modes(int nChannels, int nHits, int batch, const std::string &path) {
+    PIXIE::Experiment_Definition definition;
+    make_definition(definition, nChannels);
+    for (size_t i=0; i<definition.detectors.size(); i+=8) {
+      definition.detectors[i] -> isTrigger = true;
+    }
+    definition.compile();
+
+    //single hits, so the events are only what the builder makes of them
+    std::mt19937 rng(1);
+    std::string listPath = path + ".evt";
+    Listmode layout;
+    layout.hitGap = {1, 20};
+    layout.eventGap = {0, 0};
+    double inputMB = write_listmode(listPath, definition, nHits, layout, rng);
+
+    printf("%d channels, %d hits, %.1f MB of listmode data\n", nChannels, nHits, inputMB);
+    const char *names[] = {"rolling", "fixed window", "trigger"};
+    for (int mode=PIXIE::Event::kRolling; mode<=PIXIE::Event::kTrigger; ++mode) {
+      PIXIE::Reader reader;
+      reader.definition = definition;
+      reader.buildMode = (PIXIE::Event::Mode)mode;
+      reader.open(listPath);
+      reader.start();
+
+      PIXIE::HitBatch hits;
+      uint32_t largest = 0;
+      auto start = std::chrono::steady_clock::now();
+      while (true) {
+        hits.clear();
+        reader.read(hits, 20, batch, -1, false);
+        for (size_t event=0; event<hits.events(); ++event) {
+          largest = std::max(largest, hits.mult(event));
+        }
+        if (reader.eof() || reader.end) {
+          break;
+        }
+      }
+      double elapsed = seconds_since(start);
+      reader.close();
+      printf("%-14s %10.0f hits/s, %10.0f events/s, multiplicity %.2f mean, %u largest, %lld hits dropped\n", names[mode],
+             (reader.subevents + reader.untriggered)/elapsed, reader.nEvents/elapsed, (double)reader.subevents/reader.nEvents, largest, reader.untriggered);
+    }
+    std::remove(listPath.c_str());
+    return 0;
+  }
+
+  //checksum of the hits of a read and their trace results, in order
+  uint64_t event_checksum(uint64_t check, const std::vector<PIXIE::Event> &events) {
+    for (const auto &event : events) {
+      for (const auto &meas : event.fMeasurements) {
+        check = check*1000003 + meas.eventTime + 7*meas.eventEnergy + (meas.crateID<<8 | meas.slotID<<4 | meas.channelNumber);
+        for (int32_t datum : meas.trace_meas) {
+          check = check*31 + (uint32_t)datum;
+        }
+      }
+      check = check*1000003 + event.fMeasurements.size();
+    }
+    return check;
+  }
+
+  /* Builds the events of a synthetic file, with traces on every third
+     channel, once reading again the record that closes each event and
+     once keeping it as the lookahead of the next, through stdio, block
+     reads and batch decoding: the events and trace results must be the
+     same, and with the lookahead each traced hit processed exactly once */
+  int bench_lookahead(int nChannels, int nEvents, int batch, const std::string &path) {
+    std::string algPath = path + ".trap";
+    FILE *fpa = fopen(algPath.c_str(), "w");
+    fprintf(fpa, "1 10 5 40 20 50.0 8 4 30.0 5.0\n");
+    fclose(fpa);
+
+    PIXIE::Experiment_Definition definition;
+    make_definition(definition, nChannels);
+    for (size_t i=0; i<definition.detectors.size(); i+=3) {
+      auto *channel = definition.detectors[i];
+      channel -> traces = true;
+      if (PIXIE::setTraceAlg(channel->alg, "trapfilter", algPath, 1) < 0) {
+        std::cerr << "No trapfilter trace algorithm" << std::endl;
+        return 1;
+      }
+    }
+    definition.compile();
+
+    //events of 1-4 hits, half the hits of traced channels with a 64 sample pulse
+    std::mt19937 rng(1);
+    std::string listPath = path + ".evt";
+    Listmode layout;
+    layout.mult = 4;
+    layout.randomMult = true;
+    layout.traceLength = 64;
+    layout.hitGap = {1, 20};
+    layout.eventGap = {3000, 1500};
+    double inputMB = write_listmode(listPath, definition, nEvents, layout, rng);
+    long long traced = layout.traced;
+
+    printf("%d channels, %d events, %lld traced hits, %.1f MB of listmode data\n", nChannels, nEvents, traced, inputMB);
+    const char *paths[] = {"stdio", "block reads", "batch decode"};
+    int failed = 0;
+    for (int input=0; input<3; ++input) {
+      uint64_t check[2] = {0, 0};
+      long long events[2] = {0, 0};
+      long long traces[2] = {0, 0};
+      for (int keep=0; keep<2; ++keep) {
+        PIXIE::Reader reader;
+        reader.definition = definition;
+        reader.blockSize = input == 0 ? 0 : 1<<16;
+        reader.batchDecode = input == 2;
+        reader.keepLookahead = keep;
+        reader.open(listPath);
+        reader.start();
+
+        std::vector<PIXIE::Event> built;
+        while (true) {
+          built.clear();
+          reader.read(built, 3, batch, -1, false);
+          check[keep] = event_checksum(check[keep], built);
+          if (reader.eof() || reader.end) {
+            break;
+          }
+        }
+        reader.close();
+        events[keep] = reader.nEvents;
+        traces[keep] = reader.traces;
+      }
+      bool same = check[0] == check[1] && events[0] == events[1];
+      bool once = traces[1] == traced;
+      printf("%-14s %lld events, %s (check %llx), %lld traces processed without the lookahead and %lld with it%s\n", paths[input], events[1],
+             same ? "identical" : "DIFFERENT", (unsigned long long)check[1], traces[0], traces[1], once ? "" : ", NOT once per traced hit");
+      failed += !same || !once;
+    }
+    std::remove(listPath.c_str());
+    std::remove(algPath.c_str());
+    return failed ? 1 : 0;
+  }
+
+  //the same-channel search Event::GetMeasurement used to do
+  const PIXIE::Measurement *scan(const PIXIE::Event &event, int crate, int slot, int chan) {
+    for (const auto &meas : event.fMeasurements) {
+      if (meas.crateID == crate && meas.slotID == slot && meas.channelNumber == chan) {
+        return &meas;
+      }
+    }
+    return NULL;
+  }
+
+  /* Building events of mult hits on random channels, looking for an
+     earlier hit in the same channel before adding each: by searching
+     the hits, and through the event's channel table */
+  int bench_pileup(int nChannels, int mult, int nEvents) {
+    PIXIE::Experiment_Definition definition;
+    make_definition(definition, nChannels);
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> channel(0, definition.detectors.size()-1);
+    std::vector<const PIXIE::Experiment_Definition::Channel*> hits(mult*1000);
+    for (auto &hit : hits) {
+      hit = definition.detectors[channel(rng)];
+    }
+
+    printf("%d channels, multiplicity %d, %d events\n", nChannels, mult, nEvents);
+    const char *methods[] = {"search the hits", "channel table"};
+    for (int method=0; method<2; ++method) {
+      PIXIE::Event event;
+      PIXIE::Measurement meas;
+      long long pileups = 0;
+      auto start = std::chrono::steady_clock::now();
+      for (int i=0; i<nEvents; ++i) {
+        event.clear();
+        for (int m=0; m<mult; ++m) {
+          const auto *chan = hits[(i*mult + m) % hits.size()];
+          const PIXIE::Measurement *dup = method == 0 ? scan(event, chan->crateID, chan->slotID, chan->channelNumber)
+                                                      : event.GetMeasurement(chan->crateID, chan->slotID, chan->channelNumber);
+          if (dup) {
+            ++pileups;
+          }
+          meas.crateID = chan->crateID;
+          meas.slotID = chan->slotID;
+          meas.channelNumber = chan->channelNumber;
+          event.AddMeasurement(meas);
+        }
+      }
+      double elapsed = seconds_since(start);
+      printf("%-22s %8.1f M hits/s (%lld same-channel)\n", methods[method], (double)nEvents*mult/elapsed/1e6, pileups);
+    }
+    return 0;
+  }
+
+  /* RawTree fill rate, writing the whole tree after every batch (as
+     pixie2root used to) or leaving the baskets to autoFlush */
+  int bench_fill(int nChannels, int mult, int nEvents, int batch, const std::string &path) {
+    PIXIE::Experiment_Definition definition;
+    make_definition(definition, nChannels);
+    std::mt19937 rng(1);
+    PIXIE::HitBatch hits;
+    make_events(hits, batch, definition, mult, rng);
+
+    printf("%d channels, multiplicity %d, %d events in batches of %d\n", nChannels, mult, nEvents, batch);
+    for (int everyBatch=1; everyBatch>=0; --everyBatch) {
+      options opt;
+      TFile *file = new TFile(path.c_str(), "recreate");
+      TreeWriter writer(opt, &definition, file);
+      std::ofstream log("/dev/null");
+      writer.branch(log);
+
+      auto start = std::chrono::steady_clock::now();
+      for (int done=0; done<nEvents; done+=batch) {
+        for (size_t event=0; event<hits.events(); ++event) {
+          writer.fill(hits, event);
+        }
+        if (everyBatch) {
+          writer.tree -> Write();
+        }
+        else {
+          writer.flush(0);
+        }
+      }
+      writer.end_chunk(0);
+      writer.write();
+      file -> Purge();
+      file -> Close();
+      double elapsed = seconds_since(start);
+      delete file;
+
+      printf("%-22s %10.0f events/s %8.1f MB written\n", everyBatch ? "Write() every batch" : "autoFlush", nEvents/elapsed, file_mb(path));
+    }
+    std::remove(path.c_str());
+    return 0;
+  }
+
+  //the CFD and time decoders before they were specialised: frequency tested per record
+  PIXIE::CFD cfd_runtime(unsigned int data, int frequency) {
+    using PIXIE::Measurement;
+    PIXIE::CFD retval = {};
+    if (frequency == 100) {
+      retval = {static_cast<int>(Measurement::mCFDTime100(data)), Measurement::mCFDForce100(data)};
+    }
+    else if (frequency == 250) {
+      int CFDTime                = Measurement::mCFDTime250(data);
+      unsigned int CFDTrigSource = Measurement::mCFDTrigSource250(data);
+      retval.CFDForce = Measurement::mCFDForce250(data);
+      if (retval.CFDForce == 0) {
+        retval.CFDFraction = CFDTime - 16384*static_cast<int>(CFDTrigSource);
+      }
+      else {
+        retval.CFDFraction = 16384;
+      }
+    }
+    else if (frequency == 500) {
+      int CFDTime                = Measurement::mCFDTime500(data);
+      unsigned int CFDTrigSource = Measurement::mCFDTrigSource500(data);
+      if (CFDTrigSource == 7) {
+        retval.CFDForce = 1;
+        retval.CFDFraction = 40960*4/5;
+      }
+      else {
+        retval.CFDForce = 0;
+        retval.CFDFraction = (CFDTime + 8192*(static_cast<int>(CFDTrigSource)-1))*4/5;
+      }
+    }
+    return retval;
+  }
+
+  PIXIE::EventTime time_runtime(unsigned long long timestamp, unsigned int cfddat, int frequency) {
+    PIXIE::CFD cfd = cfd_runtime(cfddat, frequency);
+    unsigned long long time = (timestamp << 15) + cfd.CFDFraction;
+    if (frequency == 250) {
+      time = time*8/10;
+    }
+    return {time, cfd.CFDForce};
+  }
+
+  //the header decoder before it was specialised: frequency and header length tested per record
+  void decode_runtime(PIXIE::Measurement &meas, const uint32_t *words, int frequency) {
+    using PIXIE::Measurement;
+    meas.channelNumber = Measurement::mChannelNumber(words[0]);
+    meas.slotID        = Measurement::mSlotID(words[0]);
+    meas.crateID       = Measurement::mCrateID(words[0]);
+    meas.headerLength  = Measurement::mHeaderLength(words[0]);
+    meas.eventLength   = Measurement::mEventLength(words[0]);
+    meas.finishCode    = Measurement::mFinishCode(words[0]);
+    uint64_t timestamp = ((uint64_t)Measurement::mTimeHigh(words[2])<<32) + Measurement::mTimeLow(words[1]);
+    PIXIE::EventTime time = time_runtime(timestamp, words[2], frequency);
+    meas.eventTime   = time.time;
+    meas.CFDForce    = time.CFDForce;
+    meas.eventEnergy = Measurement::mEventEnergy(words[3]);
+    meas.traceLength = Measurement::mTraceLength(words[3]);
+    meas.outOfRange  = Measurement::mTraceOutRange(words[3]);
+    if (meas.headerLength == 8 || meas.headerLength == 16) {
+      meas.ESumTrailing = words[4];
+      meas.ESumLeading  = words[5];
+      meas.ESumGap      = words[6];
+      meas.baseline     = words[7];
+    }
+    if (meas.headerLength == 12 || meas.headerLength == 16) {
+      for (int i=0; i<8; ++i) {
+        meas.QDCSums[i] = words[meas.headerLength-8+i];
+      }
+    }
+  }
+
+  /* Header decoding rate over records held in memory, with the slots
+     spread over 100, 250 and 500 MHz: as it was (channel maps, tests on
+     frequency and header length per record), with the channel table,
+     with the kernels specialised per frequency and header length, and
+     with each batch kernel this CPU runs over the runs of 4-word records */
+  int bench_decode(int nChannels, int nRecords, bool qdcs) {
+    PIXIE::Experiment_Definition definition;
+    make_definition(definition, nChannels);
+    int freqs[] = {100, 250, 500};
+    for (auto &crate : definition.crateMap) {
+      for (auto &slot : crate.second->slotMap) {
+        slot.second->freq = freqs[slot.first%3];
+      }
+    }
+    definition.compile();
+
+    std::mt19937 rng(1);
+    std::uniform_int_distribution<int> channel(0, definition.detectors.size()-1);
+    std::uniform_int_distribution<uint32_t> word;
+    std::vector<uint32_t> records;
+    std::vector<size_t> starts;
+    for (int i=0; i<nRecords; ++i) {
+      const auto *chan = definition.detectors[channel(rng)];
+      uint32_t headerLength = (qdcs && i%2) ? 12 : 4;
+      starts.push_back(records.size());
+      records.push_back(header_word(chan, headerLength, 0));
+      for (uint32_t w=1; w<headerLength; ++w) {
+        records.push_back(w == 3 ? word(rng) & 0x8000FFFF : word(rng)); //no trace
+      }
+    }
+
+    printf("%d channels, %d records of %s\n", nChannels, nRecords, qdcs ? "4 and 12 words" : "4 words");
+    const char *methods[] = {"maps, runtime tests", "table, runtime tests", "table, kernels"};
+    for (int method=0; method<3; ++method) {
+      uint64_t check = 0;
+      PIXIE::Measurement meas;
+      auto start = std::chrono::steady_clock::now();
+      for (size_t offset : starts) {
+        const uint32_t *words = &records[offset];
+        if (method == 0) {
+          int crate = PIXIE::Measurement::mCrateID(words[0]);
+          int slot = PIXIE::Measurement::mSlotID(words[0]);
+          if (definition.GetChannel(crate, slot, PIXIE::Measurement::mChannelNumber(words[0]))) {
+            decode_runtime(meas, words, definition.GetSlot(crate, slot)->freq);
+          }
+        }
+        else if (method == 1) {
+          decode_runtime(meas, words, definition.Lookup(words[0]).freq);
+        }
+        else {
+          meas.decode(words, definition);
+        }
+        check += meas.eventTime + meas.eventEnergy + (meas.headerLength >= 12 ? meas.QDCSums[7] : 0);
+      }
+      double elapsed = seconds_since(start);
+      printf("%-22s %8.1f M records/s (check %llx)\n", methods[method], nRecords/elapsed/1e6, (unsigned long long)check);
+    }
+
+    PIXIE::HeaderBatch batch;
+    batch.bind(definition);
+    for (int isa=PIXIE::HeaderBatch::kScalar; isa<=PIXIE::HeaderBatch::best(); ++isa) {
+      batch.isa = (PIXIE::HeaderBatch::Isa)isa;
+      batch.decoded = 0;
+      uint64_t check = 0;
+      PIXIE::Measurement meas;
+      auto start = std::chrono::steady_clock::now();
+      size_t i = 0;
+      while (i < starts.size()) {
+        size_t n = batch.decode(&records[starts[i]], (records.size() - starts[i])/4);
+        for (size_t k=0; k<n; ++k) {
+          batch.get(meas);
+          batch.pop();
+          check += meas.eventTime + meas.eventEnergy;
+        }
+        if (n == 0) {
+          meas.decode(&records[starts[i]], definition);
+          check += meas.eventTime + meas.eventEnergy + (meas.headerLength >= 12 ? meas.QDCSums[7] : 0);
+          n = 1;
+        }
+        i += n;
+      }
+      double elapsed = seconds_since(start);
+      std::string method = std::string("batch, ") + PIXIE::HeaderBatch::name(batch.isa);
+      printf("%-22s %8.1f M records/s (check %llx, %.0f%% batched)\n", method.c_str(), nRecords/elapsed/1e6, (unsigned long long)check, 100.0*batch.decoded/nRecords);
+    }
+    return 0;
+  }
+
+  /* Sum of every hit's eventEnergy, read back from a RawTree in each
+     layout: the dense tree has to read every channel's branch, the
+     sparse tree and the RNTuple only the one column */
+  double read_dense(const std::string &path, const PIXIE::Experiment_Definition &definition, double &sum) {
+    auto start = std::chrono::steady_clock::now();
+    TFile *file = new TFile(path.c_str());
+    TTree *tree = (TTree*)file -> Get("RawTree");
+    std::vector<UInt_t> energies(definition.detectors.size());
+    tree -> SetBranchStatus("*", 0);
+    for (size_t i=0; i<definition.detectors.size(); ++i) {
+      auto *chan = definition.detectors[i];
+      std::string name = std::to_string(chan->crateID) + "." + std::to_string(chan->slotID) + "." + std::to_string(chan->channelNumber) + ".eventEnergy";
+      tree -> SetBranchStatus(name.c_str(), 1);
+      tree -> SetBranchAddress(name.c_str(), &energies[i]);
+    }
+    Long64_t nEntries = tree -> GetEntries();
+    for (Long64_t i=0; i<nEntries; ++i) {
+      tree -> GetEntry(i);
+      for (auto e : energies) {
+        sum += e;
+      }
+    }
+    delete file;
+    return seconds_since(start);
+  }
+
+  double read_sparse(const std::string &path, double &sum) {
+    auto start = std::chrono::steady_clock::now();
+    TFile *file = new TFile(path.c_str());
+    TTree *tree = (TTree*)file -> Get("RawTree");
+    Int_t mult;
+    std::vector<UInt_t> energies(16*14*16);
+    tree -> SetBranchStatus("*", 0);
+    tree -> SetBranchStatus("mult", 1);
+    tree -> SetBranchStatus("eventEnergy", 1);
+    tree -> SetBranchAddress("mult", &mult);
+    tree -> SetBranchAddress("eventEnergy", energies.data());
+    Long64_t nEntries = tree -> GetEntries();
+    for (Long64_t i=0; i<nEntries; ++i) {
+      tree -> GetEntry(i);
+      for (int m=0; m<mult; ++m) {
+        sum += energies[m];
+      }
+    }
+    delete file;
+    return seconds_since(start);
+  }
+
+#ifdef PIXIE2ROOT_RNTUPLE
+  double read_ntuple(const std::string &path, double &sum) {
+    auto start = std::chrono::steady_clock::now();
+    auto reader = ROOT::RNTupleReader::Open("RawTree", path);
+    auto energies = reader -> GetView<std::vector<std::uint32_t>>("eventEnergy");
+    for (auto i : reader -> GetEntryRange()) {
+      for (auto e : energies(i)) {
+        sum += e;
+      }
+    }
+    return seconds_since(start);
+  }
+#endif
+
+  /* Writes the same events as a dense TTree, a sparse TTree and an
+     RNTuple, then reads every energy back from each */
+  int bench_read(int nChannels, int mult, int nEvents, int batch, const std::string &path) {
+    PIXIE::Experiment_Definition definition;
+    make_definition(definition, nChannels);
+    std::mt19937 rng(1);
+    PIXIE::HitBatch hits;
+    make_events(hits, batch, definition, mult, rng);
+
+    printf("%d channels, multiplicity %d, %d events\n", nChannels, mult, nEvents);
+    const char *layouts[] = {"TTree, dense", "TTree, sparse", "RNTuple"};
+    for (int layout=0; layout<3; ++layout) {
+      options opt;
+      opt.sparse = layout == 1;
+      opt.rntuple = layout == 2;
+      std::ofstream log("/dev/null");
+
+      auto start = std::chrono::steady_clock::now();
+      OutputWriter *writer;
+      TFile *file = nullptr;
+      if (opt.rntuple) {
+#ifdef PIXIE2ROOT_RNTUPLE
+        writer = new NTupleWriter(opt, &definition, path);
+#else
+        printf("%-22s not available, needs ROOT 6.36\n", layouts[layout]);
+        continue;
+#endif
+      }
+      else {
+        file = new TFile(path.c_str(), "recreate");
+        writer = new TreeWriter(opt, &definition, file);
+      }
+      writer -> branch(log);
+      writer -> start_chunk(0);
+      for (int done=0; done<nEvents; done+=batch) {
+        for (size_t event=0; event<hits.events(); ++event) {
+          writer -> fill(hits, event);
+        }
+        writer -> flush(0);
+      }
+      writer -> end_chunk(0);
+      writer -> write();
+      delete writer;
+      if (file) {
+        file -> Close();
+        delete file;
+      }
+      double writeTime = seconds_since(start);
+
+      double sum = 0;
+      double readTime = 0;
+      if (layout == 0) {
+        readTime = read_dense(path, definition, sum);
+      }
+      else if (layout == 1) {
+        readTime = read_sparse(path, sum);
+      }
+#ifdef PIXIE2ROOT_RNTUPLE
+      else {
+        readTime = read_ntuple(path, sum);
+      }
+#endif
+      printf("%-22s write %10.0f events/s, read %10.0f events/s %8.1f MB (energy sum %.0f)\n",
+             layouts[layout], nEvents/writeTime, nEvents/readTime, file_mb(path), sum);
+    }
+    std::remove(path.c_str());
+    return 0;
+  }
+}
+
+int main(int argc, char **argv) {
+  ROOT::EnableThreadSafety();
+
+  args::ArgumentParser parser("pixie_bench: synthetic benchmarks for pixie2root");
+  args::HelpFlag help(parser, "help", "Display this help menu", {'h', "help"});
+
+  args::Group commands(parser, "benchmarks");
+  args::Command fill(commands, "fill", "RawTree fill rate with and without writing the tree every batch");
+  args::Command compress(commands, "compress", "Conversion rate and output size for each compression setting");
+  args::Command build(commands, "build", "Event building rate into Event objects and into a reused HitBatch");
+  args::Command modes(commands, "modes", "Event building rate of the rolling, fixed-window and trigger modes on a dense stream of hits (-N hits)");
+  args::Command lookahead(commands, "lookahead", "Checks that keeping the record that closes an event builds the same events, processing each trace once");
+  args::Command pileup(commands, "pileup", "Same-channel pileup checks by searching the hits and by the channel table (multiplicity 50 unless -m)");
+  args::Command decode(commands, "decode", "Header decoding rate with run-time dispatch, specialised kernels and SIMD batches");
+  args::Command read(commands, "read", "Write and read-back rates of the dense and sparse TTree and the RNTuple");
+
+  args::Group arguments(parser, "options", args::Group::Validators::DontCare, args::Options::Global);
+  args::ValueFlag<UInt_t> n_channels(arguments, "200", "Channels in the definition", {'C', "channels"}, 200);
+  args::ValueFlag<UInt_t> mult(arguments, "2", "Hits per event", {'m', "multiplicity"}, 2);
+  args::ValueFlag<UInt_t> n_events(arguments, "1000000", "Events", {'N', "nevents"}, 1000000);
+  args::ValueFlag<UInt_t> n_batch(arguments, "10000", "Events per batch", {'n', "eventsperread"}, 10000);
+  args::Flag qdcs(arguments, "qdcs", "Records carry QDC sums", {'q', "qdcs"});
+  args::ValueFlag<std::string> output(arguments, "pixie_bench.root", "Scratch ROOT file", {'o', "rootfile"}, "pixie_bench.root");
+
+  try { parser.ParseCLI(argc, argv); }
+  catch (args::Help) {
+    std::cout << parser;
+    return 0;
+  }
+  catch (args::ParseError e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return 1;
+  }
+  catch (args::ValidationError e) {
+    std::cerr << e.what() << std::endl;
+    std::cerr << parser;
+    return 2;
+  }
+
+  int nChannels = std::max(1u, std::min(args::get(n_channels), 16u*14u*16u));
+  int nMult = std::max(1, std::min((int)args::get(mult), nChannels));
+
+  if (fill) {
+    return bench_fill(nChannels, nMult, args::get(n_events), std::max(1u, args::get(n_batch)), args::get(output));
+  }
+  if (compress) {
+    return bench_compress(nChannels, nMult, args::get(n_events), std::max(1u, args::get(n_batch)), args::get(output), args::get(qdcs));
+  }
+  if (build) {
+    return bench_build(nChannels, nMult, args::get(n_events), std::max(1u, args::get(n_batch)), args::get(output));
+  }
+  if (modes) {
+    return bench_modes(nChannels, args::get(n_events), std::max(1u, args::get(n_batch)), args::get(output));
+  }
+  if (lookahead) {
+    return bench_lookahead(nChannels, args::get(n_events), std::max(1u, args::get(n_batch)), args::get(output));
+  }
+  if (pileup) {
+    int pileupMult = mult ? nMult : std::min(50, nChannels);
+    return bench_pileup(nChannels, pileupMult, args::get(n_events));
+  }
+  if (decode) {
+    return bench_decode(nChannels, args::get(n_events), args::get(qdcs));
+  }
+  if (read) {
+    return bench_read(nChannels, nMult, args::get(n_events), std::max(1u, args::get(n_batch)), args::get(output));
+  }
+  return 0;
+}
@@ -1,16 +1,20 @@
 #include <iostream>
 #include <vector>
 #include <thread>
+#include <set>
 
 #include <TROOT.h>
 #include <TTreeReader.h>
 #include <TTreeReaderValue.h>
+#include <TTreeReaderArray.h>
 #include <TH1.h>
 #include <TFile.h>
 
 #include <ROOT/TThreadedObject.hxx>
 #include <ROOT/TTreeProcessorMT.hxx>
 
+#include "chunk_index.hh"
+
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
 #define ANSI_COLOR_YELLOW  "\x1b[33m"
@@ -72,6 +76,137 @@ struct tagReader {
 
 };
 
+void print_summary(std::atomic<unsigned long long> *mults,
+                   std::atomic<unsigned long long> *tag_mults,
+                   std::map< std::string, detCounter*> &detCounters,
+                   std::map< std::string, tagCounter*> &tagCounters,
+                   int nDetectors,
+                   int nTaggers) {
+  if (nDetectors) {
+    std::cout << std::endl;
+    std::cout << "Detectors: " << std::endl;
+    for (int i=0; i<8; ++i) {
+      std::cout << "Mult " << i << "  " << ANSI_COLOR_BLUE << mults[i] << ANSI_COLOR_RESET << std::endl;
+    }
+
+    printf("     Det           Total              Pile Up               E no T               T no E           out of range              bad CFD\n");
+    for (auto &det : detCounters) {
+      ULong64_t te = static_cast<ULong64_t>(det.second->total_events);
+      ULong64_t pu = static_cast<ULong64_t>(det.second->pileup_events);
+      ULong64_t ent = static_cast<ULong64_t>(det.second->energy_notime);
+      ULong64_t tne = static_cast<ULong64_t>(det.second->time_noenergy);
+      ULong64_t cfdf = static_cast<ULong64_t>(det.second->cfdforces);
+      ULong64_t outrange = static_cast<ULong64_t>(det.second->out_of_range);
+      
+      printf(ANSI_COLOR_CYAN "%8s" ANSI_COLOR_RESET ":  " ANSI_COLOR_BLUE " %12llu "
+             "%12llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
+             "%8llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
+             "%8llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
+             "%8llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
+             "%12llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]\n",
+             det.first.c_str(),
+             te,  
+             pu, 100.*((double)pu/te),
+             ent, 100.*((double)ent/te),
+             tne, 100.*((double)tne/te),
+             outrange, 100.*((double)outrange/te),
+             cfdf, 100.*((double)cfdf/te));
+    }
+  }
+  
+  if (nTaggers) {
+    std::cout << std::endl;
+    std::cout << "Taggers: " << std::endl;
+    for (int i=0; i<8; ++i) {
+      std::cout << "Mult " << i << "  " << ANSI_COLOR_BLUE << tag_mults[i] << ANSI_COLOR_RESET << std::endl;
+    }
+
+    printf("     Tag           Total               V no T                T no V\n");
+    for (auto &tag : tagCounters) {
+      ULong64_t te = static_cast<ULong64_t>(tag.second->total_events);
+      ULong64_t vnt = static_cast<ULong64_t>(tag.second->val_notime);
+      ULong64_t tnv = static_cast<ULong64_t>(tag.second->time_noval);
+      printf(ANSI_COLOR_CYAN "%8s" ANSI_COLOR_RESET ":    " ANSI_COLOR_BLUE "%12llu    "
+             "%12llu " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
+             "%12llu " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]\n", tag.first.c_str(),
+             te, 
+             vnt, 100.*((double)vnt/te),
+             tnv, 100.*((double)tnv/te));
+    }
+  }
+
+}
+
+/* Sparse RawTree (pixie2root -s): every entry lists the hits of the
+   event, so channels are found as they turn up rather than from the
+   branch names */
+void sort_sparse(TTreeReader &reader, ChunkOrder &order, long long unsigned maxEvent, long long unsigned nEvents) {
+  TTreeReaderValue<Int_t> mult(reader, "mult");
+  TTreeReaderArray<UShort_t> id(reader, "id");
+  TTreeReaderArray<UChar_t> tagger(reader, "tagger");
+  TTreeReaderArray<ULong64_t> time(reader, "eventTime");
+  TTreeReaderArray<UInt_t> energy(reader, "eventEnergy");
+  TTreeReaderArray<UInt_t> pileup(reader, "finishCode");
+  TTreeReaderArray<UInt_t> cfdforce(reader, "CFDForce");
+  TTreeReaderArray<UInt_t> outrange(reader, "outOfRange");
+
+  std::map< std::string, detCounter*> detCounters;
+  std::map< std::string, tagCounter*> tagCounters;
+  std::atomic<unsigned long long>  mults[8];
+  std::atomic<unsigned long long>  tag_mults[8];
+  for (int i=0; i<8; ++i) {
+    mults[i] = 0;
+    tag_mults[i] = 0;
+  }
+
+  long long unsigned eventNo = 0;
+  Long64_t entry;
+  while ((entry = order.Next()) >= 0 && reader.SetEntry(entry) == TTreeReader::kEntryValid && (maxEvent == 0 || eventNo < maxEvent) ) {
+    ++eventNo;
+    if (eventNo % 10000 == 0 ) {
+      printf("\r%llu/%llu     [" ANSI_COLOR_GREEN "%4.1f%%" ANSI_COLOR_RESET "]", eventNo, nEvents, 100.0*static_cast<double>(eventNo)/static_cast<double>(nEvents));
+      std::cout << std::flush;
+    }
+    int dets_fired = 0;
+    std::set<int> tags_fired;
+    for (int i=0; i<*mult; ++i) {
+      std::string name = std::to_string(id[i]>>8) + "." + std::to_string((id[i]>>4) & 0xF) + "." + std::to_string(id[i] & 0xF);
+      if (tagger[i]) {
+        //like taggerNew, only tagger hits with finishCode 0 count
+        if (pileup[i]) { continue; }
+        tagCounter *&counter = tagCounters[name];
+        if (!counter) { counter = new tagCounter(); }
+        if (!tags_fired.insert(id[i]).second) { continue; }
+        counter->total_events += 1;
+        if (energy[i] && !time[i]) { counter->val_notime +=1; }
+        if (!energy[i] && time[i]) { counter->time_noval +=1; }
+        continue;
+      }
+
+      detCounter *&counter = detCounters[name];
+      if (!counter) { counter = new detCounter(); }
+      dets_fired+=1;
+      counter->total_events+=1;
+
+      if (pileup[i]) { counter->pileup_events += 1; }
+      if (outrange[i]) { counter->out_of_range += 1; }
+      if (energy[i] && !time[i] && !pileup[i]) { counter->energy_notime += 1; std::cout << "\nNo time in event " << eventNo << std::endl;}
+      if (!energy[i] && time[i] && !pileup[i]) { counter->time_noenergy += 1; }
+      if (cfdforce[i]) { counter->cfdforces += 1; }
+    }
+    if (dets_fired < 9) {
+      mults[dets_fired]+=1;
+    }
+    if (tags_fired.size() < 9) {
+      tag_mults[tags_fired.size()]+=1;
+    }
+  }
+
+  std::cout << std::endl;
+  std::cout << ANSI_COLOR_BLUE << detCounters.size() << ANSI_COLOR_RESET << " detectors, " << ANSI_COLOR_BLUE << tagCounters.size() << ANSI_COLOR_RESET << " taggers fired" << std::endl;
+  print_summary(mults, tag_mults, detCounters, tagCounters, detCounters.size(), tagCounters.size());
+}
+
 int main(int argc, char **argv) {
 
   //ROOT::EnableImplicitMT(std::thread::hardware_concurrency());
@@ -102,6 +237,13 @@ int main(int argc, char **argv) {
   TTree *tree = (TTree*)file->Get("RawTree");
   
   TTreeReader reader("RawTree", file);
+  ChunkOrder order(file, tree->GetEntries());
+
+  if (tree->GetBranch("mult")) {
+    sort_sparse(reader, order, maxEvent, tree->GetEntries());
+    file->Close();
+    return 0;
+  }
   
   TObjArray *branches = tree->GetListOfBranches();
 
@@ -193,7 +335,8 @@ int main(int argc, char **argv) {
     std::cout << "entering event loop " << reader.GetEntries(kTRUE) << std::endl;
     std::cout << reader.SetEntry(0) << std::endl;
     std::cout << "actually entering loop" << std::endl;
-    while (reader.Next() && (maxEvent == 0 || eventNo < maxEvent) ) {
+    Long64_t entry;
+    while ((entry = order.Next()) >= 0 && reader.SetEntry(entry) == TTreeReader::kEntryValid && (maxEvent == 0 || eventNo < maxEvent) ) {
       ++eventNo;
       if (eventNo % 10000 == 0 ) {
         printf("\r%llu/%llu     [" ANSI_COLOR_GREEN "%4.1f%%" ANSI_COLOR_RESET "]", static_cast<ULong64_t>(eventNo), nEvents, 100.0*static_cast<double>(eventNo)/static_cast<double>(nEvents));
@@ -252,57 +395,5 @@ int main(int argc, char **argv) {
   sort(reader);
 
   std::cout << std::endl;
-  if (nDetectors) {
-    std::cout << std::endl;
-    std::cout << "Detectors: " << std::endl;
-    for (int i=0; i<8; ++i) {
-      std::cout << "Mult " << i << "  " << ANSI_COLOR_BLUE << mults[i] << ANSI_COLOR_RESET << std::endl;
-    }
-
-    printf("     Det           Total              Pile Up               E no T               T no E           out of range              bad CFD\n");
-    for (auto &det : detCounters) {
-      ULong64_t te = static_cast<ULong64_t>(det.second->total_events);
-      ULong64_t pu = static_cast<ULong64_t>(det.second->pileup_events);
-      ULong64_t ent = static_cast<ULong64_t>(det.second->energy_notime);
-      ULong64_t tne = static_cast<ULong64_t>(det.second->time_noenergy);
-      ULong64_t cfdf = static_cast<ULong64_t>(det.second->cfdforces);
-      ULong64_t outrange = static_cast<ULong64_t>(det.second->out_of_range);
-      
-      printf(ANSI_COLOR_CYAN "%8s" ANSI_COLOR_RESET ":  " ANSI_COLOR_BLUE " %12llu "
-             "%12llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
-             "%8llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
-             "%8llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
-             "%8llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
-             "%12llu  " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]\n",
-             det.first.c_str(),
-             te,  
-             pu, 100.*((double)pu/te),
-             ent, 100.*((double)ent/te),
-             tne, 100.*((double)tne/te),
-             outrange, 100.*((double)outrange/te),
-             cfdf, 100.*((double)cfdf/te));
-    }
-  }
-  
-  if (nTaggers) {
-    std::cout << std::endl;
-    std::cout << "Taggers: " << std::endl;
-    for (int i=0; i<8; ++i) {
-      std::cout << "Mult " << i << "  " << ANSI_COLOR_BLUE << tag_mults[i] << ANSI_COLOR_RESET << std::endl;
-    }
-
-    printf("     Tag           Total               V no T                T no V\n");
-    for (auto &tag : tagCounters) {
-      ULong64_t te = static_cast<ULong64_t>(tag.second->total_events);
-      ULong64_t vnt = static_cast<ULong64_t>(tag.second->val_notime);
-      ULong64_t tnv = static_cast<ULong64_t>(tag.second->time_noval);
-      printf(ANSI_COLOR_CYAN "%8s" ANSI_COLOR_RESET ":    " ANSI_COLOR_BLUE "%12llu    "
-             "%12llu " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]   " ANSI_COLOR_BLUE
-             "%12llu " ANSI_COLOR_RESET "[" ANSI_COLOR_GREEN "%5.2f%%" ANSI_COLOR_RESET "]\n", tag.first.c_str(),
-             te, 
-             vnt, 100.*((double)vnt/te),
-             tnv, 100.*((double)tnv/te));
-    }
-  }
-
+  print_summary(mults, tag_mults, detCounters, tagCounters, nDetectors, nTaggers);
 }
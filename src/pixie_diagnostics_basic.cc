@@ -7,6 +7,8 @@
 #include <TH1.h>
 #include <TFile.h>
 
+#include "chunk_index.hh"
+
 #define ANSI_COLOR_RED     "\x1b[31m"
 #define ANSI_COLOR_GREEN   "\x1b[32m"
 #define ANSI_COLOR_YELLOW  "\x1b[33m"
@@ -206,7 +208,8 @@ int main(int argc, char **argv) {
 
     std::cout << "actually entering loop" << std::endl;
     if (!maxEvent) { maxEvent = nEvents; }
-    for (int ev=0; ev<nEvents; ++ev) {
+    ChunkOrder order(file, nEvents);
+    for (Long64_t ev = order.Next(); ev >= 0; ev = order.Next()) {
       tree->GetEvent(ev);
       ++eventNo;
       if (eventNo % 10000 == 0 ) {
@@ -44,6 +44,7 @@ int main(int argc, char ** argv) {
   args::ValueFlag<std::string> traceN(parser, "Trace", "Output trace name", {'t', "traceName"}, "Trace");
 
   args::Flag append(parser, "append", "append to file", {'a', "append"}, 1);
+  args::Flag mmap(parser, "mmap", "Memory-map the listmode file", {'M', "mmap"});
 
   args::Group filegroup(parser, "Required files", args::Group::Validators::All);
   args::ValueFlag<std::string> expdef(filegroup, "exptdef.expt", "Experimental definition file", {'d', "expdef"});
@@ -93,9 +94,17 @@ int main(int argc, char ** argv) {
   definition.close();
 
   
+  //an up to date index tells us straight away if the channel fired at all
+  PIXIE::ListIndex index;
+  if (index.load(lstPath) == 0 && index.count(crate, slot, chan) == 0) {
+    printf("No traces for given channel\n");
+    exit(1);
+  }
+
   PIXIE::Reader reader;
   reader.thread = 0;
   reader.definition = definition;
+  reader.useMmap = args::get(mmap);
   reader.open(lstPath);
   retval = reader.dump_traces(crate, slot, chan, outPath, nEvents, app, traceName);
 
@@ -3,92 +3,163 @@
 #include "pre_reader.hh"
 
 #include <iostream>
+#include <thread>
+#include <algorithm>
 
 namespace PIXIE {
   
   off_t PreReader::offset() const
   {
-    return (ftello(this->file));
+    return (this->source->offset());
   }
 
   int PreReader::open(const std::string &path)
   {
-    if (this->file)
+    if (this->source)
       {
         return (-1); //file has already been opened
       }
 
-    if (!(this->file = fopen(path.c_str(), "rb")))
+    this->source = new BlockReader();
+    if (this->source->open(path) < 0) {
+      delete this->source;
+      this->source = NULL;
       return (-2);
+    }
+    this->path = path;
 
     return (0);
   }
 
   int PreReader::read(size_t breakatevent) {
-    struct stat stat;
-    if (fstat(fileno(this->file), &stat) != 0)
-      std::cout << "Couldn't stat" << std::endl;
-
-    this->fileLength = stat.st_size;
+    this->fileLength = this->source->update_filesize();
     
     offsets.clear();
 
-    int thread = 0;
-    int events=0;
-    while (true) {
-      //if (breakatevent==0){
-      if (thread==this->nThreads) { break; }
-      if (offset()*this->nThreads >= thread*this->fileLength) {
-	offsets.push_back(offset());
-	++thread;
-      }
-      //}
-    //else{
-    //	printf("here %d %d\n",thread,nThreads);
-    //	if (thread>this->nThreads) { break; }
-    //	if (events*this->nThreads >= thread*breakatevent) {
-    //	  offsets.push_back(offset());
-    //	  ++thread;
-    //	}
-    //}
-      uint32_t firstWord;
-      if (fread(&firstWord, (size_t) 4, (size_t) 1, this->file) != 1) {
-        return -1;    
-      }
-      events+=1;
-      Mask mEventLength = Mask(0x7FFE0000, 17);
-      
-      Mask mChannelNumber = Mask(0xF, 0);
-      Mask mSlotID = Mask(0xF0, 4);
-      Mask mCrateID = Mask(0xF00, 8);
-      Mask mHeaderLength = Mask(0x1F000, 12);
-      
-      uint32_t eventLength = mEventLength(firstWord);
-
-      /*
-      uint32_t channelNumber=mChannelNumber(firstWord);
-      uint32_t slotID=mSlotID(firstWord);
-      uint32_t crateID=mCrateID(firstWord);
-      uint32_t headerLength=mHeaderLength(firstWord);
-
-      bool qdcs = false;
-      bool eraw = false;
-      bool traces = false;
-      if (headerLength == 8) { eraw = true; }
-      else if (headerLength == 12) { qdcs = true; }
-      else if (headerLength == 16) { qdcs = true; eraw = true; }
-      if (headerLength != eventLength) { traces = true; }
-
-      definition.AddChannel(crateID, slotID, channelNumber, eraw, qdcs,traces);
-      */
-      
-      if (fseek(this->file, (eventLength-1)*4, SEEK_CUR)) {
-        return -1;
-      }      
+    if (this->useIndex && this->index.load(this->path) == 0) {
+      std::cout << "Using index " << ListIndex::path_for(this->path) << std::endl;
+    }
+    else if (this->probe) {
+      //each thread looks near k/n of the file for a header, then for a gap
+      offsets.resize(this->nThreads, 0);
+      std::vector<std::thread> probes;
+      for (int i=1; i<this->nThreads; ++i) {
+        probes.emplace_back([this, i] {
+          BlockReader src(256<<10);
+          src.open(this->path);
+          off_t guess = (this->fileLength/this->nThreads)*i;
+          off_t split = find_header(src, guess);
+          if (this->definition && this->coincWindow >= 0) {
+            split = find_gap(src, split);
+          }
+          offsets[i] = split;
+        });
+      }
+      for (auto &probe : probes) {
+        probe.join();
+      }
+      for (int i=1; i<offsets.size(); ++i) {
+        if (offsets[i] < offsets[i-1]) { offsets[i] = offsets[i-1]; }
+      }
+      return 0;
+    }
+    else {
+      this->index.build(*this->source, this->stride);
+      if (this->useIndex && this->index.write(this->path) == 0) {
+        std::cout << "Wrote index " << ListIndex::path_for(this->path) << std::endl;
+      }
+    }
+
+    offsets = this->index.split(this->nThreads);
+
+    //move each split forward to the next gap in time, so no event straddles two threads
+    if (this->definition && this->coincWindow >= 0) {
+      for (int i=1; i<offsets.size(); ++i) {
+        off_t from = offsets[i] > offsets[i-1] ? offsets[i] : offsets[i-1];
+        offsets[i] = find_gap(*this->source, from);
+      }
     }
     return 0;
   }
 
+  off_t PreReader::find_gap(Source &src, off_t from) {
+    //Event::read closes an event when the next record is later than the
+    //previous one plus the window, so a split there can't change any event;
+    //records of channels with time offsets can be behind by their spread,
+    //and any record by the disorder the reader puts back in order
+    uint64_t window = ((uint64_t)this->coincWindow<<15) + this->definition->offsetSpread + ((uint64_t)this->disorder<<15);
+    bool first = true;
+    uint64_t lastTime = 0;
+
+    src.seek(from);
+    while (true) {
+      off_t pos = src.offset();
+      const uint32_t *words = src.peek(1);
+      if (!words) {
+        break;
+      }
+      uint32_t headerLength = Measurement::mHeaderLength(words[0]);
+      uint32_t eventLength = Measurement::mEventLength(words[0]);
+      if (headerLength < 4 || eventLength < headerLength || !(words = src.peek(eventLength))) {
+        break;
+      }
+
+      Measurement meas;
+      if (this->definition->Lookup(words[0]).channel) {
+        meas.decode(words, *this->definition);
+      }
+      if (!first && meas.eventTime > lastTime + window) {
+        return pos;
+      }
+      first = false;
+      //a record behind its neighbours must not open a gap
+      lastTime = std::max(lastTime, meas.eventTime);
+      src.commit(eventLength);
+    }
+    return src.offset(); //no gap before the end of the file
+  }
+
+  bool PreReader::valid_records(Source &src, off_t from) {
+    src.seek(from);
+    for (int i=0; i<this->probeRecords; ++i) {
+      const uint32_t *words = src.peek(4);
+      if (!words) {
+        //running into the end of the file exactly is fine
+        return (src.offset() == src.fileLength && i > 0);
+      }
+      uint32_t headerLength = Measurement::mHeaderLength(words[0]);
+      uint32_t eventLength  = Measurement::mEventLength(words[0]);
+      uint32_t traceLength  = Measurement::mTraceLength(words[3]);
+      if (headerLength != 4 && headerLength != 8 && headerLength != 12 && headerLength != 16) {
+        return false;
+      }
+      if (eventLength != headerLength + (traceLength+1)/2) {
+        return false;
+      }
+      if (this->definition && !this->definition->Lookup(words[0]).channel) {
+        return false;
+      }
+      if (!src.peek(eventLength)) {
+        return (src.offset() + eventLength*4 == src.fileLength);
+      }
+      src.commit(eventLength);
+    }
+    return true;
+  }
+
+  off_t PreReader::find_header(Source &src, off_t guess) {
+    //records are word aligned; a real header is followed by a chain of
+    //plausible headers, so try each word until one starts such a chain
+    off_t limit = guess + 4*BlockReader::kMaxRecord;
+    for (off_t pos = guess/4*4; pos < limit && pos < src.fileLength; pos += 4) {
+      if (valid_records(src, pos)) {
+        return pos;
+      }
+    }
+    std::cout << "Couldn't find a header near offset " << guess << std::endl;
+    return src.fileLength;
+  }
+
   void PreReader::print() const {
     std::cout << "File size " << this->fileLength << std::endl;
     for (int i=0; i<offsets.size(); ++i) {
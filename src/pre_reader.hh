@@ -7,6 +7,8 @@
 #include <sys/stat.h>
 
 #include "experiment_definition.hh"
+#include "list_index.hh"
+#include "source.hh"
 
 namespace PIXIE {
   class PreReader {
@@ -15,12 +17,24 @@ namespace PIXIE {
     off_t fileLength;
     bool end;
     std::vector<off_t> offsets;
-    FILE *file;
+    Source *source;
+    std::string path;
+    ListIndex index;
+    bool useIndex;      //load <file>.pxidx if it is up to date, write it otherwise
+    uint32_t stride;    //records per index block
+    Experiment_Definition *definition; //needed to decode times for the split search
+    int coincWindow;    //splits land on gaps longer than this (10 ns units), <0 = anywhere
+    int disorder;       //10 ns units records can be out of order by, widens the gaps
+    bool probe;         //find splits by probing the file in parallel instead of scanning it
+    int probeRecords;   //consecutive valid records needed to trust a probed header
   public:
-    PreReader(int threads) : nThreads(threads), file(NULL) {};
-    ~PreReader() {};
+    PreReader(int threads) : nThreads(threads), source(NULL), useIndex(true), stride(1024), definition(NULL), coincWindow(-1), disorder(0), probe(false), probeRecords(8) {};
+    ~PreReader() { delete source; };
     int open(const std::string &path);
     int read(size_t breakatevent=0);
+    off_t find_gap(Source &src, off_t from);
+    off_t find_header(Source &src, off_t guess);
+    bool valid_records(Source &src, off_t from);
     off_t offset() const;
     void print() const;
   };
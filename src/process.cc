@@ -9,6 +9,7 @@
 #include<cerrno>
 #include<sstream>
 #include<fstream>
+#include<algorithm>
 
 #include<pthread.h>
 
@@ -23,126 +24,786 @@
 
 #include "pixie.hh"
 #include "traces.hh"
+#include "trace_algorithms.hh"
 #include "pixie2root.hh"
 
-namespace PIXIE {  
-  void *Process(void *thread) {
-    PIXIE::Reader *reader            = &(((PixieThread*)thread) -> reader);
-    options options                  = ((PixieThread*)thread) -> opt;
-    Experiment_Definition definition = ((PixieThread*)thread) -> definition;
-    off_t offset                     = ((PixieThread*)thread) -> offset;
-    off_t max_offset                 = ((PixieThread*)thread) -> max_offset;
-    int threadNum                    = ((PixieThread*)thread) -> threadNum;
+TreeWriter::TreeWriter(const options &op, PIXIE::Experiment_Definition *def, TFile *f, MergedOutput *m)
+  : opt(op), file(f), merged(m), segmentEntries(0), definition(def), chunkSeq(0), chunkFirstEntry(0), chunkEntries(0) {
+  file -> cd();
+  tree = new TTree("RawTree", "RawTree");
+  //negative values are in bytes rather than entries
+  tree -> SetAutoFlush(-opt.autoFlush);
+  tree -> SetAutoSave(-opt.autoSave);
+  lastCheckpoint = std::chrono::steady_clock::now();
+
+  chunkTree = new TTree("ChunkIndex", "ChunkIndex");
+  chunkTree -> Branch("chunk", &chunkSeq);
+  chunkTree -> Branch("firstEntry", &chunkFirstEntry);
+  chunkTree -> Branch("entries", &chunkEntries);
+}
 
-    reader -> definition = definition;
-    reader -> thread = threadNum;
-    
-    //reader -> set_algorithm(((PixieThread*)thread) -> tracealg);    
+int compression_settings(const std::string &spec) {
+  size_t colon = spec.find(':');
+  std::string name = spec.substr(0, colon);
+  std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+
+  using Algorithm = ROOT::RCompressionSetting::EAlgorithm;
+  struct { const char *name; Algorithm::EValues algorithm; int level; } known[] = {
+    {"zlib", Algorithm::kZLIB, 1},
+    {"lzma", Algorithm::kLZMA, 7},
+    {"lz4",  Algorithm::kLZ4,  4},
+    {"zstd", Algorithm::kZSTD, 5},
+  };
+  if (name == "none") {
+    return 0;
+  }
+  for (const auto &alg : known) {
+    if (name != alg.name) {
+      continue;
+    }
+    int level = alg.level;
+    if (colon != std::string::npos) {
+      char *end;
+      level = strtol(spec.c_str() + colon + 1, &end, 10);
+      if (*end || level < 1 || level > 9) {
+        return -1;
+      }
+    }
+    return ROOT::CompressionSettings(alg.algorithm, level);
+  }
+  return -1;
+}
 
-    std::ofstream log(("Thread_"+std::to_string(threadNum)+".log").c_str());
-    log << "[ " << threadNum << " ] " << std::endl;
-    log << std::flush;
+bool branch_class(const std::string &name) {
+  for (const char *known : {"event", "eraw", "qdc", "trace", "tagger"}) {
+    if (name == known) {
+      return true;
+    }
+  }
+  return false;
+}
 
-    TFile outFile((options.path_output+"_"+std::to_string(threadNum)).c_str(), "recreate");
-    //outFile.SetCompressionAlgorithm(ROOT::kLZ4);
-    //outFile.SetCompressionLevel(3);
-  
-    if (options.verbose==true) {
-      log << "Creating ROOT Tree in file: "<< (options.path_output+"_"+std::to_string(threadNum)).c_str() << std::endl;
-      log << std::flush;
-    } 
+TreeWriter::~TreeWriter() {
+  for (auto data : detector_data) { delete data; }
+  for (auto tracedata : detector_tracedata) { delete tracedata; }
+  for (auto tag : tagger_data) { delete tag; }
+}
+
+TBranch *TreeWriter::compress(TBranch *branch, const char *branchClass) {
+  auto settings = opt.branchCompression.find(branchClass);
+  if (branch && settings != opt.branchCompression.end()) {
+    branch -> SetCompressionSettings(settings->second);
+  }
+  return branch;
+}
+
+void TreeWriter::bind_hits(bool create) {
+  struct {
+    const char *name;
+    void *address;
+    const char *leaves;
+    const char *branchClass;
+    bool wanted;
+  } columns[] = {
+    {"mult",         &hits.mult,               "mult/I",                 "event", true},
+    {"id",           hits.id.data(),           "id[mult]/s",             "event", true},
+    {"tagger",       hits.tagger.data(),       "tagger[mult]/b",         "event", true},
+    {"eventTime",    hits.eventTime.data(),    "eventTime[mult]/l",      "event", true},
+    {"eventRelTime", hits.eventRelTime.data(), "eventRelTime[mult]/i",   "event", true},
+    {"finishCode",   hits.finishCode.data(),   "finishCode[mult]/i",     "event", true},
+    {"CFDForce",     hits.CFDForce.data(),     "CFDForce[mult]/i",       "event", true},
+    {"eventEnergy",  hits.eventEnergy.data(),  "eventEnergy[mult]/i",    "event", true},
+    {"outOfRange",   hits.outOfRange.data(),   "outOfRange[mult]/i",     "event", true},
+    {"ESumTrailing", hits.ESumTrailing.data(), "ESumTrailing[mult]/i",   "eraw",  opt.rawE},
+    {"ESumLeading",  hits.ESumLeading.data(),  "ESumLeading[mult]/i",    "eraw",  opt.rawE},
+    {"ESumGap",      hits.ESumGap.data(),      "ESumGap[mult]/i",        "eraw",  opt.rawE},
+    {"baseline",     hits.baseline.data(),     "baseline[mult]/i",       "eraw",  opt.rawE},
+    {"QDCSums",      hits.QDCSums.data(),      "QDCSums[mult][8]/i",     "qdc",   opt.QDCs},
+    {"nTrace",       &hits.nTrace,             "nTrace/I",               "trace", opt.traces},
+    {"traceFirst",   hits.traceFirst.data(),   "traceFirst[mult]/I",     "trace", opt.traces},
+    {"traceMeas",    hits.traceMeas.data(),    "traceMeas[nTrace]/I",    "trace", opt.traces},
+  };
+  for (const auto &column : columns) {
+    if (!column.wanted) {
+      continue;
+    }
+    if (create) {
+      compress(tree -> Branch(column.name, column.address, column.leaves), column.branchClass);
+    }
+    else {
+      tree -> SetBranchAddress(column.name, column.address);
+    }
+  }
+}
 
-    TTree *tree;
-    tree = new TTree("RawTree", "RawTree");
-
-    std::unordered_map<const PIXIE::Experiment_Definition::Channel*, PixieTraceEvent*> channel_to_tracedata;
-    std::unordered_map<const PIXIE::Experiment_Definition::Channel*, PixieEvent*> channel_to_data;
-    std::unordered_map<const PIXIE::Experiment_Definition::Channel*, PixieTagger*> channel_to_tagger;
-  
-    //////////////////
-    // Add branches //
-    //////////////////
-    for (const auto &crate_it : reader->definition.crateMap) {
-      auto crate = crate_it.second;
-      for (const auto &slot_it : crate->slotMap) {
-        auto slot = slot_it.second;
-        for (const auto &channel_it : slot->channelMap) {
-          auto channel = channel_it.second;        
-          // tree branch prefix
-          std::string branchName(std::to_string(crate->crateID) +
-                                 "." +
-                                 std::to_string(slot->slotID) +
-                                 "." +
-                                 std::to_string(channel->channelNumber));  //add options to include the name?
-          log << "adding branch " << branchName << std::endl;
-          log << std::flush;
-
-          //the branch is a tagger:
-          if (std::find(reader->definition.taggers.begin(), reader->definition.taggers.end(), channel) != reader->definition.taggers.end()) { 
-            PixieTagger* tag = new PixieTagger(); // IIRC legit use of pointer for the sake of Branch
+void TreeWriter::branch(std::ofstream &log) {
+  if (opt.sparse) {
+    log << "sparse layout, one row per hit" << std::endl;
+    bind_hits(true);
+    return;
+  }
+
+  detector_data.assign(definition->detectors.size(), nullptr);
+  detector_tracedata.assign(definition->detectors.size(), nullptr);
+  tagger_data.assign(definition->taggers.size(), nullptr);
+
+  //////////////////
+  // Add branches //
+  //////////////////
+  for (const auto &crate_it : definition->crateMap) {
+    auto crate = crate_it.second;
+    for (const auto &slot_it : crate->slotMap) {
+      auto slot = slot_it.second;
+      for (const auto &channel_it : slot->channelMap) {
+        auto channel = channel_it.second;        
+        const auto &info = definition->Lookup(crate->crateID, slot->slotID, channel->channelNumber);
+        if (info.channel != channel || info.index < 0) {
+          continue; //not one of the detectors or taggers, nothing would ever fill it
+        }
+        // tree branch prefix
+        std::string branchName(std::to_string(crate->crateID) +
+                               "." +
+                               std::to_string(slot->slotID) +
+                               "." +
+                               std::to_string(channel->channelNumber));  //add options to include the name?
+        log << "adding branch " << branchName << std::endl;
+        log << std::flush;
+
+        //the branch is a tagger:
+        if (info.flags & PIXIE::Experiment_Definition::ChannelInfo::kTagger) { 
+          PixieTagger* tag = new PixieTagger(); // IIRC legit use of pointer for the sake of Branch
           
-            tree -> Branch((branchName+".taggerTime").c_str(), &(tag->taggerTime));
-            tree -> Branch((branchName+".taggerValue").c_str(), &(tag->taggerValue));
-            tree -> Branch((branchName+".taggerNew").c_str(), &(tag->taggerNew));
+          compress(tree -> Branch((branchName+".taggerTime").c_str(), &(tag->taggerTime)), "tagger");
+          compress(tree -> Branch((branchName+".taggerValue").c_str(), &(tag->taggerValue)), "tagger");
+          compress(tree -> Branch((branchName+".taggerNew").c_str(), &(tag->taggerNew)), "tagger");
           
 
-            channel_to_tagger.insert({channel, tag});
-          } else { //regular measurement
-            PixieEvent *data = new PixieEvent();          
-            tree -> Branch((branchName+".eventTime").c_str(), &(data->eventTime));
-            tree -> Branch((branchName+".eventRelTime").c_str(), &(data->eventRelTime));
-            tree -> Branch((branchName+".finishCode").c_str(), &(data->finishCode));
-            tree -> Branch((branchName+".CFDForce").c_str(), &(data->CFDForce));
-            tree -> Branch((branchName+".eventEnergy").c_str(), &(data->eventEnergy));
-            tree -> Branch((branchName+".outOfRange").c_str(), &(data->outOfRange));
-
-            //if Raw Energy Sums enabled
-            if (options.rawE) {
-              if (channel->eraw) {
-                tree -> Branch((branchName+".ESumTrailing").c_str(), &(data->ESumTrailing));
-                tree -> Branch((branchName+".ESumLeading").c_str(), &(data->ESumLeading));
-                tree -> Branch((branchName+".ESumGap").c_str(), &(data->ESumGap));
-                tree -> Branch((branchName+".baseline").c_str(), &(data->baseline));
-              }
+          tagger_data[info.index] = tag;
+        } else { //regular measurement
+          PixieEvent *data = new PixieEvent();          
+          compress(tree -> Branch((branchName+".eventTime").c_str(), &(data->eventTime)), "event");
+          compress(tree -> Branch((branchName+".eventRelTime").c_str(), &(data->eventRelTime)), "event");
+          compress(tree -> Branch((branchName+".finishCode").c_str(), &(data->finishCode)), "event");
+          compress(tree -> Branch((branchName+".CFDForce").c_str(), &(data->CFDForce)), "event");
+          compress(tree -> Branch((branchName+".eventEnergy").c_str(), &(data->eventEnergy)), "event");
+          compress(tree -> Branch((branchName+".outOfRange").c_str(), &(data->outOfRange)), "event");
+
+          //if Raw Energy Sums enabled
+          if (opt.rawE) {
+            if (channel->eraw) {
+              compress(tree -> Branch((branchName+".ESumTrailing").c_str(), &(data->ESumTrailing)), "eraw");
+              compress(tree -> Branch((branchName+".ESumLeading").c_str(), &(data->ESumLeading)), "eraw");
+              compress(tree -> Branch((branchName+".ESumGap").c_str(), &(data->ESumGap)), "eraw");
+              compress(tree -> Branch((branchName+".baseline").c_str(), &(data->baseline)), "eraw");
             }
+          }
 
-            //if QDCs enabled
-            if (options.QDCs) {
-              if (channel->qdcs) {
-                for (int i=0; i<8; ++i) {
-                  tree -> Branch((branchName+".QDCSum"+std::to_string(i)).c_str(), &(data->QDCSums[i]));
-                }
+          //if QDCs enabled
+          if (opt.QDCs) {
+            if (channel->qdcs) {
+              for (int i=0; i<8; ++i) {
+                compress(tree -> Branch((branchName+".QDCSum"+std::to_string(i)).c_str(), &(data->QDCSums[i])), "qdc");
               }
             }
+          }
 
-            //if traces enabled
-            if (options.traces) {            
-              if (channel->traces) {
-                if (!channel->alg) {
-                  std::cout << "Must provide an algorithm to process traces! " << std::endl;
-                }
-                else {
-                  auto trace_meas = channel->alg->Prototype();
-                  PixieTraceEvent *tracedata = new PixieTraceEvent(trace_meas.size());
-                  for (int i=0; i<trace_meas.size(); ++i) {
-                    PIXIE::Trace::Measurement meas = trace_meas[i];
-                    tree->Branch((branchName+"."+meas.name).c_str(), &(tracedata->meas[i]));
-                  }
-                  channel_to_tracedata.insert({channel, tracedata});
+          //if traces enabled
+          if (opt.traces) {            
+            if (channel->traces) {
+              if (!channel->alg) {
+                std::cout << "Must provide an algorithm to process traces! " << std::endl;
+              }
+              else {
+                auto trace_meas = channel->alg->Prototype();
+                PixieTraceEvent *tracedata = new PixieTraceEvent(trace_meas.size());
+                for (int i=0; i<trace_meas.size(); ++i) {
+                  PIXIE::Trace::Measurement meas = trace_meas[i];
+                  compress(tree->Branch((branchName+"."+meas.name).c_str(), &(tracedata->meas[i])), "trace");
                 }
+                detector_tracedata[info.index] = tracedata;
               }
             }
-
-            channel_to_data.insert({channel, data});
           }
 
-        } 
+          detector_data[info.index] = data;
+        }
+
       } 
     } 
+  } 
+
+  for (auto tag : tagger_data) {
+    //*reinterpret_cast<PixieTagger *>(tag) = {0, 0, 0};
+    if (tag) { tag -> Reset(); } // this is how we do, chill in laid back
+  }
+}
+
+int TreeWriter::fill_hits(const PIXIE::HitBatch &batch, size_t event) {
+  if ((int)batch.mult(event) < opt.minMult) {
+    return 0;
+  }
+
+  size_t nTrace = 0;
+  for (uint32_t h=batch.first(event); h<batch.last(event); ++h) {
+    nTrace += batch.traceCount[h];
+  }
+  if (hits.reserve(batch.mult(event), nTrace)) {
+    bind_hits(false);
+  }
+
+  using ChannelInfo = PIXIE::Experiment_Definition::ChannelInfo;
+
+  int n = 0;
+  hits.nTrace = 0;
+  for (uint32_t h=batch.first(event); h<batch.last(event); ++h) {
+    const auto &info = definition->Lookup(batch.id[h]);
+    if (info.index < 0) {
+      continue; //no branch for it in the dense layout either
+    }
+    bool eraw = info.flags & ChannelInfo::kERaw;
+    bool qdcs = info.flags & ChannelInfo::kQDCs;
+    hits.id[n]           = batch.id[h];
+    hits.tagger[n]       = (info.flags & ChannelInfo::kTagger) != 0;
+    hits.eventTime[n]    = batch.eventTime[h];
+    hits.eventRelTime[n] = batch.eventRelTime[h];
+    hits.finishCode[n]   = batch.finishCode[h];
+    hits.CFDForce[n]     = batch.CFDForce[h];
+    hits.eventEnergy[n]  = batch.eventEnergy[h];
+    hits.outOfRange[n]   = batch.outOfRange[h];
+
+    if (opt.rawE) {
+      hits.ESumTrailing[n] = eraw ? batch.ESumTrailing[h] : 0;
+      hits.ESumLeading[n]  = eraw ? batch.ESumLeading[h] : 0;
+      hits.ESumGap[n]      = eraw ? batch.ESumGap[h] : 0;
+      hits.baseline[n]     = eraw ? batch.baseline[h] : 0;
+    }
+
+    if (opt.QDCs) {
+      for (int i=0; i<8; ++i) {
+        hits.QDCSums[8*n+i] = qdcs ? batch.QDCSums[8*h+i] : 0;
+      }
+    }
+
+    if (opt.traces) {
+      hits.traceFirst[n] = -1;
+      if ((info.flags & ChannelInfo::kTraces) && batch.traceCount[h]) {
+        hits.traceFirst[n] = hits.nTrace;
+        for (int32_t i=0; i<batch.traceCount[h]; ++i) {
+          hits.traceMeas[hits.nTrace++] = batch.traceMeas[batch.traceFirst[h]+i];
+        }
+      }
+    }
+    ++n;
+  }
+  hits.mult = n;
+
+  tree -> Fill();
+  segmentEntries += 1;
+  return 1;
+}
+
+int TreeWriter::fill(const PIXIE::HitBatch &batch, size_t event) {
+  if (opt.sparse) {
+    return fill_hits(batch, event);
+  }
+
+  using ChannelInfo = PIXIE::Experiment_Definition::ChannelInfo;
+
+  int mult = 0;
+  for (auto data : detector_data) {
+    if (data) { data -> Reset(); } // bring the beat back
+  }
+  for (auto tracedata : detector_tracedata) {
+    if (tracedata) { tracedata -> Reset(); } // bring the beat back
+  }
+  for (auto tag : tagger_data) {
+    // only change this part of the tagger
+    if (tag) { tag -> taggerNew = 0; }
+  }
+
+  // Done setting up, iterate and fill the event
+  for (uint32_t h=batch.first(event); h<batch.last(event); ++h) {
+    const auto &info = definition->Lookup(batch.id[h]);
+    mult += 1;
+    if (info.index < 0) {
+      continue;
+    }
+
+    if (info.flags & ChannelInfo::kTagger) {
+      //it's a tagger
+      PixieTagger *tag = tagger_data[info.index];
+      if ( tag && batch.finishCode[h] == 0 ) {
+        //Only update for the first tagger in the event
+        if(tag->taggerNew == 0 ) {
+          tag->taggerValue = batch.eventEnergy[h];  //tag values are stored as energy
+          tag->taggerTime = batch.eventTime[h];  //time at which the tagger fired
+        }
+        tag->taggerNew += 1; // ask Tim Gray about this one.
+      }
+      continue;
+    }
+
+    PixieEvent *data = detector_data[info.index];
+    if (data) {
+      //it's a detector
+      data->finishCode   = batch.finishCode[h];
+      data->eventTime    = batch.eventTime[h];
+      data->eventRelTime = batch.eventRelTime[h]; // time relative to the first trigger plus 1 -A
+      data->CFDForce     = batch.CFDForce[h];
+      data->eventEnergy  = batch.eventEnergy[h];
+      data->outOfRange   = batch.outOfRange[h];
+
+      if (opt.rawE) {
+        if (info.flags & ChannelInfo::kERaw) {
+          data->ESumTrailing   = batch.ESumTrailing[h];
+          data->ESumLeading   = batch.ESumLeading[h];
+          data->ESumGap   = batch.ESumGap[h];
+          data->baseline   = batch.baseline[h];
+        }
+      }
 
+      if (opt.QDCs) {
+        if (info.flags & ChannelInfo::kQDCs) {
+          for (int i=0;i<8;++i)
+            {
+              data->QDCSums[i]   = batch.QDCSums[8*h+i];
+            }
+        }
+      }
+    }
+
+    PixieTraceEvent *tracedata = detector_tracedata[info.index];
+    if (tracedata) {
+      if (opt.traces) {
+        if (info.flags & ChannelInfo::kTraces) {
+          for (int i=0;i<tracedata->meas.size(); ++i) {
+            if (i >= batch.traceCount[h]) {
+              tracedata->meas[i] = 0;
+            }
+            else {
+              tracedata->meas[i] = batch.traceMeas[batch.traceFirst[h]+i];
+            }
+          }
+        }
+      }
+    }
+  }
+        
+  if (mult >= opt.minMult) {
+    tree -> Fill();
+    segmentEntries += 1;
+    return 1;
+  }
+  return 0;
+}
 
-    // preallocating should speed up
-    std::vector<PIXIE::Event> new_events(options.events_per_read);
+void TreeWriter::flush(int seq) {
+  if (!merged) {
+    //baskets are written by autoFlush, just make sure a crash leaves a readable file
+    if (opt.checkpoint > 0 && std::chrono::steady_clock::now() - lastCheckpoint >= std::chrono::seconds(opt.checkpoint)) {
+      tree -> AutoSave("SaveSelf");
+      chunkTree -> AutoSave("SaveSelf");
+      lastCheckpoint = std::chrono::steady_clock::now();
+    }
+    return;
+  }
+
+  if (segmentEntries == 0) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(merged->mutex);
+  chunkSeq = seq;
+  chunkFirstEntry = merged -> entries;
+  chunkEntries = segmentEntries;
+  chunkTree -> Fill();
+  merged -> entries += segmentEntries;
+  segmentEntries = 0;
+  //hands the trees to the merger and empties them
+  file -> Write();
+}
+
+void TreeWriter::end_chunk(int seq) {
+  if (merged) {
+    return; //every segment already has its row
+  }
+  chunkSeq = seq;
+  chunkEntries = tree -> GetEntries() - chunkFirstEntry;
+  chunkTree -> Fill();
+  chunkFirstEntry = tree -> GetEntries();
+}
+
+void TreeWriter::write() {
+  if (merged) {
+    return;
+  }
+  tree -> Write(tree->GetName(), TObject::kOverwrite);
+  chunkTree -> Write();
+}
+
+#ifdef PIXIE2ROOT_RNTUPLE
+std::unique_ptr<ROOT::RNTupleModel> NTupleWriter::model(const options &op) {
+  auto model = ROOT::RNTupleModel::Create();
+  model -> MakeField<std::int32_t>("chunk");
+  model -> MakeField<std::vector<std::uint16_t>>("id");
+  model -> MakeField<std::vector<std::uint8_t>>("tagger");
+  model -> MakeField<std::vector<std::uint64_t>>("eventTime");
+  for (const char *name : {"eventRelTime", "finishCode", "CFDForce", "eventEnergy", "outOfRange"}) {
+    model -> MakeField<std::vector<std::uint32_t>>(name);
+  }
+  if (op.rawE) {
+    for (const char *name : {"ESumTrailing", "ESumLeading", "ESumGap", "baseline"}) {
+      model -> MakeField<std::vector<std::uint32_t>>(name);
+    }
+  }
+  if (op.QDCs) {
+    model -> MakeField<std::vector<std::array<std::uint32_t, 8>>>("QDCSums");
+  }
+  if (op.traces) {
+    model -> MakeField<std::vector<std::vector<std::int32_t>>>("traceMeas");
+  }
+  return model;
+}
+
+ROOT::RNTupleWriteOptions NTupleWriter::write_options(const options &op) {
+  ROOT::RNTupleWriteOptions writeOptions;
+  if (op.compression >= 0) {
+    writeOptions.SetCompression(op.compression);
+  }
+  //clusters play the part of the TTree's autoFlush
+  writeOptions.SetApproxZippedClusterSize(op.autoFlush);
+  return writeOptions;
+}
+
+NTupleWriter::NTupleWriter(const options &op, PIXIE::Experiment_Definition *def, const std::string &path, MergedNTuple *m)
+  : opt(op), definition(def) {
+  if (m) {
+    context = m -> writer -> CreateFillContext();
+    entry = context -> CreateEntry();
+  }
+  else {
+    writer = ROOT::RNTupleWriter::Recreate(model(opt), "RawTree", path, write_options(opt));
+    entry = writer -> CreateEntry();
+  }
+}
+
+void NTupleWriter::branch(std::ofstream &log) {
+  log << "RNTuple output, one collection per field over the hits" << std::endl;
+  if (!opt.branchCompression.empty()) {
+    log << "branch compression ignored, an RNTuple has one setting for the file" << std::endl;
+  }
+
+  chunk = entry -> GetPtr<std::int32_t>("chunk");
+  id = entry -> GetPtr<std::vector<std::uint16_t>>("id");
+  tagger = entry -> GetPtr<std::vector<std::uint8_t>>("tagger");
+  eventTime = entry -> GetPtr<std::vector<std::uint64_t>>("eventTime");
+  eventRelTime = entry -> GetPtr<std::vector<std::uint32_t>>("eventRelTime");
+  finishCode = entry -> GetPtr<std::vector<std::uint32_t>>("finishCode");
+  CFDForce = entry -> GetPtr<std::vector<std::uint32_t>>("CFDForce");
+  eventEnergy = entry -> GetPtr<std::vector<std::uint32_t>>("eventEnergy");
+  outOfRange = entry -> GetPtr<std::vector<std::uint32_t>>("outOfRange");
+  if (opt.rawE) {
+    ESumTrailing = entry -> GetPtr<std::vector<std::uint32_t>>("ESumTrailing");
+    ESumLeading = entry -> GetPtr<std::vector<std::uint32_t>>("ESumLeading");
+    ESumGap = entry -> GetPtr<std::vector<std::uint32_t>>("ESumGap");
+    baseline = entry -> GetPtr<std::vector<std::uint32_t>>("baseline");
+  }
+  if (opt.QDCs) {
+    QDCSums = entry -> GetPtr<std::vector<std::array<std::uint32_t, 8>>>("QDCSums");
+  }
+  if (opt.traces) {
+    traceMeas = entry -> GetPtr<std::vector<std::vector<std::int32_t>>>("traceMeas");
+  }
+}
+
+void NTupleWriter::start_chunk(int seq) {
+  *chunk = seq;
+}
+
+int NTupleWriter::fill(const PIXIE::HitBatch &batch, size_t event) {
+  if ((int)batch.mult(event) < opt.minMult) {
+    return 0;
+  }
+
+  //clear() keeps the capacity, so after the first few events nothing is allocated
+  id -> clear();
+  tagger -> clear();
+  eventTime -> clear();
+  for (auto *column : {&eventRelTime, &finishCode, &CFDForce, &eventEnergy, &outOfRange}) {
+    (*column) -> clear();
+  }
+  if (opt.rawE) {
+    for (auto *column : {&ESumTrailing, &ESumLeading, &ESumGap, &baseline}) {
+      (*column) -> clear();
+    }
+  }
+  if (opt.QDCs) {
+    QDCSums -> clear();
+  }
+  if (opt.traces) {
+    traceMeas -> clear();
+  }
+
+  using ChannelInfo = PIXIE::Experiment_Definition::ChannelInfo;
+  for (uint32_t h=batch.first(event); h<batch.last(event); ++h) {
+    const auto &info = definition->Lookup(batch.id[h]);
+    if (info.index < 0) {
+      continue;
+    }
+    bool eraw = info.flags & ChannelInfo::kERaw;
+    bool qdcs = info.flags & ChannelInfo::kQDCs;
+    id -> push_back(batch.id[h]);
+    tagger -> push_back((info.flags & ChannelInfo::kTagger) != 0);
+    eventTime -> push_back(batch.eventTime[h]);
+    eventRelTime -> push_back(batch.eventRelTime[h]);
+    finishCode -> push_back(batch.finishCode[h]);
+    CFDForce -> push_back(batch.CFDForce[h]);
+    eventEnergy -> push_back(batch.eventEnergy[h]);
+    outOfRange -> push_back(batch.outOfRange[h]);
+
+    if (opt.rawE) {
+      ESumTrailing -> push_back(eraw ? batch.ESumTrailing[h] : 0);
+      ESumLeading -> push_back(eraw ? batch.ESumLeading[h] : 0);
+      ESumGap -> push_back(eraw ? batch.ESumGap[h] : 0);
+      baseline -> push_back(eraw ? batch.baseline[h] : 0);
+    }
+
+    if (opt.QDCs) {
+      QDCSums -> emplace_back();
+      for (int i=0; i<8; ++i) {
+        QDCSums->back()[i] = qdcs ? batch.QDCSums[8*h+i] : 0;
+      }
+    }
+
+    if (opt.traces) {
+      traceMeas -> emplace_back();
+      if (info.flags & ChannelInfo::kTraces) {
+        const int32_t *first = batch.traceMeas.data() + batch.traceFirst[h];
+        traceMeas->back().assign(first, first + batch.traceCount[h]);
+      }
+    }
+  }
+
+  if (context) {
+    context -> Fill(*entry);
+  }
+  else {
+    writer -> Fill(*entry);
+  }
+  return 1;
+}
+
+void NTupleWriter::flush(int seq) {
+  //clusters are written as they fill up, and there is no header to checkpoint
+}
+
+void NTupleWriter::end_chunk(int seq) {
+  //every entry carries its chunk
+}
+
+void NTupleWriter::write() {
+  //commits the clusters still in memory and, for our own file, the footer
+  entry.reset();
+  context.reset();
+  writer.reset();
+}
+#endif
+
+Pipeline::Pipeline(OutputWriter &w, const PIXIE::Experiment_Definition &def, int nw, int depth)
+  : decodeWait(0),
+    fillWait(0),
+    writer(w),
+    definition(def),
+    nWorkers(nw),
+    freeBatches(depth),
+    toProcess(depth + nw),
+    toWrite(depth + 1) {
+  for (int i=0; i<depth; ++i) {
+    batches.push_back(new Batch());
+    freeBatches.push(batches.back());
+  }
+  for (int i=0; i<nWorkers; ++i) {
+    workers.emplace_back(&Pipeline::process, this);
+  }
+  writerThread = std::thread(&Pipeline::write, this);
+}
+
+Pipeline::~Pipeline() {
+  finish();
+  for (auto batch : batches) {
+    delete batch;
+  }
+}
+
+Pipeline::Batch *Pipeline::acquire() {
+  Batch *batch;
+  if (!freeBatches.try_pop(batch)) {
+    auto start = std::chrono::steady_clock::now();
+    batch = freeBatches.pop();
+    decodeWait += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  }
+  batch -> hits.clear();
+  batch -> chunkEnd = false;
+  return batch;
+}
+
+void Pipeline::submit(Batch *batch) {
+  //the writer sees batches in the order they were read, whoever processes them
+  toWrite.push(batch);
+  toProcess.push(batch);
+}
+
+void Pipeline::end_chunk(int seq) {
+  Batch *batch = acquire();
+  batch -> chunk = seq;
+  batch -> chunkEnd = true;
+  submit(batch);
+}
+
+void Pipeline::finish() {
+  if (!writerThread.joinable()) {
+    return;
+  }
+  for (int i=0; i<nWorkers; ++i) {
+    toProcess.push(nullptr);
+  }
+  toWrite.push(nullptr);
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  writerThread.join();
+}
+
+void Pipeline::process() {
+  //algorithm objects keep state between calls, so each worker gets its own
+  std::unordered_map<const PIXIE::Experiment_Definition::Channel*, PIXIE::Trace::Algorithm*> algs;
+  std::vector<int32_t> datums;
+  while (Batch *batch = toProcess.pop()) {
+    PIXIE::HitBatch &hits = batch -> hits;
+    for (size_t h=0; h<hits.hits(); ++h) {
+      if (hits.sampleFirst[h] < 0) {
+        continue;
+      }
+      auto *channel = definition.Lookup(hits.id[h]).channel;
+      auto alg = algs.find(channel);
+      if (alg == algs.end()) {
+        PIXIE::Trace::Algorithm *tracealg = nullptr;
+        PIXIE::setTraceAlg(tracealg, channel->algName, channel->algFile, channel->algIndex);
+        alg = algs.insert({channel, tracealg}).first;
+      }
+      PIXIE::Trace::Algorithm *tracealg = alg->second;
+      if (!tracealg || !tracealg->loaded) {
+        continue;
+      }
+      datums.resize(tracealg->Width());
+      int n = tracealg->Process(&hits.samples[hits.sampleFirst[h]], hits.sampleCount[h], datums.data());
+      hits.set_trace(h, datums.data(), n);
+    }
+    batch -> processed.store(true, std::memory_order_release);
+  }
+  for (auto &alg : algs) {
+    delete alg.second;
+  }
+}
+
+void Pipeline::write() {
+  while (Batch *batch = toWrite.pop()) {
+    if (!batch->processed.load(std::memory_order_acquire)) {
+      auto start = std::chrono::steady_clock::now();
+      for (int spins=0; !batch->processed.load(std::memory_order_acquire); ++spins) {
+        PIXIE::BoundedQueue<Batch*>::backoff(spins);
+      }
+      fillWait += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    if (batch->chunkEnd) {
+      writer.end_chunk(batch->chunk);
+    }
+    else {
+      writer.start_chunk(batch->chunk);
+      for (size_t event=0; event<batch->hits.events(); ++event) {
+        writer.fill(batch->hits, event);
+      }
+      writer.flush(batch->chunk);
+    }
+
+    batch -> processed.store(false, std::memory_order_relaxed);
+    freeBatches.push(batch);
+  }
+}
+
+namespace PIXIE {  
+  void *Process(void *thread) {
+    PixieThread *pixie_thread        = (PixieThread*)thread;
+    PIXIE::Reader *reader            = &(pixie_thread -> reader);
+    options options                  = pixie_thread -> opt;
+    Experiment_Definition definition = pixie_thread -> definition;
+    ChunkScheduler *scheduler        = pixie_thread -> scheduler;
+    int threadNum                    = pixie_thread -> threadNum;
+
+    reader -> definition = definition;
+    reader -> thread = threadNum;
+    reader -> useMmap = options.mmap;
+    reader -> blockSize = options.blockSize;
+    reader -> directIO = options.directIO;
+    reader -> prefetchDepth = options.prefetchDepth;
+    reader -> deferTraces = options.dspThreads > 0;
+    reader -> batchDecode = options.batchDecode;
+    reader -> timeOrder = options.timeOrder;
+    reader -> reorderWindow = options.reorderWindow;
+    reader -> live = options.live;
+    reader -> disorder = options.disorder;
+    reader -> buildMode = (PIXIE::Event::Mode)options.buildMode;
+    
+    //reader -> set_algorithm(((PixieThread*)thread) -> tracealg);    
+
+    std::ofstream log(("Thread_"+std::to_string(threadNum)+".log").c_str());
+    log << "[ " << threadNum << " ] " << std::endl;
+    log << std::flush;
+
+    std::string outPath = options.path_output+"_"+std::to_string(threadNum);
+    if (pixie_thread->merged || pixie_thread->mergedNTuple) {
+      outPath = options.path_output;
+    }
+    if (options.verbose==true) {
+      log << "Creating " << (options.rntuple ? "RNTuple" : "ROOT Tree") << " in file: "<< outPath << std::endl;
+      log << std::flush;
+    } 
+
+    std::shared_ptr<ROOT::TBufferMergerFile> mergeFile;
+    TFile *outFile = nullptr;
+    OutputWriter *writer;
+#ifdef PIXIE2ROOT_RNTUPLE
+    if (options.rntuple) {
+      writer = new NTupleWriter(options, &(reader->definition), outPath, pixie_thread->mergedNTuple);
+    }
+    else
+#endif
+    {
+      if (pixie_thread->merged) {
+        //in-memory file, merged into the single output as we go
+        mergeFile = pixie_thread -> merged -> merger.GetFile();
+        outFile = mergeFile.get();
+      }
+      else {
+        outFile = new TFile(outPath.c_str(), "recreate");
+      }
+      //branches take the file's compression when they are made
+      if (options.compression >= 0) {
+        outFile -> SetCompressionSettings(options.compression);
+      }
+      writer = new TreeWriter(options, &(reader->definition), outFile, pixie_thread->merged);
+    }
+    writer -> branch(log);
+
+    //decoding stays on this thread, trace processing and filling move to others
+    Pipeline *pipeline = nullptr;
+    if (options.dspThreads > 0) {
+      pipeline = new Pipeline(*writer, reader->definition, options.dspThreads, 2*options.dspThreads + 2);
+      log << "pipelined with " << options.dspThreads << " trace processing threads" << std::endl;
+    }
+
+    //reused read after read, so filling allocates nothing once it has grown
+    PIXIE::HitBatch new_hits;
 
     log << "opening the listmode data " << std::endl;
     log << std::flush;
@@ -153,136 +814,74 @@ namespace PIXIE {
       std::cout << std::flush;
     }
 
-    for (auto& map_entry : channel_to_tagger) {
-      //*reinterpret_cast<PixieTagger *>(map_entry.second) = {0, 0, 0};
-      map_entry.second -> Reset(); // this is how we do, chill in laid back
-    }
-
-    reader -> set_offset(offset);  
     // start timing
     //size_t eventsread = 0;
     log << "starting the event loop " << std::endl;
     log << std::flush;
     reader -> start();
-    reader -> set_offset(offset);
+
+    ////////////////
+    // chunk loop //
+    ////////////////
+    ChunkScheduler::Chunk chunk;
+    bool done = false;
+    int stolen;
+    while (!done && (stolen = scheduler->next(threadNum, chunk)) >= 0) {
+      auto chunkStart = std::chrono::steady_clock::now();
+      pixie_thread -> chunks += 1;
+      pixie_thread -> steals += stolen;
+      reader -> set_offset(chunk.begin);
+      options.liveCount = 0;
+      if (!pipeline) {
+        writer -> start_chunk(chunk.seq);
+      }
 
     ///////////////
     // read loop //
     ///////////////
     while(true) {
-      new_events.clear();
+      Pipeline::Batch *batch = nullptr;
+      PIXIE::HitBatch *hits = &new_hits;
+      if (pipeline) {
+        batch = pipeline -> acquire();
+        batch -> chunk = chunk.seq;
+        hits = &(batch -> hits);
+      }
+
+      hits -> clear();
       if (options.breakatevent > 0 && reader->eventsread + options.events_per_read > options.breakatevent){
-	reader -> read(new_events, options.coincWindow, options.breakatevent - reader->eventsread, max_offset, options.warnings);
+	reader -> read(*hits, options.coincWindow, options.breakatevent - reader->eventsread, chunk.end, options.warnings);
       }
       else{
-      	reader -> read(new_events, options.coincWindow, options.events_per_read, max_offset, options.warnings);
+      	reader -> read(*hits, options.coincWindow, options.events_per_read, chunk.end, options.warnings);
       }
-      reader->eventsread = reader->eventsread + new_events.size();
-
-      if (new_events.size()) {
-        for (auto& event : new_events) {
-          int mult = 0;
-          for (auto &map_entry : channel_to_data) {
-            map_entry.second -> Reset(); // bring the beat back
-          }
-          for (auto &map_entry : channel_to_tracedata) {
-            map_entry.second -> Reset(); // bring the beat back
-          }
-          for (auto &map_entry : channel_to_tagger) {
-            // only change this part of the tagger
-            (map_entry.second) -> taggerNew = 0;
-          }
-
-          // Done setting up, iterate and fill the event
-          for (auto &meas : event.fMeasurements) {
-            auto *channel = reader->definition.GetChannel(meas.crateID, meas.slotID, meas.channelNumber);
-            const auto& detector = channel_to_data.find(channel);
-            const auto& tagger = channel_to_tagger.find(channel);
-
-            if (!(detector == channel_to_data.end())) {
-              //it's a detector
-              (detector->second)->finishCode   = meas.finishCode;
-              (detector->second)->eventTime    = meas.eventTime;
-              (detector->second)->eventRelTime = meas.eventRelTime; // time relative to the first trigger plus 1 -A
-              (detector->second)->CFDForce     = meas.CFDForce;
-              (detector->second)->eventEnergy  = meas.eventEnergy;
-              (detector->second)->outOfRange   = meas.outOfRange;
-
-              if (options.rawE) {
-                if (channel->eraw) {
-                  (detector->second)->ESumTrailing   = meas.ESumTrailing;
-                  (detector->second)->ESumLeading   = meas.ESumLeading;
-                  (detector->second)->ESumGap   = meas.ESumGap;
-                  (detector->second)->baseline   = meas.baseline;
-                }
-              }
-
-              if (options.QDCs) {
-                if (channel->qdcs) {
-                  for (int i=0;i<8;++i)
-                    {
-                      (detector->second)->QDCSums[i]   = meas.QDCSums[i];
-                    }
-                }
-              }
-            }
-
-            const auto& tracedetector = channel_to_tracedata.find(channel);
-
-            if (!(tracedetector == channel_to_tracedata.end())) {
-              if (options.traces) {
-                if (channel->traces) {
-                  for (int i=0;i<(tracedetector->second)->meas.size(); ++i) {
-                    if (i >= meas.trace_meas.size()) {
-                      (tracedetector->second)->meas[i] = 0;
-                    }
-                    else {
-                      (tracedetector->second)->meas[i] = meas.trace_meas[i].datum;
-                    }
-                  }
-                }
-              }
-            }
+      reader->eventsread = reader->eventsread + hits->events();
 
-            mult += 1;
-
-            if (!(tagger == channel_to_tagger.end())) {
-              //it's a tagger
-              if ( meas.finishCode == 0 ) {
-		//Only update for the first tagger in the event
-		if((tagger->second)->taggerNew == 0 ) {
-		  (tagger->second)->taggerValue = meas.eventEnergy;  //tag values are stored as energy
-		  (tagger->second)->taggerTime = meas.eventTime;  //time at which the tagger fired
-		}
-		(tagger->second)->taggerNew += 1; // ask Tim Gray about this one.
-              }
-              continue;
-            }
-            else {
-              continue;
-            }
-          }
-        
-          if (mult >= options.minMult) {
-            tree -> Fill();
-          }
+      if (pipeline) {
+        pipeline -> submit(batch);
+      }
+      else {
+        for (size_t event=0; event<hits->events(); ++event) {
+          writer -> fill(*hits, event);
         }// event loop
+        writer -> flush(chunk.seq);
       }
 
-      tree -> Write();
       reader -> printUpdate();
 
       if (options.breakatevent && reader->eventsread >= options.breakatevent) {
-        tree -> Write(tree->GetName(), TObject::kOverwrite);
+        done = true;
         break;
       }
 
       if (reader->eof() || reader->end) {
-        if (options.live && options.liveCount<=10) { //if we hit the end of the file for 50 seconds continuously, assume we have stopped acquiring data and quit
+        if (options.live && chunk.end < 0 && options.liveCount<=10) { //if we hit the end of the file for 50 seconds continuously, assume we have stopped acquiring data and quit
           std::cout << " eof? " << options.liveCount << std::endl;
           std::this_thread::sleep_for(std::chrono::milliseconds(10));
           options.liveCount=options.liveCount+1;
           continue;
+        } else if (reader->drain()) { //acquisition has stopped, let the time-ordering go
+          continue;
         } else {
           break;
         }
@@ -290,8 +889,34 @@ namespace PIXIE {
 
     } //while (true) loop
 
-    outFile.Purge();
-    outFile.Close();
+      if (pipeline) {
+        pipeline -> end_chunk(chunk.seq);
+      }
+      else {
+        writer -> end_chunk(chunk.seq);
+      }
+      pixie_thread -> busyTime += std::chrono::duration<double>(std::chrono::steady_clock::now() - chunkStart).count();
+    } //chunk loop
+
+    if (pipeline) {
+      pipeline -> finish();
+      pixie_thread -> decodeWait = pipeline -> decodeWait;
+      pixie_thread -> fillWait = pipeline -> fillWait;
+      delete pipeline;
+    }
+
+    writer -> write();
+    delete writer;
+    reader -> close();
+
+    if (mergeFile) {
+      mergeFile.reset();
+    }
+    else if (outFile) {
+      outFile -> Purge();
+      outFile -> Close();
+      delete outFile;
+    }
     pthread_exit(NULL);
   }
 }
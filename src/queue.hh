@@ -0,0 +1,107 @@
+// -*-c++-*-
+/* libpixie bounded queue for passing work between pipeline stages */
+
+#ifndef LIBPIXIE_QUEUE_H
+#define LIBPIXIE_QUEUE_H
+
+#include <atomic>
+#include <vector>
+#include <thread>
+#include <chrono>
+#include <cstddef>
+
+namespace PIXIE {
+  /* Fixed-size multi-producer/multi-consumer ring (D. Vyukov's design).
+     Every cell carries a sequence number telling whether it is ready to
+     be written (seq == pos) or read (seq == pos+1), so producers and
+     consumers each claim a position with one compare-and-swap on their
+     own counter and never take a lock.  The capacity is rounded up to a
+     power of two. */
+  template <typename T>
+  class BoundedQueue {
+  private:
+    struct alignas(64) Cell {
+      std::atomic<size_t> seq;
+      T data;
+    };
+
+    std::vector<Cell> cells;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head; //next position to write
+    alignas(64) std::atomic<size_t> tail; //next position to read
+
+  public:
+    explicit BoundedQueue(size_t capacity) : head(0), tail(0) {
+      size_t size = 2;
+      while (size < capacity) { size <<= 1; }
+      cells = std::vector<Cell>(size);
+      mask = size - 1;
+      for (size_t i=0; i<size; ++i) {
+        cells[i].seq.store(i, std::memory_order_relaxed);
+      }
+    }
+
+    bool try_push(const T &value) {
+      size_t pos = head.load(std::memory_order_relaxed);
+      while (true) {
+        Cell &cell = cells[pos & mask];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        if (seq == pos) {
+          if (head.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+            cell.data = value;
+            cell.seq.store(pos+1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (seq < pos) {
+          return false; //full
+        }
+        else {
+          pos = head.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    bool try_pop(T &value) {
+      size_t pos = tail.load(std::memory_order_relaxed);
+      while (true) {
+        Cell &cell = cells[pos & mask];
+        size_t seq = cell.seq.load(std::memory_order_acquire);
+        if (seq == pos+1) {
+          if (tail.compare_exchange_weak(pos, pos+1, std::memory_order_relaxed)) {
+            value = cell.data;
+            cell.seq.store(pos+mask+1, std::memory_order_release);
+            return true;
+          }
+        }
+        else if (seq < pos+1) {
+          return false; //empty
+        }
+        else {
+          pos = tail.load(std::memory_order_relaxed);
+        }
+      }
+    }
+
+    //blocking versions: spin briefly, then back off so idle stages don't burn a core
+    void push(const T &value) {
+      for (int spins=0; !try_push(value); ++spins) { backoff(spins); }
+    }
+    T pop() {
+      T value;
+      for (int spins=0; !try_pop(value); ++spins) { backoff(spins); }
+      return value;
+    }
+
+    static void backoff(int spins) {
+      if (spins < 64) {
+        std::this_thread::yield();
+      }
+      else {
+        std::this_thread::sleep_for(std::chrono::microseconds(50));
+      }
+    }
+  };
+}
+
+#endif //LIBPIXIE_QUEUE_H
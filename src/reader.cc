@@ -6,6 +6,7 @@
 #include <cstdio>
 #include <cstring>
 #include <cassert>
+#include <algorithm>
 #include <sys/stat.h>
 #include <unistd.h>
 
@@ -16,7 +17,28 @@
 namespace PIXIE
 {
   Reader::Reader()
-    : file(nullptr)
+    : file(nullptr),
+      source(nullptr),
+      useMmap(false),
+      blockSize(4<<20),
+      directIO(false),
+      prefetchDepth(0),
+      deferTraces(false),
+      buildMode(Event::kRolling),
+      batchDecode(false),
+      timeOrder(false),
+      reorderWindow(100000),
+      live(false),
+      orderer(nullptr),
+      lateRecords(0),
+      forcedRecords(0),
+      reorderPeak(0),
+      disorder(0),
+      building(&arena),
+      keepLookahead(true),
+      ioTime(0),
+      ioStall(0),
+      decodeStall(0)
   {
     this->pileups      = 0;
 
@@ -31,6 +53,9 @@ namespace PIXIE
     this->outofrange   = 0;
     this->subevents    = 0;
     this->nEvents      = 0;
+    this->decodes      = 0;
+    this->traces       = 0;
+    this->untriggered  = 0;
 
     this->liveSort     = 0;
 
@@ -46,21 +71,41 @@ namespace PIXIE
   
   Reader::~Reader()
   {
+    delete this->source;
   }  
 
   off_t Reader::offset() const
   {
-    return (ftello(this->file));
+    //the lookahead has been read, but not yet put in an event
+    off_t held = this->lookahead.headerLength ? 4*(off_t)this->lookahead.eventLength : 0;
+    held += this->reorder.bytes();
+    if (this->source) {
+      return (this->source->offset() - held);
+    }
+    return (ftello(this->file) - held);
   }
 
   off_t Reader::set_offset(off_t s_offset) {
-    fseek(this->file, s_offset, SEEK_SET);
+    this->batch.clear();
+    this->lookahead.headerLength = 0;
+    this->reorder.clear();
+    if (this->source) {
+      this->source->seek(s_offset);
+    }
+    else {
+      fseek(this->file, s_offset, SEEK_SET);
+    }
     this->start_offset = s_offset;
     return s_offset;
   }
 
   off_t Reader::update_filesize()
   {
+    if (this->source) {
+      this->fileLength = this->source->update_filesize();
+      return(this->fileLength);
+    }
+
     struct stat stat;
     if (fstat(fileno(this->file), &stat) != 0)
       std::cout << "Couldn't stat" << std::endl;
@@ -77,7 +122,7 @@ namespace PIXIE
   
   bool Reader::eof()
   {    
-    assert(this->file);
+    assert(this->file || this->source);
 
     if (this->liveSort) {
       if (this->offset()>this->update_filesize()) {
@@ -86,6 +131,9 @@ namespace PIXIE
     }
     assert(this->offset() <= this->fileLength);
 
+    if (this->source) {
+      return(this->offset() == this->fileLength);
+    }
     return(this->offset() == this->fileLength || std::feof(this->file) );
   }
 
@@ -109,10 +157,45 @@ namespace PIXIE
   }
     
   int Reader::open(const std::string &path) {
-    if (this->file) {
+    this->batch.clear();
+    this->lookahead.headerLength = 0;
+    this->reorder.clear();
+    if (this->file || this->source) {
       return (-1); //file has already been opened
     }
 
+    if (this->useMmap) {
+      this->source = new MappedSource();
+    }
+    else if (this->blockSize > 0 && this->prefetchDepth > 0) {
+      this->source = new PrefetchReader(this->blockSize, this->prefetchDepth, this->directIO);
+    }
+    else if (this->blockSize > 0) {
+      this->source = new BlockReader(this->blockSize, this->directIO);
+    }
+
+    if (this->timeOrder) {
+      if (!this->source) {
+        this->source = new BlockReader(); //ordering is done on a Source
+      }
+      //ordered by offset times, which a module writes out of order by up to their spread
+      uint64_t window = ((uint64_t)this->reorderWindow<<15) + this->definition.offsetSpread;
+      this->orderer = new TimeOrderer(this->source, this->definition, window);
+      this->orderer->live = this->live;
+      this->source = this->orderer;
+    }
+
+    if (this->source) {
+      if (this->source->open(path) < 0) {
+        delete this->source;
+        this->source = nullptr;
+        this->orderer = nullptr;
+        return (-1);
+      }
+      if (this->liveSort) {this->source->seek(this->update_filesize()); this->end = true; usleep(1000000);}
+      return (0);
+    }
+
     if (!(this->file = fopen(path.c_str(), "rb"))) {
       return (-1);
     }
@@ -122,29 +205,134 @@ namespace PIXIE
     return (0);
   }
 
+  int Reader::close() {
+    if (this->source) {
+      this->source->close();
+      this->ioTime      = this->source->ioTime;
+      this->ioStall     = this->source->ioStall;
+      this->decodeStall = this->source->decodeStall;
+      if (this->orderer) {
+        this->lateRecords   = this->orderer->late;
+        this->forcedRecords = this->orderer->forced;
+        this->reorderPeak   = this->orderer->peak;
+      }
+      delete this->source;
+      this->source = nullptr;
+      this->orderer = nullptr;
+    }
+    if (this->file) {
+      fclose(this->file);
+      this->file = nullptr;
+    }
+    return (0);
+  }
+
+  bool Reader::drain() {
+    if (!this->orderer || !this->orderer->live) {
+      return false;
+    }
+    this->orderer->live = false;
+    this->end = false;
+    return true;
+  }
+
+  int Reader::read_measurement(Measurement &meas, uint16_t *outTrace) {
+    if (this->lookahead.headerLength || !this->reorder.empty()) {
+      set_offset(offset()); //read the lookahead (and whatever waits to be reordered) again, here
+    }
+    this->batch.clear(); //decoded from where the cursor was
+    if (this->source) {
+      return (meas.read(*this->source, this->definition, outTrace));
+    }
+    return (meas.read(this->file, this->definition, outTrace));
+  }
+
+  namespace {
+    //where each built event goes
+    void keep(std::vector<Event> &events, Event &event) {
+      events.push_back(std::move(event));
+    }
+    void keep(HitBatch &hits, Event &event) {
+      hits.add(event);
+    }
+  }
+
   int Reader::read(std::vector<Event> &events,
                    int                coincWindow,
                    int                max,
                    off_t              max_offset,
                    bool               warnings) {
+    return read_events(events, coincWindow, max, max_offset, warnings);
+  }
+
+  int Reader::read(HitBatch          &hits,
+                   int                coincWindow,
+                   int                max,
+                   off_t              max_offset,
+                   bool               warnings) {
+    return read_events(hits, coincWindow, max, max_offset, warnings);
+  }
+
+  template <typename Output>
+  int Reader::read_events(Output &out,
+                          int     coincWindow,
+                          int     max,
+                          off_t   max_offset,
+                          bool    warnings) {
     this->max_offset = max_offset;
     coincWindow = coincWindow<<15;
     this->end = false;
     this->update_filesize();
+    if (this->source) {
+      this->source->set_limit(max_offset);
+    }
+    if (this->batchDecode && !this->batch.bound()) {
+      this->batch.bind(this->definition);
+    }
+    //time offsets can put a channel's records behind others by up to their spread
+    uint64_t reorderWindow = std::max((uint64_t)this->disorder<<15, this->definition.offsetSpread);
+    ReorderBuffer *reorder = NULL;
+    if (reorderWindow > 0) {
+      reorder = &this->reorder;
+      if (reorder->window() != reorderWindow) {
+        reorder->set_window(reorderWindow);
+      }
+    }
+    //the previous read's events are done with, start the arena again
+    this->building.release();
+    this->arena.reset();
 
     while (max) { // loop for reading the file 
       //check for reading past max offset        
       if (this->max_offset > 0) {
-        if (ftello(this->file) >= this->max_offset) {
-          std::cout << this->max_offset << "   " << ftello(this->file) << std::endl;
+        if (this->offset() >= this->max_offset) {
+          std::cout << this->max_offset << "   " << this->offset() << std::endl;
           this->end = true;
           break;
         }
       }
 
-      //make Event object
-      Event event;
-      int retval = event.read(this->file, this->definition, coincWindow, this->max_offset, warnings);
+      //start the next event
+      Event &event = this->building;
+      event.clear();
+      event.deferTraces = this->deferTraces;
+      event.mode = this->buildMode;
+      int retval;
+      Measurement *lookahead = this->keepLookahead ? &this->lookahead : NULL;
+      if (this->source && this->batchDecode) {
+        retval = event.read(*this->source, this->batch, this->definition, coincWindow, this->max_offset, warnings, lookahead, reorder);
+      }
+      else if (this->source) {
+        retval = event.read(*this->source, this->definition, coincWindow, this->max_offset, warnings, lookahead, reorder);
+      }
+      else {
+        retval = event.read(this->file, this->definition, coincWindow, this->max_offset, warnings, lookahead, reorder);
+      }
+
+      //records read on the way, even into an event that isn't kept
+      this->decodes += event.decodes;
+      this->traces += event.traces;
+      this->untriggered += event.untriggered;
 
       if (retval == 0) {}  //successful read
       else if (retval == 1) { //end of file 
@@ -165,8 +353,8 @@ namespace PIXIE
         this->mults[i] += event.mults[i];
       }
         
-      //add (now complete event) to the vector of events
-      events.push_back(event);
+      //add (now complete event) to the output
+      keep(out, event);
       max=max-1;
         
       if (eof()) {
@@ -174,11 +362,10 @@ namespace PIXIE
       }
     }//loop for reading the file
     return 0;
-  }//Reader::read
+  }//Reader::read_events
 
   int Reader::dump_traces(int crate, int slot, int chan, std::string outPath, int maxTraces, int append, std::string traceName) {
-    fpos_t pos;
-    fgetpos(this->file, &pos);          
+    off_t pos = this->offset();
 
     int retval=0;
 
@@ -186,7 +373,7 @@ namespace PIXIE
     int traceLen = 0;
     while (traceLen == 0){
       PIXIE::Measurement meas;
-      int retval = meas.read(this->file, this->definition, NULL);
+      int retval = read_measurement(meas, NULL);
       if (retval<0){break;}
       else if (!meas.good_trace || crate!=meas.crateID || slot!=meas.slotID || chan!=meas.channelNumber){;}
       else {
@@ -195,7 +382,7 @@ namespace PIXIE
     }
     if(traceLen == 0){printf("No traces for given channel\n");exit(1);}
 
-    fsetpos(this->file, &pos);  //we were never even here
+    set_offset(pos);  //we were never even here
     //Draw traces
     double superTrace[traceLen];//={0};
 
@@ -205,7 +392,7 @@ namespace PIXIE
     while (nTraces<maxTraces){
       uint16_t trace[traceLen];//={0};
       PIXIE::Measurement meas;
-      int retval = meas.read(this->file, this->definition, trace);
+      int retval = read_measurement(meas, trace);
       if (retval<0){break;}
       else if (!meas.good_trace || crate!=meas.crateID || slot!=meas.slotID || chan!=meas.channelNumber){;}
       else {
@@ -235,7 +422,7 @@ namespace PIXIE
       this->definition.GetChannel(crate, slot, chan)->alg->dumpTrace(&tempTrace[0], traceLen, nTraces, outPath, append, traceName+"_SuperTrace");
     }
 
-    fsetpos(this->file, &pos);  //we were never even here
+    set_offset(pos);  //we were never even here
     return 1;
     
   }
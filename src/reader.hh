@@ -7,7 +7,12 @@
 #include <stdio.h>
 #include <sys/stat.h>
 
+#include "arena.hh"
 #include "event.hh"
+#include "header_batch.hh"
+#include "hit_batch.hh"
+#include "source.hh"
+#include "time_order.hh"
 #include "traces.hh"
 
 namespace PIXIE {
@@ -23,8 +28,37 @@ namespace PIXIE {
     long long sameChanPU;
     long long outofrange;
     long long mults[4];
+    long long decodes;   //records decoded, equal to subevents as none is read twice
+    long long traces;    //traces processed (or kept for processing)
+    long long untriggered; //hits dropped for having no trigger near them (trigger mode)
     
     FILE *file;
+    Source *source;  //cursor-based input, replaces file when set
+    bool useMmap;    //map the listmode file rather than going through stdio
+    size_t blockSize; //read in chunks of this many bytes, 0 = stdio
+    bool directIO;   //bypass the page cache for block reads
+    int prefetchDepth; //blocks read ahead by a separate thread, 0 = none
+    bool deferTraces;  //keep raw traces in the events, to be processed by another thread
+    Event::Mode buildMode; //where events end
+    bool batchDecode;  //decode runs of plain 4-word records many at a time (Source only)
+    bool timeOrder;    //hand the records to event building in time order
+    int reorderWindow; //records this much later (10 ns units) than one make it safe to hand out
+    bool live;         //the file is still being written, hold records back until drain()
+    TimeOrderer *orderer; //the source when time-ordering
+    long long lateRecords;   //time-ordered records later than the reorder window
+    long long forcedRecords; //handed out early, the reorder buffer being full
+    size_t reorderPeak;      //most records held for time-ordering at once
+    int disorder;      //10 ns units of disorder absorbed ahead of event building, 0 = none
+    ReorderBuffer reorder; //decoded records waiting to go into events in time order
+    HeaderBatch batch;
+    Arena arena;       //events and traces of the last read(), reset by the next
+    Event building;    //the event being built, in the arena
+    Measurement lookahead; //decoded record that starts the next event, headerLength 0 = none
+    bool keepLookahead;    //keep the record that closes an event for the next, rather than reading it again
+
+    double ioTime;      //time (s) spent reading the listmode file
+    double ioStall;     //prefetch thread waiting for the decoder to free a block
+    double decodeStall; //decoder waiting for data to be read
     
     PIXIE::Trace::Algorithm *tracealg;
 
@@ -49,7 +83,7 @@ namespace PIXIE {
     };
 
     bool eof();
-    off_t offset() const;
+    off_t offset() const; //of the next record to go into an event, the lookahead if any (less those reordered)
     off_t set_offset(off_t s_offset);
     off_t update_filesize();
     bool check_pos();
@@ -58,13 +92,29 @@ namespace PIXIE {
     int set_algorithm(PIXIE::Trace::Algorithm *&alg);
 
     int open(const std::string &path);
+    int close();
+    bool drain(); //stop waiting for records that could go before those held, true if any are
+    int read_measurement(Measurement &meas, uint16_t *outTrace=NULL);
+    /* Events handed out by the vector overload keep their hits and
+       traces in the arena, so they are only valid until the next read() */
     int read(std::vector<Event> &events,
              int               coincWindow,
              int               max,
              off_t             max_offset,
              bool              warnings);
+    //as above, appending the events to a batch of hit columns
+    int read(HitBatch         &hits,
+             int               coincWindow,
+             int               max,
+             off_t             max_offset,
+             bool              warnings);
     int dump_traces(int crate, int slot, int chan, std::string outPath, int maxTraces, int append, std::string traceName);
 
+  private:
+    template <typename Output>
+    int read_events(Output &out, int coincWindow, int max, off_t max_offset, bool warnings);
+
+  public:
     void start() {
       eventsread = 0;
       time(&starttime);
@@ -0,0 +1,174 @@
+/* libpixie reorder buffer of decoded records */
+
+#include <algorithm>
+
+#include "reorder_buffer.hh"
+
+namespace PIXIE {
+  ReorderBuffer::ReorderBuffer() :
+    fWindow(0),
+    fShift(0),
+    fFloor(0),
+    fNewest(0),
+    fLast(0),
+    fStarted(false),
+    fTop(-1),
+    fNext(0),
+    fPending(false),
+    fCount(0),
+    fBytes(0),
+    fForced(false),
+    maxHeld(1<<22),
+    maxDisorder(0),
+    reordered(0),
+    late(0),
+    forced(0),
+    peak(0)
+  {
+    set_window(0);
+  }
+
+  void ReorderBuffer::set_window(uint64_t window) {
+    clear();
+    //about a thousand buckets over the window, and a spare one at each end
+    fWindow = window;
+    fShift = 0;
+    while ((uint64_t(1024)<<fShift) < window) {
+      ++fShift;
+    }
+    size_t buckets = 1;
+    while (buckets < (window>>fShift) + 2) {
+      buckets <<= 1;
+    }
+    fRing.assign(buckets, std::vector<uint32_t>());
+  }
+
+  void ReorderBuffer::clear() {
+    for (auto &bucket : fRing) {
+      fFree.insert(fFree.end(), bucket.begin(), bucket.end());
+      bucket.clear();
+    }
+    fFloor = 0;
+    fNewest = 0;
+    fLast = 0;
+    fStarted = false;
+    fTop = -1;
+    fCount = 0;
+    fBytes = 0;
+    fForced = false;
+  }
+
+  Measurement &ReorderBuffer::slot() {
+    if (!fPending && fFree.empty()) {
+      fNext = fSlots.size();
+      fSlots.emplace_back();
+      fKeys.push_back(0);
+    }
+    else if (!fPending) {
+      fNext = fFree.back();
+      fFree.pop_back();
+    }
+    fPending = true;
+    fSlots[fNext].reset(); //the slot's trace memory is kept for the next record
+    return fSlots[fNext];
+  }
+
+  void ReorderBuffer::push() {
+    fPending = false;
+    const Measurement &meas = fSlots[fNext];
+    uint64_t time = meas.eventTime;
+    if ((fCount || fStarted) && time < fNewest) {
+      ++reordered;
+      maxDisorder = std::max(maxDisorder, fNewest - time);
+    }
+    if (time > fNewest || (!fCount && !fStarted)) {
+      fNewest = time;
+    }
+
+    //too late to go where it belongs, it goes out next
+    uint64_t key = time;
+    if (fStarted && time < fLast) {
+      ++late;
+      key = fLast;
+    }
+    fKeys[fNext] = key;
+
+    uint64_t bucket = key>>fShift;
+    if (!fCount || bucket < fFloor) {
+      fFloor = bucket;
+    }
+    fRing[bucket & (fRing.size()-1)].push_back(fNext);
+    if (fTop >= 0 && key < fKeys[fTop]) {
+      fTop = -1;
+    }
+    fBytes += 4*(size_t)meas.eventLength;
+    peak = std::max(peak, ++fCount);
+  }
+
+  int ReorderBuffer::find_top() {
+    if (fTop >= 0 || !fCount) {
+      return fTop;
+    }
+    size_t mask = fRing.size()-1;
+    for (size_t k=0; k<fRing.size(); ++k) {
+      uint64_t bucket = fFloor + k;
+      int best = -1;
+      for (uint32_t s : fRing[bucket & mask]) {
+        //the bucket also holds records a whole turn of the ring later
+        if ((fKeys[s]>>fShift) == bucket && (best < 0 || fKeys[s] < fKeys[best])) {
+          best = s;
+        }
+      }
+      if (best >= 0) {
+        fFloor = bucket;
+        fTop = best;
+        return fTop;
+      }
+    }
+
+    //everything held is more than a ring ahead: start the ring again from it
+    uint64_t earliest = UINT64_MAX;
+    for (auto &bucket : fRing) {
+      for (uint32_t s : bucket) {
+        earliest = std::min(earliest, fKeys[s]);
+      }
+    }
+    fFloor = earliest>>fShift;
+    return find_top();
+  }
+
+  bool ReorderBuffer::ready(bool draining) {
+    fForced = false;
+    if (!fCount) {
+      return false;
+    }
+    if (draining || fKeys[find_top()] + fWindow <= fNewest) {
+      return true;
+    }
+    if (fCount >= maxHeld) {
+      fForced = true;
+      return true;
+    }
+    return false;
+  }
+
+  const Measurement &ReorderBuffer::top() {
+    return fSlots[find_top()];
+  }
+
+  void ReorderBuffer::pop() {
+    int s = find_top();
+    std::vector<uint32_t> &bucket = fRing[fFloor & (fRing.size()-1)];
+    bucket.erase(std::find(bucket.begin(), bucket.end(), (uint32_t)s));
+    fLast = fKeys[s];
+    fStarted = true;
+    fBytes -= 4*(size_t)fSlots[s].eventLength;
+    --fCount;
+    fFree.push_back(s);
+    fTop = -1;
+    if (fForced) {
+      ++forced;
+      fForced = false;
+    }
+  }
+} // namespace PIXIE
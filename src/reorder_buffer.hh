@@ -0,0 +1,78 @@
+// -*-c++-*-
+/* libpixie reorder buffer of decoded records, ahead of event building */
+
+#ifndef LIBPIXIE_REORDER_BUFFER_H
+#define LIBPIXIE_REORDER_BUFFER_H
+
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+#include "measurement.hh"
+
+namespace PIXIE {
+  /* Decoded records held until nothing earlier can still arrive, so that
+     events are built from them in time order.  Records go into a ring of
+     buckets by eventTime, each bucket covering a fixed slice of time and
+     the ring the whole window, so finding the earliest is a scan of the
+     next few buckets and one small bucket.  The earliest record is
+     ready once one at least window later has been pushed (or when
+     draining), and the buffer never holds much more than a window of
+     data: memory follows the window, not the file.
+
+     A record arriving after one later than it has gone out is late: it
+     goes out next, out of order.  Statistics: maxDisorder is the most any
+     record was behind the latest before it (eventTime units), reordered
+     the records that arrived behind it. */
+  class ReorderBuffer {
+  private:
+    std::vector<Measurement> fSlots;           //records held, and spares
+    std::vector<uint64_t> fKeys;               //time each slot is ordered by
+    std::vector<uint32_t> fFree;
+    std::vector<std::vector<uint32_t>> fRing;  //slots by key, in arrival order
+    uint64_t fWindow;
+    int fShift;          //a bucket is 2^fShift of eventTime
+    uint64_t fFloor;     //bucket number of the earliest record (or below it)
+    uint64_t fNewest;    //latest eventTime pushed
+    uint64_t fLast;      //eventTime of the last record popped
+    bool fStarted;       //something has been popped since the last clear()
+    int fTop;            //slot of the earliest record, -1 = not found yet
+    uint32_t fNext;      //slot handed out by slot()
+    bool fPending;       //and not yet pushed, so slot() hands it out again
+    size_t fCount;
+    size_t fBytes;
+    bool fForced;        //ready() only because the buffer is full
+
+    int find_top();
+
+  public:
+    size_t maxHeld;          //records held before the earliest is forced out
+    uint64_t maxDisorder;
+    long long reordered;
+    long long late;
+    long long forced;
+    size_t peak;             //most records held at once
+
+  public:
+    ReorderBuffer();
+
+    void set_window(uint64_t window);
+    uint64_t window() const { return fWindow; }
+    //drops everything held, the statistics stay
+    void clear();
+    size_t size() const { return fCount; }
+    bool empty() const { return fCount == 0; }
+    //listmode bytes of the records held
+    size_t bytes() const { return fBytes; }
+
+    //an empty record to decode the next one into, then push() it
+    Measurement &slot();
+    void push();
+    //the earliest record can go out, all of them when draining
+    bool ready(bool draining);
+    const Measurement &top();
+    void pop();
+  };
+} // namespace PIXIE
+
+#endif //LIBPIXIE_REORDER_BUFFER_H
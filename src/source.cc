@@ -0,0 +1,462 @@
+/* libpixie input sources */
+
+#include <iostream>
+#include <chrono>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "source.hh"
+
+namespace PIXIE
+{
+  namespace {
+    double seconds_since(std::chrono::steady_clock::time_point start) {
+      return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+  }
+
+  off_t Source::update_filesize()
+  {
+    struct stat stat;
+    if (fstat(this->fd, &stat) != 0)
+      std::cout << "Couldn't stat" << std::endl;
+
+    this->fileLength = stat.st_size;
+    return(this->fileLength);
+  }
+
+  int MappedSource::open(const std::string &path)
+  {
+    if (this->fd >= 0) {
+      return (-1); //file has already been opened
+    }
+
+    if ((this->fd = ::open(path.c_str(), O_RDONLY)) < 0) {
+      return (-2);
+    }
+
+    return (remap());
+  }
+
+  int MappedSource::close()
+  {
+    if (fMap) {
+      munmap(fMap, fMapLength);
+      fMap = nullptr;
+      fMapLength = 0;
+    }
+    if (this->fd >= 0) {
+      ::close(this->fd);
+      this->fd = -1;
+    }
+    fBegin = fCur = fEnd = nullptr;
+    return 0;
+  }
+
+  int MappedSource::remap()
+  {
+    off_t pos = offset();
+    update_filesize();
+
+    if (fMap) {
+      munmap(fMap, fMapLength);
+      fMap = nullptr;
+      fMapLength = 0;
+    }
+
+    if (this->fileLength > 0) {
+      void *map = mmap(nullptr, this->fileLength, PROT_READ, MAP_SHARED, this->fd, 0);
+      if (map == MAP_FAILED) {
+        std::cout << "Couldn't map listmode file" << std::endl;
+        fBegin = fCur = fEnd = nullptr;
+        return (-3);
+      }
+      madvise(map, this->fileLength, MADV_SEQUENTIAL);
+      fMap = map;
+      fMapLength = this->fileLength;
+    }
+
+    fBegin = static_cast<const char*>(fMap);
+    fEnd = fBegin + fMapLength;
+    fCur = fBegin + (pos < (off_t)fMapLength ? pos : fMapLength);
+    fWindowOffset = 0;
+    return (0);
+  }
+
+  bool MappedSource::fill(size_t nbytes)
+  {
+    //the whole file is mapped, so we can only run short if it has grown
+    if (update_filesize() > (off_t)fMapLength) {
+      if (remap() < 0) { return false; }
+    }
+    return ((size_t)(fEnd - fCur) >= nbytes);
+  }
+
+  off_t MappedSource::seek(off_t offset)
+  {
+    if (offset > (off_t)fMapLength) {
+      remap();
+    }
+    if (offset > (off_t)fMapLength) {
+      offset = fMapLength;
+    }
+    fCur = fBegin + offset;
+    return offset;
+  }
+
+  ChunkReads::ChunkReads(size_t chunkSize, bool direct) :
+    direct(direct)
+  {
+    //both the headroom and the chunk must keep reads aligned for O_DIRECT
+    headroom = (kMaxRecord + kAlignment - 1)/kAlignment*kAlignment;
+    if (chunkSize < headroom) { chunkSize = headroom; }
+    this->chunkSize = (chunkSize + kAlignment - 1)/kAlignment*kAlignment;
+  }
+
+  int ChunkReads::open(const std::string &path)
+  {
+    int fd = -1;
+    if (direct) {
+      fd = ::open(path.c_str(), O_RDONLY | O_DIRECT);
+      if (fd < 0) {
+        std::cout << "O_DIRECT not supported for " << path << ", using buffered reads" << std::endl;
+        direct = false;
+      }
+    }
+    if (fd < 0 && (fd = ::open(path.c_str(), O_RDONLY)) < 0) {
+      return (-1);
+    }
+    if (!direct) {
+      posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    return fd;
+  }
+
+  char *ChunkReads::allocate() const
+  {
+    char *buffer;
+    if (posix_memalign((void**)&buffer, kAlignment, headroom + chunkSize) != 0) {
+      return nullptr;
+    }
+    return buffer;
+  }
+
+  ssize_t ChunkReads::read(int fd, char *buffer, off_t offset)
+  {
+    char *chunk = buffer + headroom;
+    ssize_t got = pread(fd, chunk, chunkSize, offset);
+    if (got < 0 && errno == EINVAL && direct) {
+      //filesystem refused the direct read (an unaligned tail), carry on buffered
+      fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+      direct = false;
+      got = pread(fd, chunk, chunkSize, offset);
+    }
+    return got;
+  }
+
+  BlockReader::BlockReader(size_t chunkSize, bool direct) :
+    fBuffer(nullptr),
+    fReads(chunkSize, direct)
+  {
+  }
+
+  BlockReader::~BlockReader()
+  {
+    close();
+    free(fBuffer);
+  }
+
+  int BlockReader::open(const std::string &path)
+  {
+    if (this->fd >= 0) {
+      return (-1); //file has already been opened
+    }
+
+    if ((this->fd = fReads.open(path)) < 0) {
+      return (-2);
+    }
+
+    if (!fBuffer && !(fBuffer = fReads.allocate())) {
+      return (-3);
+    }
+
+    update_filesize();
+    seek(0);
+    return (0);
+  }
+
+  int BlockReader::close()
+  {
+    if (this->fd >= 0) {
+      ::close(this->fd);
+      this->fd = -1;
+    }
+    return 0;
+  }
+
+  bool BlockReader::fill(size_t nbytes)
+  {
+    if (this->fd < 0 || nbytes > fReads.headroom) {
+      return false;
+    }
+
+    off_t cur_off = offset();
+    off_t end_off = fWindowOffset + (fEnd - fBegin);
+
+    //continue reading where the window ends, from an aligned position
+    off_t read_from = end_off/kAlignment*kAlignment;
+    if (read_from < cur_off) {
+      read_from = cur_off/kAlignment*kAlignment;
+    }
+
+    //keep the unread bytes before read_from, placed right in front of the chunk
+    size_t keep = (read_from > cur_off) ? read_from - cur_off : 0;
+    char *chunk = fBuffer + fReads.headroom;
+    memmove(chunk - keep, fCur, keep);
+
+    auto start = std::chrono::steady_clock::now();
+    ssize_t got = fReads.read(this->fd, fBuffer, read_from);
+    if (got < 0) {
+      got = 0;
+    }
+    //reads are synchronous, so decoding waits for all of them
+    double elapsed = seconds_since(start);
+    ioTime += elapsed;
+    decodeStall += elapsed;
+
+    fBegin = chunk - keep;
+    fWindowOffset = read_from - keep;
+    fCur = fBegin + (cur_off - fWindowOffset);
+    fEnd = chunk + got;
+    if (fCur > fEnd) {
+      fCur = fEnd;
+    }
+
+    return ((size_t)(fEnd - fCur) >= nbytes);
+  }
+
+  off_t BlockReader::seek(off_t offset)
+  {
+    off_t end_off = fWindowOffset + (fEnd - fBegin);
+    if (fBegin && offset >= fWindowOffset && offset <= end_off) {
+      //still inside the buffered window
+      fCur = fBegin + (offset - fWindowOffset);
+      return offset;
+    }
+
+    //drop the window, the next peek() reads from the new position
+    fBegin = fCur = fEnd = fBuffer + fReads.headroom;
+    fWindowOffset = offset;
+    return offset;
+  }
+
+  PrefetchReader::PrefetchReader(size_t chunkSize, int depth, bool direct) :
+    fReads(chunkSize, direct),
+    fDepth(depth < 1 ? 1 : depth),
+    fCurrent(nullptr),
+    fFinished(false),
+    fStop(false),
+    fReadFrom(0),
+    fLimit(-1)
+  {
+  }
+
+  PrefetchReader::~PrefetchReader()
+  {
+    close();
+    for (auto buffer : fBuffers) {
+      free(buffer);
+    }
+  }
+
+  int PrefetchReader::open(const std::string &path)
+  {
+    if (this->fd >= 0) {
+      return (-1); //file has already been opened
+    }
+
+    if ((this->fd = fReads.open(path)) < 0) {
+      return (-2);
+    }
+
+    //one buffer being decoded plus depth queued up behind it
+    while ((int)fBuffers.size() < fDepth + 1) {
+      char *buffer = fReads.allocate();
+      if (!buffer) {
+        return (-3);
+      }
+      fBuffers.push_back(buffer);
+    }
+
+    update_filesize();
+    seek(0);
+    return (0);
+  }
+
+  int PrefetchReader::close()
+  {
+    stop();
+    if (this->fd >= 0) {
+      ::close(this->fd);
+      this->fd = -1;
+    }
+    return 0;
+  }
+
+  void PrefetchReader::start(off_t from)
+  {
+    fStop = false;
+    fFinished = false;
+    fReadFrom = from;
+    fFilled.clear();
+    fFree.clear();
+    for (auto buffer : fBuffers) {
+      if (buffer != fCurrent) {
+        fFree.push_back(buffer);
+      }
+    }
+    fThread = std::thread(&PrefetchReader::prefetch, this);
+  }
+
+  void PrefetchReader::stop()
+  {
+    if (!fThread.joinable()) {
+      return;
+    }
+    {
+      std::lock_guard<std::mutex> lock(fMutex);
+      fStop = true;
+    }
+    fCond.notify_all();
+    fThread.join();
+    fFilled.clear();
+  }
+
+  void PrefetchReader::prefetch()
+  {
+    off_t pos = fReadFrom;
+    while (true) {
+      char *buffer;
+      {
+        std::unique_lock<std::mutex> lock(fMutex);
+        auto start = std::chrono::steady_clock::now();
+        fCond.wait(lock, [this] { return fStop || !fFree.empty(); });
+        ioStall += seconds_since(start);
+        if (fStop) {
+          return;
+        }
+        off_t limit = fLimit;
+        if (limit > 0 && pos >= limit) {
+          fFinished = true;
+          fCond.notify_all();
+          return;
+        }
+        buffer = fFree.front();
+        fFree.pop_front();
+      }
+
+      auto start = std::chrono::steady_clock::now();
+      ssize_t got = fReads.read(this->fd, buffer, pos);
+      double elapsed = seconds_since(start);
+
+      std::lock_guard<std::mutex> lock(fMutex);
+      ioTime += elapsed;
+      if (got > 0) {
+        fFilled.push_back({buffer, pos, (size_t)got});
+        pos += got;
+      }
+      else {
+        fFree.push_back(buffer);
+      }
+      //a short read means we have reached the end of the file (for now)
+      if (got < (ssize_t)fReads.chunkSize) {
+        fFinished = true;
+      }
+      fCond.notify_all();
+      if (fFinished) {
+        return;
+      }
+    }
+  }
+
+  bool PrefetchReader::fill(size_t nbytes)
+  {
+    if (this->fd < 0 || nbytes > fReads.headroom) {
+      return false;
+    }
+
+    while ((size_t)(fEnd - fCur) < nbytes) {
+      off_t cur_off = offset();
+      off_t end_off = fWindowOffset + (fEnd - fBegin);
+      off_t read_from = end_off/BlockReader::kAlignment*BlockReader::kAlignment;
+      if (read_from < cur_off) {
+        read_from = cur_off/BlockReader::kAlignment*BlockReader::kAlignment;
+      }
+
+      if (!fThread.joinable()) {
+        start(read_from);
+      }
+
+      Chunk chunk;
+      {
+        std::unique_lock<std::mutex> lock(fMutex);
+        auto start = std::chrono::steady_clock::now();
+        fCond.wait(lock, [this] { return fFinished || !fFilled.empty(); });
+        decodeStall += seconds_since(start);
+        if (fFilled.empty()) {
+          lock.unlock();
+          //the file may have grown since (live mode), otherwise we're done
+          stop();
+          off_t limit = fLimit;
+          if ((limit > 0 && end_off >= limit) || update_filesize() <= end_off) {
+            return false;
+          }
+          continue;
+        }
+        chunk = fFilled.front();
+        fFilled.pop_front();
+      }
+
+      //bring the unread tail of the window in front of the new chunk
+      size_t keep = (chunk.offset > cur_off) ? chunk.offset - cur_off : 0;
+      char *data = chunk.buffer + fReads.headroom;
+      memcpy(data - keep, fCur, keep);
+
+      if (fCurrent) {
+        std::lock_guard<std::mutex> lock(fMutex);
+        fFree.push_back(fCurrent);
+        fCond.notify_all();
+      }
+      fCurrent = chunk.buffer;
+
+      fBegin = data - keep;
+      fWindowOffset = chunk.offset - keep;
+      fCur = fBegin + (cur_off - fWindowOffset);
+      fEnd = data + chunk.length;
+      if (fCur > fEnd) {
+        fCur = fEnd;
+      }
+    }
+    return true;
+  }
+
+  off_t PrefetchReader::seek(off_t offset)
+  {
+    off_t end_off = fWindowOffset + (fEnd - fBegin);
+    if (fBegin && offset >= fWindowOffset && offset <= end_off) {
+      fCur = fBegin + (offset - fWindowOffset);
+      return offset;
+    }
+
+    stop();
+    fCurrent = nullptr;
+    fBegin = fCur = fEnd = nullptr;
+    fWindowOffset = offset;
+    return offset;
+  }
+}//PIXIE
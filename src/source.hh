@@ -0,0 +1,189 @@
+// -*-c++-*-
+/* libpixie input sources: cursor-based access to listmode data */
+
+#ifndef LIBPIXIE_SOURCE_H
+#define LIBPIXIE_SOURCE_H
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+#include <deque>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include <sys/types.h>
+
+namespace PIXIE {
+  /* A Source holds a window of the listmode file in memory and hands out
+     pointers into it.  peek() makes a number of words available at the
+     cursor (refilling the window if needed) and commit() advances past
+     them, so records are decoded in place without any per-word library
+     calls.  Pointers returned by peek() are only valid until the next
+     call to peek() or seek(). */
+  class Source {
+  protected:
+    const char *fBegin;    //start of the window held in memory
+    const char *fCur;      //read cursor
+    const char *fEnd;      //end of valid data in the window
+    off_t fWindowOffset;   //file offset of fBegin
+    int fd;
+
+    //make at least nbytes available at fCur, false if the file is too short
+    virtual bool fill(size_t nbytes) = 0;
+
+  public:
+    off_t fileLength;
+
+    //time (s) spent reading, I/O waiting on free buffers, decoding waiting on I/O
+    double ioTime;
+    double ioStall;
+    double decodeStall;
+
+  public:
+    Source() :
+      fBegin(nullptr),
+      fCur(nullptr),
+      fEnd(nullptr),
+      fWindowOffset(0),
+      fd(-1),
+      fileLength(0),
+      ioTime(0),
+      ioStall(0),
+      decodeStall(0) {}
+    virtual ~Source() {}
+
+    virtual int open(const std::string &path) = 0;
+    virtual int close() = 0;
+    virtual off_t seek(off_t offset) = 0;
+    virtual void set_limit(off_t limit) {} //no need to read beyond limit, <0 = whole file
+    virtual off_t update_filesize();
+
+    const uint32_t *peek(size_t nwords) {
+      size_t nbytes = nwords*4;
+      if ((size_t)(fEnd - fCur) < nbytes && !fill(nbytes)) {
+        return nullptr;
+      }
+      return reinterpret_cast<const uint32_t*>(fCur);
+    }
+    void commit(size_t nwords) { fCur += nwords*4; }
+
+    off_t offset() const { return fWindowOffset + (fCur - fBegin); }
+    bool eof() const { return offset() >= fileLength; }
+  };
+
+  /* Whole-file memory map, grown on demand when the file is still being
+     written (live mode). */
+  class MappedSource : public Source {
+  private:
+    void *fMap;
+    size_t fMapLength;
+
+    int remap();
+
+  protected:
+    bool fill(size_t nbytes);
+
+  public:
+    MappedSource() : fMap(nullptr), fMapLength(0) {}
+    ~MappedSource() { close(); }
+
+    int open(const std::string &path);
+    int close();
+    off_t seek(off_t offset);
+  };
+
+  /* The file side of BlockReader and PrefetchReader: opening it for
+     O_DIRECT reads if asked (buffered if that is refused), chunk and
+     headroom sizes that keep every read aligned, buffers of headroom
+     plus a chunk, and reading a chunk into one. */
+  class ChunkReads {
+  public:
+    static const size_t kAlignment = 4096;
+    static const size_t kMaxRecord = 0x3FFF*4; //largest eventLength, in bytes
+
+    size_t chunkSize;
+    size_t headroom;  //in front of each chunk, for a record straddling two
+    bool direct;
+
+  public:
+    ChunkReads(size_t chunkSize, bool direct);
+
+    int open(const std::string &path);  //the descriptor, <0 if it can't be opened
+    char *allocate() const;             //an aligned buffer, nullptr if none
+    ssize_t read(int fd, char *buffer, off_t offset); //a chunk from offset into buffer, after its headroom
+  };
+
+  /* Reads the file in large aligned chunks (optionally with O_DIRECT) into
+     one reusable buffer.  The buffer keeps a headroom in front of each
+     chunk so that the unread tail of the previous chunk - a record
+     straddling the boundary - can be moved in front of the new data and
+     decoded contiguously. */
+  class BlockReader : public Source {
+  private:
+    char *fBuffer;
+    ChunkReads fReads;
+
+  protected:
+    bool fill(size_t nbytes);
+
+  public:
+    static const size_t kAlignment = ChunkReads::kAlignment;
+    static const size_t kMaxRecord = ChunkReads::kMaxRecord;
+
+    BlockReader(size_t chunkSize = 4<<20, bool direct = false);
+    ~BlockReader();
+
+    int open(const std::string &path);
+    int close();
+    off_t seek(off_t offset);
+  };
+
+  /* BlockReader with the reading done ahead of time by a dedicated thread.
+     The thread fills up to depth chunks of [offset, limit) into a bounded
+     queue while the current chunk is being decoded; fill() swaps in the
+     next chunk, copying any straddling record into its headroom. */
+  class PrefetchReader : public Source {
+  private:
+    struct Chunk {
+      char *buffer;
+      off_t offset;
+      size_t length;
+    };
+
+    ChunkReads fReads;
+    int fDepth;
+
+    std::vector<char*> fBuffers;
+    std::deque<char*> fFree;     //buffers waiting for the reader thread
+    std::deque<Chunk> fFilled;   //chunks waiting for the decoder
+    char *fCurrent;              //buffer holding the current window
+    bool fFinished;              //reader thread hit the end of the file/limit
+
+    std::thread fThread;
+    std::mutex fMutex;
+    std::condition_variable fCond;
+    bool fStop;
+    off_t fReadFrom;
+    std::atomic<off_t> fLimit;
+
+    void prefetch();
+    void start(off_t from);
+    void stop();
+
+  protected:
+    bool fill(size_t nbytes);
+
+  public:
+    PrefetchReader(size_t chunkSize = 4<<20, int depth = 2, bool direct = false);
+    ~PrefetchReader();
+
+    int open(const std::string &path);
+    int close();
+    off_t seek(off_t offset);
+    void set_limit(off_t limit) { fLimit = limit; }
+  };
+} // namespace PIXIE
+
+#endif //LIBPIXIE_SOURCE_H
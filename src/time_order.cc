@@ -0,0 +1,213 @@
+/* libpixie streaming time-ordering of listmode records */
+
+#include <cstring>
+#include <iterator>
+
+#include "measurement.hh"
+#include "time_order.hh"
+
+namespace PIXIE {
+  TimeOrderer::TimeOrderer(Source *inner, Experiment_Definition &definition, uint64_t window) :
+    fInner(inner),
+    fDefinition(&definition),
+    fWindow(window),
+    fModules(256),
+    fBuffered(0),
+    fNewest(0),
+    fLast(0),
+    fStarted(false),
+    fOut(kTarget + 4*BlockReader::kMaxRecord),
+    live(false),
+    maxBuffered(1<<22),
+    late(0),
+    forced(0),
+    peak(0)
+  {
+    fBegin = fCur = fEnd = fOut.data();
+  }
+
+  TimeOrderer::~TimeOrderer()
+  {
+    delete fInner;
+  }
+
+  int TimeOrderer::open(const std::string &path)
+  {
+    if (fInner->open(path) < 0) {
+      return (-1);
+    }
+    this->fileLength = fInner->fileLength;
+    seek(0);
+    return (0);
+  }
+
+  int TimeOrderer::close()
+  {
+    int retval = fInner->close();
+    this->ioTime      = fInner->ioTime;
+    this->ioStall     = fInner->ioStall;
+    this->decodeStall = fInner->decodeStall;
+    return (retval);
+  }
+
+  off_t TimeOrderer::seek(off_t offset)
+  {
+    //whatever was held belongs to the old position
+    for (auto &module : fModules) {
+      for (const Entry &entry : module) {
+        fFree.push_back(entry.record);
+      }
+      module.clear();
+    }
+    fHeads = decltype(fHeads)();
+    fBuffered = 0;
+    fNewest = 0;
+    fLast = 0;
+    fStarted = false;
+
+    offset = fInner->seek(offset);
+    fWindowOffset = offset;
+    fBegin = fCur = fEnd = fOut.data();
+    return offset;
+  }
+
+  off_t TimeOrderer::update_filesize()
+  {
+    this->fileLength = fInner->update_filesize();
+    return (this->fileLength);
+  }
+
+  bool TimeOrderer::ingest()
+  {
+    const uint32_t *words = fInner->peek(1);
+    if (!words) {
+      return false;
+    }
+    uint32_t headerLength = Measurement::mHeaderLength(words[0]);
+    uint32_t eventLength = Measurement::mEventLength(words[0]);
+    if (headerLength < 4 || eventLength < headerLength || !(words = fInner->peek(eventLength))) {
+      return false; //a record still being written, or not a record: nothing to order past it
+    }
+
+    //only the time is needed, and without the warnings for unknown channels
+    uint64_t time;
+    if (fDefinition->Lookup(words[0]).channel) {
+      Measurement meas;
+      meas.decode(words, *fDefinition);
+      time = meas.eventTime;
+    }
+    else {
+      time = ((static_cast<uint64_t>(Measurement::mTimeHigh(words[2]))<<32) + Measurement::mTimeLow(words[1])) << 15;
+    }
+
+    uint32_t record;
+    if (fFree.empty()) {
+      record = fRecords.size();
+      fRecords.emplace_back();
+    }
+    else {
+      record = fFree.back();
+      fFree.pop_back();
+    }
+    fRecords[record].assign(words, words + eventLength);
+    fInner->commit(eventLength);
+
+    if (fStarted && time < fLast) {
+      ++late;
+    }
+    if (time > fNewest) {
+      fNewest = time;
+    }
+
+    //records of a module are nearly in order, so look for the place from the back
+    uint32_t id = Measurement::mCrateID(words[0])<<4 | Measurement::mSlotID(words[0]);
+    std::deque<Entry> &module = fModules[id];
+    auto pos = module.end();
+    while (pos != module.begin() && std::prev(pos)->time > time) {
+      --pos;
+    }
+    if (pos == module.begin()) {
+      fHeads.push(Head(time, id)); //a new head, any old one is now stale
+    }
+    module.insert(pos, Entry{time, record});
+
+    if (++fBuffered > peak) {
+      peak = fBuffered;
+    }
+    return true;
+  }
+
+  int TimeOrderer::next()
+  {
+    bool exhausted = false;
+    while (true) {
+      //heads that have gone out or been overtaken
+      while (!fHeads.empty()) {
+        const Head &head = fHeads.top();
+        const std::deque<Entry> &module = fModules[head.second];
+        if (!module.empty() && module.front().time == head.first) {
+          break;
+        }
+        fHeads.pop();
+      }
+
+      if (!fHeads.empty()) {
+        Head head = fHeads.top();
+        bool ready = exhausted || head.first + fWindow <= fNewest;
+        if (!ready && fBuffered >= maxBuffered) {
+          ready = true;
+          ++forced;
+        }
+        if (ready) {
+          fHeads.pop();
+          std::deque<Entry> &module = fModules[head.second];
+          uint32_t record = module.front().record;
+          module.pop_front();
+          if (!module.empty()) {
+            fHeads.push(Head(module.front().time, head.second));
+          }
+          --fBuffered;
+          fLast = head.first;
+          fStarted = true;
+          return record;
+        }
+      }
+      if (exhausted) {
+        return -1;
+      }
+      if (!ingest()) {
+        if (live) {
+          return -1; //more may be written, which could be earlier
+        }
+        exhausted = true; //the end of the data, nothing left to wait for
+      }
+    }
+  }
+
+  bool TimeOrderer::fill(size_t nbytes)
+  {
+    //move the unread tail to the front and order records in behind it
+    size_t used = fEnd - fCur;
+    fWindowOffset += fCur - fBegin;
+    memmove(fOut.data(), fCur, used);
+
+    while (used < nbytes || used < kTarget) {
+      int record = next();
+      if (record < 0) {
+        break;
+      }
+      std::vector<uint32_t> &words = fRecords[record];
+      size_t length = 4*words.size();
+      if (used + length > fOut.size()) {
+        fOut.resize(used + length);
+      }
+      memcpy(fOut.data() + used, words.data(), length);
+      used += length;
+      fFree.push_back(record);
+    }
+
+    fBegin = fCur = fOut.data();
+    fEnd = fBegin + used;
+    return (used >= nbytes);
+  }
+} // namespace PIXIE
@@ -0,0 +1,80 @@
+// -*-c++-*-
+/* libpixie streaming time-ordering of listmode records */
+
+#ifndef LIBPIXIE_TIME_ORDER_H
+#define LIBPIXIE_TIME_ORDER_H
+
+#include <deque>
+#include <queue>
+#include <vector>
+#include <utility>
+#include <functional>
+#include <cstdint>
+#include <cstddef>
+
+#include "experiment_definition.hh"
+#include "source.hh"
+
+namespace PIXIE {
+  /* A Source handing out the records of another one in time order.  Each
+     module (crate/slot) writes its records nearly in order, so records
+     are kept sorted per module and merged through a heap of the module
+     heads: the earliest record goes out once a record at least window
+     later has been read, as nothing earlier should still turn up.  One
+     that does is counted in late (and goes out as soon as possible);
+     when maxBuffered records are held the earliest goes out regardless,
+     counted in forced.  Offsets count the bytes handed out, so they run
+     over the same range as the file but not over the same records: the
+     stream can only be read from the start (or the end) as a whole. */
+  class TimeOrderer : public Source {
+  private:
+    struct Entry {
+      uint64_t time;
+      uint32_t record; //in fRecords
+    };
+    typedef std::pair<uint64_t, uint32_t> Head; //time, module
+
+    Source *fInner;
+    Experiment_Definition *fDefinition;
+    uint64_t fWindow;
+
+    std::vector<std::deque<Entry>> fModules; //by crate<<4 | slot, each sorted by time
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> fHeads; //may hold stale heads
+    std::vector<std::vector<uint32_t>> fRecords; //words of the records held, reused
+    std::vector<uint32_t> fFree;                 //records not in use
+    size_t fBuffered;
+    uint64_t fNewest;  //latest time read
+    uint64_t fLast;    //time of the last record handed out
+    bool fStarted;     //something has been handed out since the last seek
+
+    std::vector<char> fOut; //the window handed out by peek()
+
+    bool ingest();
+    int next();
+
+  protected:
+    bool fill(size_t nbytes);
+
+  public:
+    static const size_t kTarget = 1<<16; //bytes ordered per fill
+
+    bool live;          //input may grow, so only the window makes a record safe to hand out
+    size_t maxBuffered; //records held before the earliest is forced out
+    long long late;     //records earlier than one already handed out
+    long long forced;   //records handed out before the window had passed
+    size_t peak;        //most records held at once
+
+  public:
+    //takes ownership of inner; window in the units of Measurement::eventTime
+    TimeOrderer(Source *inner, Experiment_Definition &definition, uint64_t window);
+    ~TimeOrderer();
+
+    int open(const std::string &path);
+    int close();
+    off_t seek(off_t offset);
+    void set_limit(off_t limit) {} //ordered offsets aren't file offsets, read everything
+    off_t update_filesize();
+  };
+} // namespace PIXIE
+
+#endif //LIBPIXIE_TIME_ORDER_H
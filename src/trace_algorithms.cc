@@ -6,6 +6,7 @@
 #include <string>
 #include <vector>
 #include <cmath>
+#include <algorithm>
 
 /* EXTERM*/
 #include "TROOT.h"
@@ -34,6 +35,7 @@ namespace PIXIE {
       return -1;
     }
     tracealg->Load(algFile.c_str(), algIndex);
+    tracealg->Width(); //cached now, before threads share the object
     return 0;
   }
   
@@ -79,13 +81,11 @@ namespace PIXIE {
       return retval;
     }
 
-    std::vector<Measurement> Trapezoid::Process(uint16_t *trace, int length) {
-      std::vector<Measurement> retval;
-      retval = Trapezoid::TrapFilter(trace, length);
-      return retval;
+    int Trapezoid::Process(const uint16_t *trace, int length, int32_t *out) {
+      return Trapezoid::TrapFilter(trace, length, out);
     }
 
-    double Trapezoid::GetBaseline(uint16_t *trace, int length) {
+    double Trapezoid::GetBaseline(const uint16_t *trace, int length) {
       double mean=0;
       //Baseline - get a better algorithm for this                              
       for (int k=0;k<40;k++) {
@@ -95,22 +95,31 @@ namespace PIXIE {
 
       return mean;
     }
-    std::vector<Measurement> Trapezoid::TrapFilter(uint16_t *trace, int length,int write) {
+    int Trapezoid::TrapFilter(const uint16_t *trace, int length, int32_t *out, int write) {
 
       good_trace = false;
-      std::vector<Measurement> retval;
       int P;
       double M;
-      float BL[length];//={0};
-      float CFD[length];//={0};
-      float sD[length];//={0};
-      float sP[length];//={0};
-      float sR[length];//={0};
-      float sTrap[length];//={0};
-      float fD[length];//={0};
-      float fP[length];//={0};
-      float fR[length];//={0};
-      float fTrap[length];//={0};
+
+      //the ten stages, each behind enough zeros for the look-backs below; one
+      //buffer per thread, grown to the longest trace seen, as threads share this object
+      static thread_local std::vector<float> scratch;
+      int pad = std::max({D, 1, sG + 2*sL, fG + 2*fL});
+      size_t stride = pad + length;
+      if (scratch.size() < 10*stride) {
+        scratch.resize(10*stride);
+      }
+      std::fill(scratch.begin(), scratch.begin() + 10*stride, 0);
+      float *BL = &scratch[0*stride + pad];
+      float *CFD = &scratch[1*stride + pad];
+      float *sD = &scratch[2*stride + pad];
+      float *sP = &scratch[3*stride + pad];
+      float *sR = &scratch[4*stride + pad];
+      float *sTrap = &scratch[5*stride + pad];
+      float *fD = &scratch[6*stride + pad];
+      float *fP = &scratch[7*stride + pad];
+      float *fR = &scratch[8*stride + pad];
+      float *fTrap = &scratch[9*stride + pad];
 
       int TCP = -1;
       int ZCP = -1;
@@ -166,19 +175,12 @@ namespace PIXIE {
         }
       }
 
-      Measurement tcp("TraceTCP", TCP);
-      retval.push_back(tcp);
+      out[0] = TCP;                   //TraceTCP
+      out[1] = ZCP;                   //TraceZCP
+      out[2] = cfd_frac;              //TraceCFD
+      out[3] = sTrap[TCP + sL + sG -1]; //TraceEnergy
       
-      Measurement zcp("TraceZCP", ZCP);
-      retval.push_back(zcp);
-      
-      Measurement cfd("TraceCFD", cfd_frac);
-      retval.push_back(cfd);
-      
-      Measurement en("TraceEnergy", sTrap[TCP + sL + sG -1]);
-      retval.push_back(en);
-      
-      if (tcp.datum > 0) { good_trace = true; }
+      if (TCP > 0) { good_trace = true; }
 
       if(write == 1){
 
@@ -214,7 +216,7 @@ namespace PIXIE {
         mgCFD->Write();
           
       }
-      return retval;
+      return 4;
     }
     
     int Trapezoid::dumpTrace(uint16_t *trace, int traceLen, int n_traces, std::string fileName, int append,std::string traceName){
@@ -232,7 +234,8 @@ namespace PIXIE {
         HTrace->AddBinContent(i,trace[i]-trace[0]);
       }
       HTrace->Write();
-      Trapezoid::TrapFilter(trace, traceLen,1);
+      int32_t datums[4];
+      Trapezoid::TrapFilter(trace, traceLen, datums, 1);
       
       //Close File
       outFile->Purge();
@@ -302,46 +305,42 @@ namespace PIXIE {
       return retval;
     }
     
-    std::vector<Measurement> TrapezoidQDC::Process(uint16_t *trace, int length) {
-      std::vector<Measurement> retval;
-      float BL[length];//={0};
-      double QDCSums[8];//={0};
+    int TrapezoidQDC::Process(const uint16_t *trace, int length, int32_t *out) {
+      double QDCSums[8]={0};
       int prevQDC=0;
       int currentQDC=0;
       
       double Q=0, QTime=0;
       
-      retval = Trapezoid::TrapFilter(trace, length);
+      Trapezoid::TrapFilter(trace, length, out);
       
       double mean = Trapezoid::GetBaseline(trace, length);
       
       for (int k=0;k<length;k++) {
-	BL[k]=trace[k]-mean;
+	float BL=trace[k]-mean;
 	
         //Get QDCSums
-	if ((k-prevQDC)>=QDCWindows[currentQDC]) {
+	if (currentQDC<8 && (k-prevQDC)>=QDCWindows[currentQDC]) {
 	  prevQDC+=QDCWindows[currentQDC];
 	  currentQDC+=1;
 	}
 	if (currentQDC<8){	  
-	  QDCSums[currentQDC]+=BL[k];
+	  QDCSums[currentQDC]+=BL;
         }
 
 	//Get QTime
-	Q+=BL[k];
-	QTime += BL[k]*k;
+	Q+=BL;
+	QTime += BL*k;
       }
       QTime = QTime / Q;      
 
-      Measurement qtime("TraceQTime", (int16_t) QTime);
-      retval.push_back(qtime);
+      out[4] = (int16_t) QTime;       //TraceQTime
 
       double qdcT=0,qdcF=0,qdcS=0,qdcP;
       char *ptr;
       long int slowMask=strtol(stringSlow,&ptr,2), fastMask=strtol(stringFast,&ptr,2);
       for (int i=0; i<8; ++i) {
-	Measurement qdc("TraceQDC"+std::to_string(i), round(QDCSums[i]));
-        retval.push_back(qdc);
+        out[5+i] = round(QDCSums[i]); //TraceQDC0-7
         if(slowMask & (1<<(7-i))){
           qdcS += round(QDCSums[i]);
         }
@@ -352,22 +351,15 @@ namespace PIXIE {
       }
       qdcP = qdcS/qdcF * 32768;
       
-      Measurement qdcFast("TraceQDCFast", qdcF);
-      retval.push_back(qdcFast);
-
-      Measurement qdcSlow("TraceQDCSlow", qdcS);
-      retval.push_back(qdcSlow);
-      
-      Measurement qdcPID("TraceQDCPID", qdcP  );
-      retval.push_back(qdcPID);
-
-      Measurement qdcTotal("TraceQDCTotal", qdcT);
-      retval.push_back(qdcTotal);
+      out[13] = qdcF;                 //TraceQDCFast
+      out[14] = qdcS;                 //TraceQDCSlow
+      out[15] = qdcP;                 //TraceQDCPID
+      out[16] = qdcT;                 //TraceQDCTot
 
       if (qdcT > enLo && qdcT < enHi && qdcP > pidLo && qdcP < pidHi) { good_trace = true; }
       else{good_trace=false;}      
 
-      return retval;
+      return 17;
     }
   
     int TrapezoidQDC::dumpTrace(uint16_t *trace, int traceLen, int n_traces, std::string fileName, int append,std::string traceName){
@@ -449,9 +441,8 @@ namespace PIXIE {
       return retval;
     }
 
-    std::vector<Measurement> PeakTail::Process(uint16_t *trace, int length) {
+    int PeakTail::Process(const uint16_t *trace, int length, int32_t *out) {
       good_trace = true;
-      std::vector<Measurement> retval;
       //actual trace processing
       float background = 0.0;
       for (int i=bLow; i<=bHigh; ++i) {
@@ -474,11 +465,11 @@ namespace PIXIE {
         tail += trace[i] - background;
       }
 
-      retval.emplace_back("energy", energy);
-      retval.emplace_back("peak", peak);
-      retval.emplace_back("tail", tail);
+      out[0] = energy;
+      out[1] = peak;
+      out[2] = tail;
 
-      return retval;
+      return 3;
     }
 
     int PeakTail::dumpTrace(uint16_t *trace, int traceLen, int n_traces, std::string fileName, int append,std::string traceName){
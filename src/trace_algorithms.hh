@@ -2,7 +2,7 @@
 
    You should edit/add to this file, the corresponding .cc file if you want to add your own algorithm.
 
-   Create a class that inherits from the PIXIE::Trace::Algorithm base class, and make sure you overload the Load, Process, and Prototype methods.  Load should take a settings file and load appropriate settings into your object.  Process is a method that actually processes the traces, outputting a vector PIXIE::Trace::Measurement objects - these must always be in the same order, and the method should always return the same number of them.  Prototype() returns an equivalent vector, but with no trace needed.  It is used only to determine how many measurements the particular algorithm returns, and get the names of the measurements for the Tree branch names.
+   Create a class that inherits from the PIXIE::Trace::Algorithm base class, and make sure you overload the Load, Process, and Prototype methods.  Load should take a settings file and load appropriate settings into your object.  Process is a method that actually processes the traces, writing its measurements as 32-bit ints into the array it is given - these must always be in the same order, and the method should always write the same number of them.  Prototype() returns a vector of PIXIE::Trace::Measurement objects describing that layout, with no trace needed.  It is used only to determine how many measurements the particular algorithm writes, and get the names of the measurements for the Tree branch names.  Process is called for every trace, so it shouldn't allocate: keep any working arrays and reuse them, thread_local as the reader threads share the algorithm objects (see Trapezoid::TrapFilter).
 
    You'll need to add to the makeOptions and setTraceAlg functions as well in order to process the command line arguments.  Hopefully replicating and adjusting the existing code is reasonbly straightforward - makeOptions creates args::ValueFlag objects with a name, description, and flag string. setTraceAlg actually creates the algorithm object according to which flag has been selected.
 
@@ -37,12 +37,12 @@ namespace PIXIE {
       float cfdThr;      
 
       void Load(const char *file, int index); //for loading parameters
-      std::vector<Measurement> Process(uint16_t *trace, int length); //pure virtual      
+      int Process(const uint16_t *trace, int length, int32_t *out);
       std::vector<Measurement> Prototype();
       int dumpTrace(uint16_t *trace, int traceLen, int n_traces, std::string fileName, int append,std::string traceName);
 
-      std::vector<Measurement> TrapFilter(uint16_t *trace, int length, int write = 0);
-      double  GetBaseline(uint16_t *trace, int length);
+      int TrapFilter(const uint16_t *trace, int length, int32_t *out, int write = 0); //writes the first 4 datums
+      double  GetBaseline(const uint16_t *trace, int length);
     };
 
     class TrapezoidQDC : public Trapezoid {  //trapezoid with QDC windows as well
@@ -53,7 +53,7 @@ namespace PIXIE {
       float pidLo=0,pidHi=999999999;
 
       void Load(const char *file, int index); //for loading parameters
-      std::vector<Measurement> Process(uint16_t *trace, int length); //pure virtual
+      int Process(const uint16_t *trace, int length, int32_t *out);
       std::vector<Measurement> Prototype();
       int dumpTrace(uint16_t *trace, int traceLen, int n_traces, std::string fileName, int append,std::string traceName);
     };
@@ -71,7 +71,7 @@ namespace PIXIE {
       int eHigh;
 
       void Load(const char *file, int index); //for loading parameters
-      std::vector<Measurement> Process(uint16_t *trace, int length); //pure virtual      
+      int Process(const uint16_t *trace, int length, int32_t *out);
       std::vector<Measurement> Prototype();
       int dumpTrace(uint16_t *trace, int traceLen, int n_traces, std::string fileName, int append,std::string traceName);
     };
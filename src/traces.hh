@@ -13,13 +13,23 @@ namespace PIXIE {
     };
 
     class Algorithm {
+    private:
+      int width=-1;
+
     public:
       bool good_trace;
       int loaded=false;
-      
+
+      virtual ~Algorithm() {}
       virtual void Load(const char *filename, int index) = 0; //for loading parameters
-      virtual std::vector<Measurement> Process(uint16_t *trace, int length) = 0; //pure virtual
-      virtual std::vector<Measurement> Prototype() = 0; //returns prototype - same size + names as Process() but with all datums = 0, used to initialise the tree
+      virtual int Process(const uint16_t *trace, int length, int32_t *out) = 0; //writes Width() datums to out in Prototype() order, returns how many; must not allocate
+      virtual std::vector<Measurement> Prototype() = 0; //returns prototype - names + layout of what Process() writes, with all datums = 0, used to initialise the tree
+      int Width() { //number of datums Process() writes
+        if (width < 0) {
+          width = Prototype().size();
+        }
+        return width;
+      }
       virtual int dumpTrace(uint16_t *trace, int traceLen, int n_traces, std::string fileName, int append,std::string traceName) = 0 ;
       
     };